@@ -0,0 +1,795 @@
+/**
+ * Microbenchmarks for the hot paths in dji-phantom.c
+ *
+ * Building and running:
+ * $ make bench
+ * $ ./dji-phantom-bench btea replay (only benchmarks whose name matches)
+ *
+ * The benchmarks are built against dji-phantom.c itself (without its
+ * main()) so that the static functions can be called directly.  Input
+ * is synthetic and generated the same way on every run, iteration
+ * counts are fixed, and decoded output goes to /dev/null through the
+ * regular output sinks.
+ */
+#define DJI_PHANTOM_NO_MAIN
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "dji-phantom.c"
+
+#define BENCH_BUFSZ FRAMER_BUFSZ
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *name, uint64_t ns, uint64_t ops, uint64_t bytes) {
+	printf("%-40s %10.1f ns/op %10.1f MB/s\n", name, (double)ns / ops,
+		bytes * 1000.0 / ns);
+}
+
+/* Keep the compiler from optimizing away results */
+static volatile uint64_t sink;
+
+/* The per-byte checksum loop read_packet() and send_packet() used to have */
+static uint8_t cksum_bytewise(const uint8_t *p, uint8_t len) {
+	uint8_t cksum, i;
+
+	for(i = cksum = 0; i < len; i++) cksum ^= p[i];
+	return cksum;
+}
+
+/* Fill buf with back to back valid frames of the given payload size */
+static size_t make_frames(uint8_t *buf, size_t size, int payload) {
+	size_t n = 0;
+	uint16_t seq = 0;
+	int i, len = 8 + payload;
+
+	while(n + len <= size) {
+		uint8_t *p = buf + n;
+
+		p[0] = DJI_PHANTOM_MAGIC & 0xff;
+		p[1] = DJI_PHANTOM_MAGIC >> 8;
+		p[2] = len;
+		p[3] = 0x4a;
+		p[4] = seq & 0xff;
+		p[5] = seq >> 8;
+		p[6] = 0x49;
+		for(i = 7; i < len - 1; i++) p[i] = i * 37 + seq;
+		p[len - 1] = cksum_bytewise(p, len - 1);
+		n += len;
+		seq++;
+	}
+
+	return n;
+}
+
+static void bench_cksum(void) {
+	static const int sizes[] = { 9, 24, 61, 255 };
+	uint8_t buf[256];
+	uint64_t t, iters = 10000000, i, acc = 0;
+	char name[64];
+	int s;
+
+	for(i = 0; i < sizeof(buf); i++) buf[i] = i * 13;
+	for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		t = now_ns();
+		for(i = 0; i < iters; i++) {
+			__asm__ volatile("" :: "r"(buf) : "memory");
+			acc += cksum_bytewise(buf, sizes[s]);
+		}
+		t = now_ns() - t;
+		snprintf(name, sizeof(name), "cksum bytewise, %d bytes", sizes[s]);
+		report(name, t, iters, iters * sizes[s]);
+
+		t = now_ns();
+		for(i = 0; i < iters; i++) {
+			__asm__ volatile("" :: "r"(buf) : "memory");
+			acc += cksum_xor(buf, sizes[s]);
+		}
+		t = now_ns() - t;
+		snprintf(name, sizeof(name), "cksum_xor, %d bytes", sizes[s]);
+		report(name, t, iters, iters * sizes[s]);
+	}
+
+	sink = acc;
+}
+
+/* Verify a buffer full of frames, one frame at a time as before */
+static int verify_bytewise(const uint8_t *buf, size_t len) {
+	size_t off = 0;
+	int n = 0;
+
+	while(len - off >= 9 && buf[off] == 0x55 && buf[off + 1] == 0xbb) {
+		if(cksum_bytewise(buf + off, buf[off + 2]) != 0)
+			break;
+		off += buf[off + 2];
+		n++;
+	}
+
+	return n;
+}
+
+static void bench_scan(void) {
+	static uint8_t buf[BENCH_BUFSZ];
+	static struct frame_span spans[BENCH_BUFSZ / 9];
+	static const int payloads[] = { 1, 16, 53 };
+	struct frame_stats st;
+	uint64_t t, iters = 2000, i, acc = 0;
+	size_t len, used;
+	char name[64];
+	int s;
+
+	for(s = 0; s < sizeof(payloads) / sizeof(payloads[0]); s++) {
+		len = make_frames(buf, sizeof(buf), payloads[s]);
+
+		t = now_ns();
+		for(i = 0; i < iters; i++)
+			acc += verify_bytewise(buf, len);
+		t = now_ns() - t;
+		snprintf(name, sizeof(name), "verify bytewise, %d byte payload", payloads[s]);
+		report(name, t, iters, iters * len);
+
+		t = now_ns();
+		for(i = 0; i < iters; i++)
+			acc += frame_scan(buf, len, spans, BENCH_BUFSZ / 9, &used, &st);
+		t = now_ns() - t;
+		snprintf(name, sizeof(name), "frame_scan, %d byte payload", payloads[s]);
+		report(name, t, iters, iters * len);
+	}
+
+	/* Resync through a buffer without any magic */
+	memset(buf, 0x55, sizeof(buf));
+	t = now_ns();
+	for(i = 0; i < iters; i++) {
+		const uint8_t *p = buf;
+
+		while((p = memchr(p, 0x55, buf + sizeof(buf) - p)) != NULL &&
+			p + 1 < buf + sizeof(buf) && p[1] != 0xbb)
+			p++;
+		acc += p != NULL;
+	}
+	t = now_ns() - t;
+	report("resync memchr loop, no magic", t, iters, iters * sizeof(buf));
+
+	t = now_ns();
+	for(i = 0; i < iters; i++)
+		acc += scan_magic(buf, buf + sizeof(buf)) - buf;
+	t = now_ns() - t;
+	report("scan_magic, no magic", t, iters, iters * sizeof(buf));
+
+	sink = acc;
+}
+
+/* Build a frame at p, as send_packet() does, and return its length */
+static int put_frame(uint8_t *p, uint8_t port, uint16_t seq, uint8_t cmd,
+		const uint8_t *data, int size) {
+	int len = 8 + size;
+
+	p[0] = DJI_PHANTOM_MAGIC & 0xff;
+	p[1] = DJI_PHANTOM_MAGIC >> 8;
+	p[2] = len;
+	p[3] = port;
+	p[4] = seq & 0xff;
+	p[5] = seq >> 8;
+	p[6] = cmd;
+	memcpy(p + 7, data, size);
+	p[len - 1] = cksum_xor(p, len - 1);
+	return len;
+}
+
+static void put_double(uint8_t *p, double d) {
+	memcpy(p, &d, sizeof(d));
+}
+
+static void put_float(uint8_t *p, float f) {
+	memcpy(p, &f, sizeof(f));
+}
+
+/**
+ * Ground station data as in 0x80 (from the app) or 0x81 (feedback)
+ * frames, with gscmd's fields where gs_decrypt_packet() looks for them.
+ * Returns the payload length.
+ */
+static int make_gs(uint8_t *d, uint8_t cmd, uint16_t seq, uint16_t gscmd) {
+	uint32_t buf[16];
+	uint8_t *p = (uint8_t *)buf, *q = d;
+	int words;
+
+	memset(buf, 0, sizeof(buf));
+	p[1] = seq & 0xff;
+	p[2] = seq >> 8;
+	p[3] = gscmd & 0xff;
+	p[4] = gscmd >> 8;
+	p += 5;
+	switch(gscmd) {
+	case 0x301:
+		p[3] = seq & 0xff;
+		p[7] = 1;
+		put_double(p + 8, 1.0355);
+		put_double(p + 16, 0.3153);
+		put_float(p + 24, 30);
+		put_float(p + 28, 5);
+		put_float(p + 34, 90);
+		words = 16;
+		break;
+	case 0x341:
+		p[9] = 1;
+		put_double(p + 23, 1.0355);
+		put_double(p + 31, 0.3153);
+		words = 13;
+		break;
+	default:
+		put_double(p + 15, 1.0355);
+		put_double(p + 23, 0.3153);
+		put_float(p + 31, 1.5);
+		words = 10;
+		break;
+	}
+
+	btea(buf, words, gs_key);
+	if(cmd == 0x81)
+		*q++ = 0;
+	q[0] = 2 + words * 4 + (cmd == 0x81? 4: 2);
+	q[1] = 0;
+	memcpy(q + 2, buf, words * 4);
+	q += 2 + words * 4;
+	/* Checksum, unknown, and the 0x81 footer */
+	*q++ = 0;
+	*q++ = 0;
+	if(cmd == 0x81) {
+		*q++ = 0xab;
+		*q++ = 0xcd;
+	}
+
+	return q - d;
+}
+
+/* A plausible reply payload for cmd, returns its length */
+static int make_payload(uint8_t *d, uint8_t cmd, uint16_t seq) {
+	int i;
+
+	memset(d, 0, 64);
+	switch(cmd) {
+	case 0x20:
+		memcpy(d, "\x14\x20\x07\x26\x07\x42\x59", 7);
+		return 7;
+	case 0x2d:
+	case 0x90:
+		return 2;
+	case 0x32:
+		put_double(d, 0.3153);
+		put_double(d + 8, 1.0355);
+		return 16;
+	case 0x41:
+		memcpy(d + 1, "FC200 v3.04     ", 16);
+		return 17;
+	case 0x49:
+		d[1] = 9;
+		put_double(d + 2, 0.3153);
+		put_double(d + 10, 1.0355);
+		put_double(d + 18, 0.3153 + seq * 1e-8);
+		put_double(d + 26, 1.0355 - seq * 1e-8);
+		d[38] = seq;
+		put_float(d + 40, 20 + (seq & 15));
+		d[48] = seq & 0xff;
+		d[49] = 1;
+		d[50] = 0xf0;
+		d[51] = 0x2e;
+		return 53;
+	case 0x52:
+		d[1] = seq & 3;
+		return 6;
+	case 0x53:
+		for(i = 1; i < 16; i++) d[i] = i * 37 + seq;
+		return 16;
+	case 0x80:
+		return make_gs(d, cmd, seq, 0x301);
+	case 0x81:
+		return make_gs(d, cmd, seq, seq & 1? 0x341: 0x342);
+	case 0xff:
+		d[0] = 0xe5;
+		return 1;
+	}
+
+	return 1;
+}
+
+/* Send decoded output to /dev/null in the given format */
+static void bench_output(const char *format) {
+	sink_close(out);
+	if(sink_open(out, "/dev/null", format, 0) < 0)
+		exit(1);
+}
+
+static const char *bench_formats[] = { "text", "json", "csv", "bin" };
+
+/* Frames from memory through the framer, as the live and replay paths do */
+static void bench_framer(void) {
+	static uint8_t buf[1 << 20];
+	static struct framer fr;
+	static const int payloads[] = { 1, 16, 53 };
+	uint64_t t, iters = 20, i, acc = 0;
+	size_t len, off;
+	struct pkt pkt;
+	char name[64];
+	int s;
+
+	bench_output("bin");
+	for(s = 0; s < sizeof(payloads) / sizeof(payloads[0]); s++) {
+		len = make_frames(buf, sizeof(buf), payloads[s]);
+		t = now_ns();
+		for(i = 0; i < iters; i++) {
+			framer_init(&fr);
+			for(off = 0; off < len; ) {
+				off += framer_feed(&fr, buf + off,
+					len - off < 4096? len - off: 4096);
+				while(framer_next(&fr, &pkt) != NULL)
+					acc++;
+			}
+		}
+		t = now_ns() - t;
+		snprintf(name, sizeof(name), "framer_next, %d byte payload", payloads[s]);
+		report(name, t, acc, iters * len);
+		acc = 0;
+	}
+}
+
+static const char hex_chars[] = "0123456789abcdef";
+
+static void hex_encode(char *dst, const uint8_t *src, size_t n) {
+	while(n--) {
+		*dst++ = hex_chars[*src >> 4];
+		*dst++ = hex_chars[*src++ & 15];
+	}
+	*dst = 0;
+}
+
+static void bench_hex(void) {
+	uint8_t data[256], frame[256];
+	char strs[3][600], name[64];
+	uint64_t t, iters = 1000000, i, acc = 0;
+	size_t lens[3];
+	struct pkt pkt;
+	int n, s;
+
+	bench_output("bin");
+	n = make_payload(data + 1, 0x49, 1);
+	data[0] = 0x49;
+	/* Command and payload, with a sequence number and a complete frame */
+	hex_encode(strs[0], data, n + 1);
+	strcpy(strs[1], "000042");
+	hex_encode(strs[1] + 6, data, n + 1);
+	n = put_frame(frame, 0x4a, 42, 0x49, data + 1, n);
+	hex_encode(strs[2], frame, n);
+
+	for(s = 0; s < 3; s++) {
+		lens[s] = strlen(strs[s]);
+		t = now_ns();
+		for(i = 0; i < iters; i++) {
+			__asm__ volatile("" :: "r"(strs[s]) : "memory");
+			acc += read_packet_from_hex_string(strs[s], lens[s], &pkt,
+				frame)->len;
+		}
+		t = now_ns() - t;
+		snprintf(name, sizeof(name), "read_packet_from_hex_string, %s",
+			s == 0? "cmd": s == 1? "seq+cmd": "frame");
+		report(name, t, iters, iters * lens[s]);
+	}
+
+	sink = acc;
+}
+
+/* Every registered handler on its own, with text and binary output */
+static void bench_handlers(void) {
+	const struct decoder *d;
+	uint8_t data[256], frame[256];
+	uint64_t t, iters = 200000, i;
+	struct pkt pkt;
+	char name[64];
+	int k, f, n;
+
+	for(f = 0; f < 4; f += 3) {
+		bench_output(bench_formats[f]);
+		for(k = 0; k < sizeof(builtin_decoders) / sizeof(builtin_decoders[0]); k++) {
+			d = &builtin_decoders[k];
+			if(d->handler == NULL)
+				continue;
+
+			n = make_payload(data, d->cmd, 1);
+			put_frame(frame, d->dir == DIR_REQUEST? 0x0a: 0x4a, 1,
+				d->cmd, data, n);
+			pkt_view(&pkt, frame);
+			t = now_ns();
+			for(i = 0; i < iters; i++) {
+				__asm__ volatile("" :: "r"(frame) : "memory");
+				d->handler(&pkt);
+			}
+			t = now_ns() - t;
+			snprintf(name, sizeof(name), "handler 0x%02x %s, %s", d->cmd,
+				d->name, bench_formats[f]);
+			report(name, t, iters, iters * pkt.len);
+		}
+	}
+}
+
+static void bench_btea(void) {
+	static const int words[] = { 2, 4, 8, 10, 13, 16, 32, 64 };
+	static uint32_t buf[64 * 64];
+	/* Same key elsewhere, which takes btea()'s generic path */
+	uint32_t key[4];
+	uint64_t t, iters, i;
+	char name[64];
+	int s;
+
+	memcpy(key, gs_key, sizeof(key));
+	for(i = 0; i < sizeof(buf) / sizeof(buf[0]); i++) buf[i] = i * 0x9e3779b9;
+	for(s = 0; s < sizeof(words) / sizeof(words[0]); s++) {
+		iters = 4000000 / words[s];
+
+		/* Independent buffers, like a stream of frames */
+		t = now_ns();
+		for(i = 0; i < iters; i++)
+			btea(buf + (i & 63) * 64, words[s], gs_key);
+		t = now_ns() - t;
+		snprintf(name, sizeof(name), "btea encrypt, %d words", words[s]);
+		report(name, t, iters, iters * words[s] * 4);
+
+		t = now_ns();
+		for(i = 0; i < iters; i++)
+			btea(buf + (i & 63) * 64, -words[s], gs_key);
+		t = now_ns() - t;
+		snprintf(name, sizeof(name), "btea decrypt, %d words", words[s]);
+		report(name, t, iters, iters * words[s] * 4);
+
+		t = now_ns();
+		for(i = 0; i < iters; i++)
+			btea(buf + (i & 63) * 64, -words[s], key);
+		t = now_ns() - t;
+		snprintf(name, sizeof(name), "btea decrypt, %d words, generic", words[s]);
+		report(name, t, iters, iters * words[s] * 4);
+
+		/* 64 buffers at a time, reported per buffer */
+		iters /= 64;
+		t = now_ns();
+		for(i = 0; i < iters; i++)
+			btea_multi(buf, -words[s], 64, gs_key);
+		t = now_ns() - t;
+		snprintf(name, sizeof(name), "btea_multi decrypt, %d words", words[s]);
+		report(name, t, iters * 64, iters * 64 * words[s] * 4);
+	}
+
+	sink = buf[0];
+}
+
+static void bench_gs(void) {
+	static const uint8_t cmds[] = { 0x80, 0x81, 0x81 };
+	uint8_t data[256], frame[256];
+	uint64_t t, iters = 200000, i;
+	struct pkt pkt;
+	char name[64];
+	int s, f, n;
+
+	for(f = 0; f < 4; f += 3) {
+		bench_output(bench_formats[f]);
+		for(s = 0; s < sizeof(cmds); s++) {
+			n = make_payload(data, cmds[s], s);
+			put_frame(frame, cmds[s] == 0x80? 0x0a: 0x4a, s, cmds[s],
+				data, n);
+			pkt_view(&pkt, frame);
+			t = now_ns();
+			for(i = 0; i < iters; i++) {
+				__asm__ volatile("" :: "r"(frame) : "memory");
+				gs_decrypt_packet(&pkt);
+			}
+			t = now_ns() - t;
+			snprintf(name, sizeof(name), "gs_decrypt_packet 0x%02x/0x%03x, %s",
+				cmds[s], s == 0? 0x301: s == 1? 0x341: 0x342,
+				bench_formats[f]);
+			report(name, t, iters, iters * pkt.len);
+		}
+	}
+}
+
+/**
+ * Aircraft side of a session: mostly telemetry with some flight mode,
+ * power and ground station feedback, the odd error and everything else
+ * the handlers know about.
+ */
+static size_t make_corpus(uint8_t *buf, size_t size) {
+	static const uint8_t mix[] = {
+		0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49, 0x49,
+		0x52, 0x52, 0x53, 0x53, 0x81, 0x81, 0x20, 0x41,
+		0x90, 0x2d, 0x32, 0x04, 0x01, 0x02, 0xff, 0x49,
+	};
+	uint8_t data[256];
+	uint16_t seq = 0;
+	size_t n = 0;
+	int len;
+
+	for(;;) {
+		uint8_t cmd = mix[seq % sizeof(mix)];
+
+		len = make_payload(data, cmd, seq);
+		if(n + 8 + len > size)
+			break;
+		n += put_frame(buf + n, 0x4a, seq++, cmd, data, len);
+	}
+
+	return n;
+}
+
+/* Framing, dispatch, handlers and output, end to end */
+static void bench_replay(void) {
+	static uint8_t buf[4 << 20];
+	static struct framer fr;
+	uint64_t t, iters = 5, i, frames;
+	size_t len, off;
+	struct pkt pkt;
+	char name[64];
+	int f;
+
+	len = make_corpus(buf, sizeof(buf));
+	for(f = 0; f < 4; f++) {
+		bench_output(bench_formats[f]);
+		frames = 0;
+		t = now_ns();
+		for(i = 0; i < iters; i++) {
+			framer_init(&fr);
+			for(off = 0; off < len; ) {
+				off += framer_feed(&fr, buf + off,
+					len - off < 4096? len - off: 4096);
+				while(framer_next(&fr, &pkt) != NULL) {
+					decode_packet(&pkt);
+					frames++;
+				}
+			}
+		}
+		sink_flush(out);
+		t = now_ns() - t;
+		snprintf(name, sizeof(name), "replay, %s", bench_formats[f]);
+		report(name, t, frames, iters * len);
+	}
+}
+
+static volatile int state_stop;
+
+/* Updates back to back, far more often than any aircraft would */
+static void *state_writer(void *arg) {
+	struct record *r = arg;
+
+	while(!state_stop) {
+		r->u.telemetry.alt += 1;
+		state_update(r);
+	}
+
+	return NULL;
+}
+
+/* Snapshots of the aircraft state, alone and racing a writer */
+static void bench_state(void) {
+	struct aircraft_state st;
+	struct record r;
+	uint64_t t, iters = 10000000, i, acc = 0;
+	pthread_t thread;
+
+	memset(&r, 0, sizeof(r));
+	r.type = REC_TELEMETRY;
+	r.session = 1;
+	t = now_ns();
+	for(i = 0; i < iters; i++) {
+		r.u.telemetry.alt = i;
+		state_update(&r);
+	}
+	t = now_ns() - t;
+	report("state update", t, iters, iters * sizeof(st));
+
+	t = now_ns();
+	for(i = 0; i < iters; i++)
+		acc += state_read(1, &st);
+	t = now_ns() - t;
+	report("state read", t, iters, iters * sizeof(st));
+
+	state_stop = 0;
+	pthread_create(&thread, NULL, state_writer, &r);
+	t = now_ns();
+	for(i = 0; i < iters; i++)
+		acc += state_read(1, &st);
+	t = now_ns() - t;
+	state_stop = 1;
+	pthread_join(thread, NULL);
+	report("state read, writer updating nonstop", t, iters, iters * sizeof(st));
+	sink = acc;
+}
+
+static uint64_t shm_read_count, shm_read_lost;
+
+/* A subscriber in another thread, as it would be in another process */
+static void *shm_reader(void *arg) {
+	struct dji_shm_reader *rd = arg;
+	uint8_t buf[DJI_SHM_REC_MAX];
+
+	for(;;) {
+		if(dji_shm_read(rd, buf) > 0)
+			shm_read_count++;
+		else if(state_stop)
+			break;
+	}
+	shm_read_lost = rd->lost;
+	return NULL;
+}
+
+/* Publishing records to a shared memory ring, with and without a reader */
+static void bench_shm(void) {
+	struct dji_shm_reader rd;
+	struct record r;
+	uint64_t t, iters = 10000000, i;
+	pthread_t thread;
+	char name[64];
+
+	if(shm_ring_create("dji-phantom-bench", 2, NULL) < 0 ||
+		dji_shm_open(&rd, "dji-phantom-bench") < 0)
+		return;
+
+	memset(&r, 0, sizeof(r));
+	r.type = REC_TELEMETRY;
+	r.session = 2;
+	t = now_ns();
+	for(i = 0; i < iters; i++) {
+		r.seq = i;
+		shm_publish(&r);
+	}
+	t = now_ns() - t;
+	report("shm publish, telemetry", t, iters, iters * 68);
+
+	rd.next = rd.ring->head;
+	state_stop = 0;
+	pthread_create(&thread, NULL, shm_reader, &rd);
+	t = now_ns();
+	for(i = 0; i < iters; i++) {
+		r.seq = i;
+		shm_publish(&r);
+	}
+	t = now_ns() - t;
+	state_stop = 1;
+	pthread_join(thread, NULL);
+	report("shm publish, one reader", t, iters, iters * 68);
+	snprintf(name, sizeof(name), "  reader got %llu, lost %llu",
+		(unsigned long long)shm_read_count,
+		(unsigned long long)shm_read_lost);
+	printf("%s\n", name);
+
+	dji_shm_close(&rd);
+	shm_unlink_all();
+}
+
+/* Synthetic flight, a telemetry record every 50 ms give or take */
+static void make_flight(struct record *r, int n) {
+	int i;
+
+	memset(r, 0, n * sizeof(*r));
+	for(i = 0; i < n; i++) {
+		r[i].ts = 1400000000000000000ull + i * 50000000ull +
+			(i * 7919 % 1000) * 1000;
+		r[i].type = REC_TELEMETRY;
+		r[i].port = 0x4a;
+		r[i].seq = i * 2;
+		r[i].cmd = 0x49;
+		r[i].u.telemetry.sats = 7 + i / 300 % 3;
+		r[i].u.telemetry.home_lat = 57.29577951;
+		r[i].u.telemetry.home_lon = 11.4591559;
+		r[i].u.telemetry.lat = 57.29577951 + i * 0.0000025;
+		r[i].u.telemetry.lon = 11.4591559 + i * 0.0000041;
+		r[i].u.telemetry.accel_z = -3 + i % 3;
+		r[i].u.telemetry.alt = 12.5f + i / 10 * 0.1f;
+		r[i].u.telemetry.roll = 10;
+		r[i].u.telemetry.pitch = 20 + i / 100 % 5;
+		r[i].u.telemetry.heading = 300 + i / 40 % 20;
+		r[i].u.telemetry.millivolts = 11900 - i / 100;
+		r[i].u.telemetry.unknown = 5;
+	}
+}
+
+/* Encoding and decoding archive blocks */
+static void bench_archive(void) {
+	static struct arc_series sr;
+	static struct record out_r[ARC_BLOCK_RECORDS];
+	uint64_t t, iters = 500, i;
+	uint8_t *blk = NULL;
+	uint32_t size = 0;
+	int n = ARC_BLOCK_RECORDS;
+	char path[64];
+
+	snprintf(path, sizeof(path), "/tmp/dji-phantom-bench-%d.arc", getpid());
+	if(arc_open(path) < 0)
+		return;
+
+	make_flight(sr.r, n);
+	t = now_ns();
+	for(i = 0; i < iters; i++) {
+		sr.n = n;
+		arc_flush(&sr, REC_TELEMETRY, 0);
+	}
+	t = now_ns() - t;
+	report("archive encode, telemetry", t, iters * n, iters * n * 68);
+	printf("  %.1f bytes per record, 68 as -o bin\n",
+		(double)arc_bytes / arc_records);
+
+	/* The first block back */
+	if(pread(arc_fd, &size, 4, 8) != 4 || (blk = malloc(size)) == NULL ||
+		pread(arc_fd, blk, size, 8) != size)
+		size = 0;
+	t = now_ns();
+	for(i = 0; i < iters && size; i++)
+		sink += arc_decode(blk, size, out_r);
+	t = now_ns() - t;
+	report("archive decode, telemetry", t, iters * n, iters * n * 68);
+	if(size && memcmp(out_r, sr.r, n * sizeof(*out_r)))
+		printf("  decoded records differ\n");
+
+	free(blk);
+	arc_close();
+	unlink(path);
+}
+
+/* Protocol diff of frames with 53 and 247 byte payloads */
+static void bench_pdiff(void) {
+	static const int payloads[] = { 53, 247 };
+	static uint8_t buf[BENCH_BUFSZ];
+	static struct pdiff pd;
+	uint64_t t, iters = 200, i, frames;
+	struct pkt pkt;
+	size_t len, off;
+	char name[64];
+	int k;
+
+	for(k = 0; k < 2; k++) {
+		len = make_frames(buf, sizeof(buf), payloads[k]);
+		t = now_ns();
+		for(i = frames = 0; i < iters; i++)
+			for(off = 0; off < len; off += buf[off + 2], frames++) {
+				pkt_view(&pkt, buf + off);
+				pdiff_add(&pd, &pkt);
+			}
+		t = now_ns() - t;
+		snprintf(name, sizeof(name), "pdiff, %d byte payload", payloads[k]);
+		report(name, t, frames, iters * len);
+		sink += pd.groups[0]->frames;
+		pdiff_free(&pd);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(void);
+} benches[] = {
+	{ "cksum", bench_cksum },
+	{ "scan", bench_scan },
+	{ "framer", bench_framer },
+	{ "hex", bench_hex },
+	{ "handlers", bench_handlers },
+	{ "btea", bench_btea },
+	{ "gs", bench_gs },
+	{ "replay", bench_replay },
+	{ "state", bench_state },
+	{ "shm", bench_shm },
+	{ "archive", bench_archive },
+	{ "pdiff", bench_pdiff },
+};
+
+int main(int argc, char **argv) {
+	int i, j;
+
+	register_builtin_decoders();
+	for(i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		for(j = 1; j < argc && strcmp(argv[j], benches[i].name); j++);
+		if(argc > 1 && j == argc)
+			continue;
+
+		benches[i].fn();
+	}
+
+	sink_close(out);
+	return 0;
+}
@@ -0,0 +1,223 @@
+/**
+ * Reader API for the shared memory rings published by dji-phantom -P
+ *
+ * dji-phantom writes decoded telemetry (0x49), flight mode (0x52), power
+ * (0x53) and ground station records to a ring in shared memory, one per
+ * session: /dev/shm/<name>, or /dev/shm/<name>.<session> with -c.  Any
+ * number of processes can map a ring read-only and follow it, each at
+ * its own pace, without parsing text and without ever holding up the
+ * decoder.  There's nothing to link against, include this file:
+ *
+ * struct dji_shm_reader rd;
+ * uint8_t buf[DJI_SHM_REC_MAX];
+ * const struct dji_shm_rec *rec = (const void *)buf;
+ *
+ * if(dji_shm_open(&rd, "phantom") < 0) ...
+ * for(;;) {
+ *	if(dji_shm_read(&rd, buf) == 0) { usleep(1000); continue; }
+ *	if(rec->type == DJI_SHM_TELEMETRY) {
+ *		const struct dji_shm_telemetry *t = (const void *)(rec + 1);
+ *		printf("%f %f\n", t->lat, t->lon);
+ *	}
+ * }
+ *
+ * Records are numbered from 0 and each one goes in slot number % nslots.
+ * A slot holds its record's number + 1 once the record is complete and
+ * 0 while it's being (over)written, the ring head the number of records
+ * written so far.  The writer never waits for readers: a reader that
+ * falls more than nslots records behind loses the oldest ones, which is
+ * counted in lost.  Records are encoded as with -o bin, a 16 byte
+ * header followed by the fields of the record type, packed.
+ *
+ * Linux only, with glibc before 2.34 link with -lrt.
+ */
+#ifndef DJI_PHANTOM_SHM_H
+#define DJI_PHANTOM_SHM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DJI_SHM_MAGIC "DJISHM1\n"
+#define DJI_SHM_SLOT_SIZE 128
+/* Largest record, header included */
+#define DJI_SHM_REC_MAX (DJI_SHM_SLOT_SIZE - 8)
+
+/* Record types, as in the type field of -o bin records */
+#define DJI_SHM_TELEMETRY 5
+#define DJI_SHM_FLIGHT_MODE 6
+#define DJI_SHM_POWER 7
+#define DJI_SHM_GS_WAYPOINT 9
+#define DJI_SHM_GS_STATUS 10
+#define DJI_SHM_GS_ATTI 11
+
+struct dji_shm_rec {
+	/* Including this header */
+	uint16_t size;
+	uint8_t type, port;
+	uint16_t seq;
+	uint8_t cmd;
+	/* Session number, in config file order from 1, or 0 */
+	uint8_t session;
+	/* Wall clock (live) or capture time, ns */
+	uint64_t ts;
+} __attribute__((packed));
+
+/* Angles are in degrees unless noted */
+struct dji_shm_telemetry {
+	uint8_t sats;
+	double home_lat, home_lon, lat, lon;
+	int16_t accel_x, accel_y, accel_z;
+	float alt;
+	uint16_t roll, pitch, heading, millivolts;
+	uint8_t unknown;
+} __attribute__((packed));
+
+struct dji_shm_flight_mode {
+	/* 0 == Manual, 1 == GPS, 2 == Fail safe (RTH), 3 == ATTI */
+	uint8_t mode;
+	uint32_t unknown;
+} __attribute__((packed));
+
+struct dji_shm_power {
+	uint16_t cap_design, cap_full, cap_cur, millivolts;
+	int16_t current;
+	uint16_t discharges;
+	uint8_t temp, life, charge;
+} __attribute__((packed));
+
+struct dji_shm_gs_waypoint {
+	uint32_t id;
+	uint8_t turn_mode;
+	double lat, lon;
+	float alt, vel;
+	uint16_t timelimit;
+	/* As sent, unit unknown */
+	float heading;
+} __attribute__((packed));
+
+struct dji_shm_gs_status {
+	double lat, lon;
+	uint16_t u;
+	float f;
+} __attribute__((packed));
+
+struct dji_shm_gs_atti {
+	double lat, lon;
+	float deg;
+} __attribute__((packed));
+
+struct dji_shm_slot {
+	uint64_t seq;
+	uint8_t rec[DJI_SHM_REC_MAX];
+};
+
+struct dji_shm_ring {
+	char magic[8];
+	/* A power of two */
+	uint32_t nslots;
+	uint32_t slot_size;
+	/* Records written so far, on a line of its own */
+	uint64_t head __attribute__((aligned(64)));
+	struct dji_shm_slot slots[] __attribute__((aligned(64)));
+};
+
+struct dji_shm_reader {
+	const struct dji_shm_ring *ring;
+	size_t size;
+	/* Number of the next record to read */
+	uint64_t next;
+	/* Records overwritten before they could be read */
+	uint64_t lost;
+};
+
+/**
+ * Map the ring of the given name, as passed to -P with the session
+ * appended.  Reading starts with the next record written.  Returns -1
+ * with errno set on errors.
+ */
+static inline int dji_shm_open(struct dji_shm_reader *rd, const char *name) {
+	char path[256];
+	struct stat st;
+	void *p;
+	int fd;
+
+	if(snprintf(path, sizeof(path), "/%s", name) >= (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if((fd = shm_open(path, O_RDONLY, 0)) < 0)
+		return -1;
+	if(fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED)
+		return -1;
+
+	rd->ring = (const struct dji_shm_ring *)p;
+	rd->size = st.st_size;
+	if(rd->size < sizeof(*rd->ring) ||
+		memcmp(rd->ring->magic, DJI_SHM_MAGIC, 8) ||
+		rd->ring->slot_size != DJI_SHM_SLOT_SIZE ||
+		rd->size < sizeof(*rd->ring) +
+			(size_t)rd->ring->nslots * DJI_SHM_SLOT_SIZE) {
+		munmap(p, rd->size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	rd->next = __atomic_load_n(&rd->ring->head, __ATOMIC_ACQUIRE);
+	rd->lost = 0;
+	return 0;
+}
+
+/**
+ * Copy the next record to buf, which needs room for DJI_SHM_REC_MAX
+ * bytes.  Returns its size, or 0 if there's nothing new.  Never blocks.
+ */
+static inline int dji_shm_read(struct dji_shm_reader *rd, void *buf) {
+	const struct dji_shm_ring *ring = rd->ring;
+	const struct dji_shm_slot *slot;
+	uint64_t head, seq;
+	uint16_t size;
+
+	for(;;) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if(rd->next >= head)
+			return 0;
+		if(head - rd->next > ring->nslots) {
+			rd->lost += head - ring->nslots - rd->next;
+			rd->next = head - ring->nslots;
+		}
+
+		slot = &ring->slots[rd->next & (ring->nslots - 1)];
+		memcpy(buf, slot->rec, sizeof(slot->rec));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		rd->next++;
+		if(seq == rd->next) {
+			memcpy(&size, buf, sizeof(size));
+			return size;
+		}
+
+		/* Overwritten while we were copying it */
+		rd->lost++;
+	}
+}
+
+static inline void dji_shm_close(struct dji_shm_reader *rd) {
+	munmap((void *)rd->ring, rd->size);
+	rd->ring = NULL;
+}
+
+#endif
@@ -0,0 +1,619 @@
+/**
+ * Simulated DJI Phantom behind ser2net, for testing dji-phantom without
+ * an aircraft
+ *
+ * Building and running:
+ * $ make dji-phantom-sim
+ * $ ./dji-phantom-sim -l 2001 -d 20 -J 5 -u 49=50,52=5 &
+ * $ echo "sim 127.0.0.1:2001 49=20" > sim.conf
+ * $ ./dji-phantom -c sim.conf -s
+ *
+ * Listens on TCP and speaks the same framing as the aircraft.  Requests
+ * for hello (0x04), camera time (0x20), firmware version (0x41), GPS/
+ * telemetry (0x49), flight mode (0x52), power status (0x53) and compass
+ * calibration (0x90) are answered with synthetic but plausible payloads;
+ * the aircraft flies circles around a home point and the battery slowly
+ * drains.  Ground station frames (0x80) are answered with XXTEA encrypted
+ * 0x81 general status feedback.  Anything else gets a plain 00 ack.
+ *
+ * Replies keep the order of their requests, as they would coming out of
+ * a serial port, and are held back -d ms plus up to -J ms of random
+ * jitter.  A share of replies can be turned into 0xe_ status replies
+ * (-e), 0xff error replies (-E) or sent with a bad checksum (-b), all in
+ * percent.  The -u schedule streams unsolicited replies to every client
+ * at the given rates, which may be far higher than dji-phantom polls.
+ * These have sequence numbers of their own so the client's framer will
+ * see them as out of sequence.
+ *
+ * Built against dji-phantom.c itself (without its main()) so the framer,
+ * event loop and XXTEA code are the same as the client's.
+ */
+#define _GNU_SOURCE
+#define DJI_PHANTOM_NO_MAIN
+/* Streams aren't polls, they may go as fast as the loop can keep up */
+#define POLL_MAX_HZ 1000000
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "dji-phantom.c"
+
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/signalfd.h>
+
+/* Replies waiting for their latency to pass, per client */
+#define SIM_QUEUE 1024
+/* Slots of a stream sent in one go when the loop falls behind */
+#define SIM_MAX_BURST 256
+#define SIM_TXBUFSZ 16384
+
+/* Home point, the aircraft circles it at SIM_RADIUS meters */
+#define SIM_HOME_LAT 59.3293
+#define SIM_HOME_LON 18.0686
+#define SIM_RADIUS 50.0
+#define SIM_LAP_S 60.0
+
+struct sim_frame {
+	uint64_t due;
+	uint8_t len;
+	uint8_t buf[255];
+};
+
+struct client {
+	int fd;
+	struct framer rx;
+	struct evsrc src, delay_src;
+	struct sim_frame queue[SIM_QUEUE];
+	unsigned qhead, qlen;
+	/* Sequence numbers of unsolicited frames */
+	uint16_t seq;
+	size_t txlen;
+	uint8_t tx[SIM_TXBUFSZ];
+	unsigned long requests, replies, errors, unsolicited, dropped;
+	struct client *next;
+};
+
+static struct sim {
+	struct evloop loop;
+	struct evsrc listen_src, stream_src, signal_src;
+	struct client *clients;
+	/* Latency and jitter in nanoseconds */
+	uint64_t latency, jitter;
+	/* Error injection in percent */
+	double status_pct, error_pct, cksum_pct;
+	struct polls streams;
+	uint64_t start, rng;
+	uint16_t gs_seq;
+	unsigned long accepted;
+	int verbose;
+} sim = { .rng = 0x9e3779b97f4a7c15ull };
+
+/* xorshift64*, reproducible with -S */
+static uint64_t sim_rand(void) {
+	sim.rng ^= sim.rng >> 12;
+	sim.rng ^= sim.rng << 25;
+	sim.rng ^= sim.rng >> 27;
+	return sim.rng * 0x2545f4914f6cdd1dull;
+}
+
+/* Uniform in [0, 100) */
+static double sim_pct(void) {
+	return (sim_rand() >> 11) * (100.0 / (1ull << 53));
+}
+
+static void put_be_float(uint8_t *p, float f) {
+	uint8_t b[sizeof(f)];
+
+	memcpy(b, &f, sizeof(f));
+	p[0] = b[3];
+	p[1] = b[2];
+	p[2] = b[1];
+	p[3] = b[0];
+}
+
+static uint8_t bcd(int v) {
+	return (v / 10) << 4 | v % 10;
+}
+
+/* Where the aircraft is t seconds in, in degrees */
+static void sim_position(double t, double *lat, double *lon, double *angle) {
+	*angle = 2 * M_PI * t / SIM_LAP_S;
+	*lat = SIM_HOME_LAT + SIM_RADIUS * cos(*angle) / 111320.0;
+	*lon = SIM_HOME_LON + SIM_RADIUS * sin(*angle) /
+		(111320.0 * cos(SIM_HOME_LAT * M_PI / 180));
+}
+
+/* Battery charge in percent, drains over 30 minutes and starts over */
+static int sim_charge(double t) {
+	return 100 - (int)(t / 18) % 100;
+}
+
+/* GPS/telemetry, see handle_packet_0x49() */
+static int sim_telemetry(uint8_t *d, double t) {
+	double lat, lon, a;
+	uint8_t *p = d;
+
+	sim_position(t, &lat, &lon, &a);
+	*p++ = 0;
+	*p++ = 9;
+	put_le_double(p, SIM_HOME_LON * M_PI / 180); p += 8;
+	put_le_double(p, SIM_HOME_LAT * M_PI / 180); p += 8;
+	put_le_double(p, lon * M_PI / 180); p += 8;
+	put_le_double(p, lat * M_PI / 180); p += 8;
+	put_le16(p, 0); p += 2;
+	put_le16(p, 0); p += 2;
+	put_le16(p, (int16_t)(10 * sin(a * 4))); p += 2;
+	put_le_float(p, 20 + 5 * sin(a)); p += 4;
+	put_le16(p, (int16_t)(8 * sin(a * 2))); p += 2;
+	put_le16(p, (int16_t)(3 * cos(a * 2))); p += 2;
+	put_le16(p, (int)(a * 180 / M_PI + 90) % 360); p += 2;
+	put_le16(p, 11100 + sim_charge(t) * 12); p += 2;
+	*p++ = 0;
+	return p - d;
+}
+
+/* Power status, see handle_packet_0x53() */
+static int sim_power(uint8_t *d, double t) {
+	int charge = sim_charge(t);
+
+	d[0] = 0;
+	put_le16(d + 1, 5200);
+	put_le16(d + 3, 5050);
+	put_le16(d + 5, 5050 * charge / 100);
+	put_le16(d + 7, 11150 + charge * 12);
+	put_le16(d + 9, 4200 + (int)(300 * sin(t)));
+	d[11] = 97;
+	d[12] = charge;
+	d[13] = 31;
+	put_le16(d + 14, 42);
+	return 16;
+}
+
+/**
+ * Ground station general status (0x341) as sent in 0x81 frames, see
+ * gs_decrypt_packet():
+ * 00 LL LL <XXTEA encrypted 00 seq cmd payload> <cksum> <footer>
+ * The checksum is still unknown (see crc_search()) so it's left zero,
+ * dji-phantom doesn't check it.
+ */
+static int sim_gs_status(uint8_t *d, double t) {
+	uint32_t buf[13];
+	uint8_t *p = (uint8_t *)buf;
+	double lat, lon, a;
+	int words = sizeof(buf) / 4;
+
+	memset(buf, 0, sizeof(buf));
+	sim_position(t, &lat, &lon, &a);
+	p[0] = 0;
+	put_le16(p + 1, sim.gs_seq++);
+	put_le16(p + 3, 0x341);
+	put_le16(p + 5 + 9, 1);
+	put_le_double(p + 5 + 23, lat * M_PI / 180);
+	put_le_double(p + 5 + 31, lon * M_PI / 180);
+	put_be_float(p + 5 + 42, 20 + 5 * sin(a));
+	btea(buf, words, gs_key);
+
+	d[0] = 0;
+	put_le16(d + 1, 2 + sizeof(buf) + 4);
+	memcpy(d + 3, buf, sizeof(buf));
+	p = d + 3 + sizeof(buf);
+	put_le16(p, 0);
+	p[2] = 0xab;
+	p[3] = 0xcd;
+	return 3 + sizeof(buf) + 4;
+}
+
+/**
+ * Feedback to a ground station command, echoing its sequence number
+ * and command as mission_feedback() expects.  What the aircraft really
+ * says hasn't been seen yet.
+ */
+static int sim_gs_feedback(uint8_t *d, const struct pkt *req) {
+	uint32_t buf[64];
+	uint16_t seq, cmd;
+	uint8_t *p = (uint8_t *)buf;
+	int words = 4;
+
+	if(gs_open(req, buf, &seq, &cmd) < 0)
+		return -1;
+
+	memset(buf, 0, words * 4);
+	put_le16(p + 1, seq);
+	put_le16(p + 3, cmd);
+	btea(buf, words, gs_key);
+
+	d[0] = 0;
+	put_le16(d + 1, 2 + words * 4 + 4);
+	memcpy(d + 3, buf, words * 4);
+	p = d + 3 + words * 4;
+	put_le16(p, 0);
+	p[2] = 0xab;
+	p[3] = 0xcd;
+	return 3 + words * 4 + 4;
+}
+
+/* Synthesize the reply payload to a command, req is NULL when streaming */
+static int sim_payload(uint8_t cmd, const struct pkt *req, uint8_t *d) {
+	double t = (time_mono_ns() - sim.start) / 1e9;
+	struct tm tm;
+	time_t now;
+	int size;
+
+	switch(cmd) {
+	case 0x20:
+		/* Setting the time is acked, otherwise it's reported */
+		if(req && req->len - 8 == 7)
+			break;
+
+		time(&now);
+		localtime_r(&now, &tm);
+		d[0] = bcd(tm.tm_year % 100);
+		d[1] = bcd(19 + tm.tm_year / 100);
+		d[2] = bcd(tm.tm_mon + 1);
+		d[3] = bcd(tm.tm_mday);
+		d[4] = bcd(tm.tm_hour);
+		d[5] = bcd(tm.tm_min);
+		d[6] = bcd(tm.tm_sec);
+		return 7;
+	case 0x41:
+		d[0] = 0;
+		memset(d + 1, 0, 16);
+		memcpy(d + 1, "FC200 v3.04 sim", 15);
+		return 17;
+	case 0x49:
+		return sim_telemetry(d, t);
+	case 0x52:
+		/* GPS mode */
+		d[0] = 0;
+		d[1] = 1;
+		memset(d + 2, 0, 4);
+		return 6;
+	case 0x53:
+		return sim_power(d, t);
+	case 0x80:
+		if(req && (size = sim_gs_feedback(d, req)) > 0)
+			return size;
+		return sim_gs_status(d, t);
+	case 0x81:
+		return sim_gs_status(d, t);
+	case 0x90:
+		d[0] = d[1] = 0;
+		return 2;
+	}
+
+	d[0] = 0;
+	return 1;
+}
+
+static int client_flush(struct client *c) {
+	size_t off = 0;
+	ssize_t n;
+
+	while(off < c->txlen) {
+		if((n = send(c->fd, c->tx + off, c->txlen - off, MSG_NOSIGNAL)) <= 0) {
+			if(n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		off += n;
+	}
+
+	c->txlen = 0;
+	return 0;
+}
+
+static int client_write(struct client *c, const uint8_t *buf, int len) {
+	if(sizeof(c->tx) - c->txlen < len && client_flush(c) < 0)
+		return -1;
+
+	memcpy(c->tx + c->txlen, buf, len);
+	c->txlen += len;
+	return 0;
+}
+
+static void client_close(struct client *c) {
+	struct client **pp;
+
+	for(pp = &sim.clients; *pp != c; pp = &(*pp)->next)
+		;
+	*pp = c->next;
+
+	fprintf(stderr, "* Client %d gone, %lu requests, %lu replies,"
+		" %lu errors, %lu unsolicited, %lu dropped\n", c->fd,
+		c->requests, c->replies, c->errors, c->unsolicited, c->dropped);
+	evloop_del(&c->src);
+	evloop_del(&c->delay_src);
+	close(c->fd);
+	free(c);
+}
+
+/* Send the replies whose time has come, arm the timer for the rest */
+static int client_deliver(struct client *c, uint64_t now) {
+	struct sim_frame *f;
+
+	while(c->qlen > 0) {
+		f = &c->queue[c->qhead];
+		if(f->due > now) {
+			evloop_arm(&c->delay_src, f->due);
+			break;
+		}
+
+		if(client_write(c, f->buf, f->len) < 0)
+			return -1;
+		c->qhead = (c->qhead + 1) % SIM_QUEUE;
+		c->qlen--;
+	}
+
+	return client_flush(c);
+}
+
+/* Answer a request, possibly mangled, after the configured latency */
+static int client_reply(struct client *c, const struct pkt *req) {
+	uint8_t data[255], cmd = req->cmd;
+	struct sim_frame *f;
+	uint64_t due, now = time_mono_ns();
+	double r;
+	int size;
+
+	c->requests++;
+	size = sim_payload(cmd, req, data);
+	/* Ground station data is answered with feedback */
+	if(cmd == 0x80)
+		cmd = 0x81;
+	r = sim_pct();
+	if(r < sim.status_pct) {
+		data[0] = 0xe0 | (1 + sim_rand() % 15);
+		size = 1;
+		c->errors++;
+	}
+	else if(r < sim.status_pct + sim.error_pct) {
+		cmd = 0xff;
+		data[0] = 0xe0 | (1 + sim_rand() % 15);
+		size = 1;
+		c->errors++;
+	}
+
+	if(c->qlen == SIM_QUEUE) {
+		c->dropped++;
+		return 0;
+	}
+
+	f = &c->queue[(c->qhead + c->qlen) % SIM_QUEUE];
+	f->len = frame_build(f->buf, req->port | 0x40, req->seq, cmd, data, size);
+	if(sim_pct() < sim.cksum_pct) {
+		f->buf[f->len - 1] ^= 1 + sim_rand() % 255;
+		c->errors++;
+	}
+
+	/* No overtaking, a serial port keeps things in order */
+	due = now + sim.latency + (sim.jitter? sim_rand() % sim.jitter: 0);
+	if(c->qlen > 0 && due < c->queue[(c->qhead + c->qlen - 1) % SIM_QUEUE].due)
+		due = c->queue[(c->qhead + c->qlen - 1) % SIM_QUEUE].due;
+	f->due = due;
+	c->qlen++;
+	c->replies++;
+	return 0;
+}
+
+static int client_readable(struct evsrc *src, uint32_t events) {
+	struct client *c = src->arg;
+	struct pkt pkt;
+
+	if(framer_fill(&c->rx, c->fd) <= 0) {
+		client_close(c);
+		return 0;
+	}
+
+	while(framer_next(&c->rx, &pkt) != NULL) {
+		if(sim.verbose)
+			decode_packet(&pkt);
+		/* Replies from a confused client aren't answered */
+		if(!(pkt.port & 0x40))
+			client_reply(c, &pkt);
+	}
+
+	if(client_deliver(c, time_mono_ns()) < 0)
+		client_close(c);
+
+	return 0;
+}
+
+static int client_delayed(struct evsrc *src, uint32_t events) {
+	struct client *c = src->arg;
+
+	if(client_deliver(c, time_mono_ns()) < 0)
+		client_close(c);
+
+	return 0;
+}
+
+static int sim_accept(struct evsrc *src, uint32_t events) {
+	struct client *c;
+	int fd, one = 1;
+
+	if((fd = accept4(src->fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+		return 0;
+
+	if((c = calloc(1, sizeof(*c))) == NULL) {
+		close(fd);
+		return 0;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	c->fd = fd;
+	framer_init(&c->rx);
+	if(evloop_add(&sim.loop, &c->src, fd, EPOLLIN, client_readable, c) < 0 ||
+		evloop_oneshot(&sim.loop, &c->delay_src, client_delayed, c) < 0) {
+		fprintf(stderr, "ERROR: Failed to add client: %s\n",
+			strerror(errno));
+		close(fd);
+		free(c);
+		return 0;
+	}
+
+	c->next = sim.clients;
+	sim.clients = c;
+	sim.accepted++;
+	fprintf(stderr, "* Client %d connected\n", fd);
+	return 0;
+}
+
+/**
+ * Send every stream's slots that are due to every client.  Unlike polls,
+ * a stream that fell behind catches up with a burst of up to
+ * SIM_MAX_BURST frames so the average rate holds.
+ */
+static int sim_stream(struct evsrc *src, uint32_t events) {
+	struct poller *p;
+	struct client *c, *next;
+	uint8_t data[255], buf[255];
+	uint64_t now = time_mono_ns(), next_due = UINT64_MAX;
+	int i, n, size, len;
+
+	for(i = 0; i < sim.streams.n; i++) {
+		p = &sim.streams.p[i];
+		for(n = 0; p->due <= now && n < SIM_MAX_BURST; n++) {
+			size = sim_payload(p->cmd, NULL, data);
+			for(c = sim.clients; c != NULL; c = c->next) {
+				len = frame_build(buf, p->port | 0x40, c->seq++, p->cmd,
+					data, size);
+				if(client_write(c, buf, len) == 0)
+					c->unsolicited++;
+			}
+			p->due += p->period;
+			p->sent++;
+		}
+
+		if(p->due <= now) {
+			p->skipped += (now - p->due) / p->period + 1;
+			p->due += ((now - p->due) / p->period + 1) * p->period;
+		}
+
+		if(p->due < next_due)
+			next_due = p->due;
+	}
+
+	for(c = sim.clients; c != NULL; c = next) {
+		next = c->next;
+		if(client_flush(c) < 0)
+			client_close(c);
+	}
+
+	evloop_arm(src, next_due);
+	return 0;
+}
+
+static int sim_signal(struct evsrc *src, uint32_t events) {
+	struct signalfd_siginfo si;
+
+	if(read(src->fd, &si, sizeof(si)) == sizeof(si))
+		fprintf(stderr, "* Caught signal %u, exiting\n", si.ssi_signo);
+	return 1;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "Usage: %s [-l [<host>:]<port>] [-d <ms>] [-J <ms>]"
+		" [-e <%%>] [-E <%%>] [-b <%%>]\n"
+		"       [-u <schedule>] [-S <seed>] [-v]\n"
+		"  -l  Address to listen on (default: %d)\n"
+		"  -d  Reply latency in milliseconds (default: 0)\n"
+		"  -J  Random extra latency up to this many milliseconds\n"
+		"  -e  Percentage of replies turned into 0xe_ status replies\n"
+		"  -E  Percentage of replies turned into 0xff error replies\n"
+		"  -b  Percentage of replies sent with a bad checksum\n"
+		"  -u  Stream unsolicited replies at given rates, i.e 49=1000,53=1"
+		" ([port:]cmd=Hz, hex)\n"
+		"  -S  Random seed for latency and errors\n"
+		"  -v  Decode and print requests\n",
+		argv0, SER2NET_PORT);
+}
+
+int main(int argc, char **argv) {
+	char addr[16];
+	const char *listen_addr = addr;
+	struct client *cl;
+	sigset_t set;
+	int c, fd, sfd, ret;
+
+	snprintf(addr, sizeof(addr), "%d", SER2NET_PORT);
+	register_builtin_decoders();
+	while((c = getopt(argc, argv, "l:d:J:e:E:b:u:S:v")) != -1) {
+		switch(c) {
+		case 'l':
+			listen_addr = optarg;
+			break;
+		case 'd':
+			sim.latency = atof(optarg) * 1000000;
+			break;
+		case 'J':
+			sim.jitter = atof(optarg) * 1000000;
+			break;
+		case 'e':
+			sim.status_pct = atof(optarg);
+			break;
+		case 'E':
+			sim.error_pct = atof(optarg);
+			break;
+		case 'b':
+			sim.cksum_pct = atof(optarg);
+			break;
+		case 'u':
+			if(poll_parse(&sim.streams, optarg) < 0)
+				return -1;
+			break;
+		case 'S':
+			sim.rng = strtoull(optarg, NULL, 0) | 1;
+			break;
+		case 'v':
+			sim.verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if((fd = listen_on(listen_addr)) < 0) {
+		fprintf(stderr, "ERROR: Failed to listen on %s\n", listen_addr);
+		return -1;
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	if((sfd = signalfd(-1, &set, SFD_CLOEXEC)) < 0 ||
+		evloop_init(&sim.loop) < 0 ||
+		evloop_add(&sim.loop, &sim.listen_src, fd, EPOLLIN, sim_accept,
+			NULL) < 0 ||
+		evloop_add(&sim.loop, &sim.signal_src, sfd, EPOLLIN, sim_signal,
+			NULL) < 0 ||
+		evloop_oneshot(&sim.loop, &sim.stream_src, sim_stream, NULL) < 0) {
+		fprintf(stderr, "ERROR: Failed to set up event loop: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	sim.start = time_mono_ns();
+	if(sim.streams.n > 0) {
+		poll_start(&sim.streams, sim.start);
+		evloop_arm(&sim.stream_src, sim.start);
+	}
+
+	/* The framer prints whatever it sees, only wanted with -v */
+	if(!sim.verbose && sink_open(out, "/dev/null", "text", 0) < 0)
+		return -1;
+
+	fprintf(stderr, "* Listening on %s\n", listen_addr);
+	ret = evloop_run(&sim.loop);
+
+	while((cl = sim.clients) != NULL)
+		client_close(cl);
+	if(sim.streams.n > 0)
+		poll_stats(&sim.streams, stderr);
+	fprintf(stderr, "* %lu clients served\n", sim.accepted);
+	sink_flush(out);
+	evloop_free(&sim.loop);
+	close(fd);
+	close(sfd);
+	return ret < 0? -1: 0;
+}
@@ -33,21 +33,50 @@
  *
  * Building:
  * $ make dji-phantom
+ * $ make bench (builds and runs the microbenchmarks in dji-phantom-bench.c)
  *
  * Usage:
  * $ ./dji-phantom (will automatically connect to 192.168.1.1:9000)
+ * $ ./dji-phantom -p 49=20,53=1,52=5 (poll telemetry at 20 Hz, battery
+ *   at 1 Hz and flight mode at 5 Hz)
+ * $ ./dji-phantom -c fleet.conf -j 4 -o json (many aircraft at once, see
+ *   struct session for the config file)
+ * $ ./dji-phantom -m route.csv -W 16 (upload a ground station mission)
+ * $ ./dji-phantom -m route.csv -e |./dji-phantom -x - (inspect its frames)
+ * $ ./dji-phantom -P phantom (telemetry for other processes, see
+ *   dji-phantom-shm.h)
+ * $ ./dji-phantom -R 2001 (decode the Vision app's traffic, relaying it to
+ *   the aircraft)
+ * $ ./dji-phantom -T dji-123.pcap -t 10 (replay a flight to the live path
+ *   at ten times the speed, reporting decode lag)
+ * $ ./dji-phantom -A flights.arc (keep telemetry in a compressed archive)
+ * $ ./dji-phantom -a flights.arc -i 1400000000,1400003600 -o csv (an
+ *   hour of it)
+ * $ ./dji-phantom -L today.flog (log every frame, indexed)
+ * $ ./dji-phantom -l today.flog -q cmd=81 -i 1400000000,1400000600 (the
+ *   ground station feedback in those ten minutes)
+ * $ ./dji-phantom -Q counts -q err=e5 dji-*.pcap (how often 0xe5
+ *   came back, reading the captures in parallel)
+ * $ ./dji-phantom -Q diff -q cmd=1b dji-*.pcap (which bytes of the
+ *   unknown 0x1b change, and how)
  *
  * To debug internal packet handlers without a network, supply one
  * or more hex strings composed of two command bytes and payload:
- * $ ./dji-phantom 0200 0100 4900.......
- * $ grep SERV.*seq dji-*-30.info |cut -b47-50,59-|tr -d \'|xargs ./dji-phantom
+ * $ ./dji-phantom -x 0200 0100 4900.......
+ * $ grep SERV.*seq dji-*-30.info |cut -b47-50,59-|tr -d \'|./dji-phantom -x -
+ * Large collections of packets, one per line, are best read in one go:
+ * $ ./dji-phantom -f packets.txt
  *
  * Sample data can be gathered using tcpdump:
  * $ ssh root@192.168.1.2 tcpdump -i br-lan -w - -s0 port not 22 > dji-123.pcap
  * (requires tcpdump, from OpenWRT, to be installed on the WiFi range extender)
- * Then use Wireshark's Follow TCP stream -> Hexdump -> Save file and parse
- * the hexdump output with a script.  Or you could proxy the Vision App's
- * network connection through something that logs traffic to files.
+ * The capture (pcap or pcapng) can then be decoded directly:
+ * $ ./dji-phantom -r dji-123.pcap
+ * $ ssh root@192.168.1.2 tcpdump -i br-lan -w - -s0 port 2001 | ./dji-phantom -r -
+ * Decoded packets can be written as JSON Lines, CSV or binary records:
+ * $ ./dji-phantom -o json -w dji-123.jsonl -r dji-123.pcap
+ * Or you could proxy the Vision App's network connection through dji-phantom
+ * (-R) and have it decode the traffic as it goes by.
  *
  *
  * Client command table (as seen on the wire)
@@ -115,21 +144,49 @@
  *   0x9000 - sent by server when compass calibration has started
  */
 
+#ifndef _GNU_SOURCE
+/* splice(), tee() and accept4() */
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <math.h>
+#include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/param.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <signal.h>
+#include <limits.h>
 #include <errno.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dji-phantom-shm.h"
 
 #define DJI_PHANTOM_MAGIC 0xbb55
+#define SER2NET_PORT 2001
 
 /**
  * Byte 00 .. 01 : Magic frame header <0x55, 0xbb>
@@ -157,6 +214,8 @@ struct pkt {
 	/* Copy of data[0] */
 	uint8_t status;
 	/**
+	 * Points into the frame, right after the command byte.
+	 *
 	 * Most requests by the client has a zero least significant byte.
 	 * There are exceptions to this, however, such as the 24XX or 32XX
 	 * commands sent by the client.  Or the 0x20 and 0x02 commands
@@ -173,9 +232,30 @@ struct pkt {
 	 * attempts are made to use the camera - whichs results in command
 	 * 0xff with payload 0xe5 being sent back.
 	 */
-	uint8_t data[255 - 7];
+	const uint8_t *data;
+	/* The entire frame, len bytes including magic and checksum */
+	const uint8_t *raw;
+	/* When it was sent or received, nanoseconds since the epoch */
+	uint64_t ts;
 };
 
+/**
+ * Set up a packet view of a frame.  Packets are never copied, they
+ * point straight into the buffer the frame was received or built in
+ * and are only valid as long as that is.
+ */
+static void pkt_view(struct pkt *pkt, const uint8_t *frame) {
+	pkt->magic = frame[0] | frame[1] << 8;
+	pkt->len = frame[2];
+	pkt->port = frame[3];
+	pkt->seq = frame[4] | frame[5] << 8;
+	pkt->cmd = frame[6];
+	pkt->data = frame + 7;
+	pkt->status = pkt->data[0];
+	pkt->raw = frame;
+	pkt->ts = 0;
+}
+
 /* Load a float stored little-endian on a LE machine */
 static float load_le_float(const uint8_t *p) {
 	union {
@@ -210,957 +290,8440 @@ static double load_le_double(const uint8_t *p) {
 	return u.d;
 }
 
-static void dump_packet(const struct pkt *pkt) {
-	uint8_t buf[255], i;
+static void put_le16(uint8_t *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
 
-	memcpy(buf, pkt, pkt->len);
-	printf("** DUMP ");
-	for(i = 0; i < pkt->len; i++) {
-		printf("%s%02x%c", i % 16 == 0 && i? "\t": "", buf[i],
-			i % 16 == 15 && i != pkt->len - 1? '\n': ' ');
-	}
-	printf("\n");
-	fflush(stdout);
+/* Store a float little-endian on a LE machine, see load_le_float() */
+static void put_le_float(uint8_t *p, float f) {
+	memcpy(p, &f, sizeof(f));
 }
 
-/* Response to command 0x01 (take picture) on port 0x08 */
-static int handle_packet_0x01(const struct pkt *pkt) {
-	int n;
+static void put_le_double(uint8_t *p, double d) {
+	memcpy(p, &d, sizeof(d));
+}
 
-	n = pkt->len - 8;
-	if(n != 1) {
-		fprintf(stderr, "[0x01]: Expected payload len 1, got %d\n", n);
-		return -1;
+/**
+ * Output sinks
+ *
+ * Handlers don't print, they fill in a struct record which is passed to
+ * emit_record() and serialized by the output sink: human readable text
+ * (the default), JSON Lines, CSV or a compact binary format.  The sink
+ * formats straight into a large buffer which is written out when it's
+ * full or, when called from the event loop, once the flush interval has
+ * passed (see sink_tick()).  No stdio and no flush per frame.
+ *
+ * The JSON, CSV and binary encodings are generated from the field tables
+ * in rec_descs[], so adding a record type takes a struct in the union,
+ * a field table and a case in text_record().
+ *
+ * CSV rows start with ts,type,port,seq,cmd followed by the fields of the
+ * record type.  The output starts with one "#type,field,..." comment
+ * line per record type describing those.
+ *
+ * Binary output starts with the 8 byte magic "DJIREC1\n", followed by
+ * records with a 16 byte header <u16 size (including the header), u8
+ * type, u8 port, u16 seq, u8 cmd, u8 session, u64 ts> and the fields of
+ * the record type packed in table order.  Everything is little-endian
+ * and strings are fixed size and NUL padded.
+ *
+ * With more than one session (-c) records are tagged with the session:
+ * text lines are prefixed with its name, JSON objects get a "session"
+ * member and CSV rows a session column after cmd.  Each worker thread
+ * has a sink of its own and they take turns writing to the same fd.
+ *
+ * Timestamps are nanoseconds since the epoch or zero when unknown, i.e
+ * for packets given in hex.
+ */
+enum rec_type {
+	REC_FRAME,
+	REC_STATUS,
+	REC_CAMERA_TIME,
+	REC_POSITION,
+	REC_VERSION,
+	REC_TELEMETRY,
+	REC_FLIGHT_MODE,
+	REC_POWER,
+	REC_ERROR,
+	REC_GS_WAYPOINT,
+	REC_GS_STATUS,
+	REC_GS_ATTI,
+	REC_TYPES
+};
+
+struct record {
+	uint64_t ts;
+	uint16_t seq;
+	uint8_t type, port, cmd;
+	/* Session number, zero without -c */
+	uint8_t session;
+	union {
+		/* Every frame sent or received, see filter_packet() */
+		struct { uint8_t len, err; } frame;
+		/* First two payload bytes of replies that carry nothing else */
+		struct { uint8_t code, arg; } status;
+		struct { char time[20]; } camera_time;
+		struct { double lat, lon; } position;
+		struct { char version[17]; } version;
+		struct {
+			uint8_t sats;
+			double home_lat, home_lon, lat, lon;
+			int16_t accel_x, accel_y, accel_z;
+			float alt;
+			uint16_t roll, pitch, heading, millivolts;
+			uint8_t unknown;
+		} telemetry;
+		/* Bytes following the mode, first one in the LSB */
+		struct { uint8_t mode; uint32_t unknown; } flight_mode;
+		struct {
+			uint16_t cap_design, cap_full, cap_cur, millivolts;
+			int16_t current;
+			uint16_t discharges;
+			uint8_t temp, life, charge;
+		} power;
+		struct { uint8_t code, len; } error;
+		struct {
+			uint32_t id;
+			uint8_t turn_mode;
+			double lat, lon;
+			float alt, vel;
+			uint16_t timelimit;
+			float heading;
+		} waypoint;
+		struct { double lat, lon; uint16_t u; float f; } gs_status;
+		struct { double lat, lon; float deg; } gs_atti;
+	} u;
+};
+
+enum field_kind { F_U8, F_U16, F_I16, F_U32, F_F32, F_F64, F_STR };
+
+struct rec_field {
+	const char *name;
+	uint8_t kind;
+	uint8_t size;
+	uint16_t off;
+};
+
+#define FIELD(type, member, kind) { #member, kind,			\
+	sizeof(((struct record *)0)->u.type.member),			\
+	offsetof(struct record, u.type.member) }
+
+static const struct rec_field frame_fields[] = {
+	FIELD(frame, len, F_U8), FIELD(frame, err, F_U8), { NULL }
+};
+
+static const struct rec_field status_fields[] = {
+	FIELD(status, code, F_U8), FIELD(status, arg, F_U8), { NULL }
+};
+
+static const struct rec_field camera_time_fields[] = {
+	FIELD(camera_time, time, F_STR), { NULL }
+};
+
+static const struct rec_field position_fields[] = {
+	FIELD(position, lat, F_F64), FIELD(position, lon, F_F64), { NULL }
+};
+
+static const struct rec_field version_fields[] = {
+	FIELD(version, version, F_STR), { NULL }
+};
+
+static const struct rec_field telemetry_fields[] = {
+	FIELD(telemetry, sats, F_U8),
+	FIELD(telemetry, home_lat, F_F64), FIELD(telemetry, home_lon, F_F64),
+	FIELD(telemetry, lat, F_F64), FIELD(telemetry, lon, F_F64),
+	FIELD(telemetry, accel_x, F_I16), FIELD(telemetry, accel_y, F_I16),
+	FIELD(telemetry, accel_z, F_I16), FIELD(telemetry, alt, F_F32),
+	FIELD(telemetry, roll, F_U16), FIELD(telemetry, pitch, F_U16),
+	FIELD(telemetry, heading, F_U16),
+	FIELD(telemetry, millivolts, F_U16), FIELD(telemetry, unknown, F_U8),
+	{ NULL }
+};
+
+static const struct rec_field flight_mode_fields[] = {
+	FIELD(flight_mode, mode, F_U8), FIELD(flight_mode, unknown, F_U32),
+	{ NULL }
+};
+
+static const struct rec_field power_fields[] = {
+	FIELD(power, cap_design, F_U16), FIELD(power, cap_full, F_U16),
+	FIELD(power, cap_cur, F_U16), FIELD(power, millivolts, F_U16),
+	FIELD(power, current, F_I16), FIELD(power, discharges, F_U16),
+	FIELD(power, temp, F_U8), FIELD(power, life, F_U8),
+	FIELD(power, charge, F_U8), { NULL }
+};
+
+static const struct rec_field error_fields[] = {
+	FIELD(error, code, F_U8), FIELD(error, len, F_U8), { NULL }
+};
+
+static const struct rec_field waypoint_fields[] = {
+	FIELD(waypoint, id, F_U32), FIELD(waypoint, turn_mode, F_U8),
+	FIELD(waypoint, lat, F_F64), FIELD(waypoint, lon, F_F64),
+	FIELD(waypoint, alt, F_F32), FIELD(waypoint, vel, F_F32),
+	FIELD(waypoint, timelimit, F_U16), FIELD(waypoint, heading, F_F32),
+	{ NULL }
+};
+
+static const struct rec_field gs_status_fields[] = {
+	FIELD(gs_status, lat, F_F64), FIELD(gs_status, lon, F_F64),
+	FIELD(gs_status, u, F_U16), FIELD(gs_status, f, F_F32), { NULL }
+};
+
+static const struct rec_field gs_atti_fields[] = {
+	FIELD(gs_atti, lat, F_F64), FIELD(gs_atti, lon, F_F64),
+	FIELD(gs_atti, deg, F_F32), { NULL }
+};
+
+static const struct rec_desc {
+	const char *name;
+	const struct rec_field *fields;
+} rec_descs[REC_TYPES] = {
+	[REC_FRAME] = { "frame", frame_fields },
+	[REC_STATUS] = { "status", status_fields },
+	[REC_CAMERA_TIME] = { "camera_time", camera_time_fields },
+	[REC_POSITION] = { "position", position_fields },
+	[REC_VERSION] = { "version", version_fields },
+	[REC_TELEMETRY] = { "telemetry", telemetry_fields },
+	[REC_FLIGHT_MODE] = { "flight_mode", flight_mode_fields },
+	[REC_POWER] = { "power", power_fields },
+	[REC_ERROR] = { "error", error_fields },
+	[REC_GS_WAYPOINT] = { "gs_waypoint", waypoint_fields },
+	[REC_GS_STATUS] = { "gs_status", gs_status_fields },
+	[REC_GS_ATTI] = { "gs_atti", gs_atti_fields },
+};
+
+#define SINK_BUFSZ (256 << 10)
+/* Room always left for one record, longer ones cause an early flush */
+#define SINK_MAXREC 1024
+#define SINK_BIN_MAGIC "DJIREC1\n"
+#define SINK_BIN_HDRSZ 16
+
+enum sink_format { SINK_TEXT, SINK_JSON, SINK_CSV, SINK_BINARY };
+
+static const char *sink_formats[] = { "text", "json", "csv", "bin", NULL };
+
+struct sink {
+	int fd, format;
+	/* Records are tagged with their session */
+	int tagged;
+	/* Flush interval, see sink_tick() */
+	uint64_t interval, last;
+	uint64_t records, flushes;
+	/* Held while writing when the fd is shared with other sinks */
+	pthread_mutex_t *lock;
+	size_t len;
+	char buf[SINK_BUFSZ];
+};
+
+static struct sink stdout_sink = { .fd = 1, .format = SINK_TEXT };
+static pthread_mutex_t sink_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Where emit_record() and text_printf() output goes, per thread */
+static __thread struct sink *out = &stdout_sink;
+/* Session the thread is working on, see struct session */
+static __thread uint8_t out_session;
+static const char *session_names[256];
+
+static uint64_t time_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t time_mono_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int sink_flush(struct sink *s) {
+	size_t off = 0;
+	ssize_t n;
+
+	if(s->lock)
+		pthread_mutex_lock(s->lock);
+
+	/* Keep anything printed with stdio in order */
+	if(s->fd == 1)
+		fflush(stdout);
+
+	while(off < s->len) {
+		if((n = write(s->fd, s->buf + off, s->len - off)) < 0) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "sink_flush(): write() failed: %s\n",
+				strerror(errno));
+			break;
+		}
+
+		off += n;
 	}
 
-	switch(pkt->data[0]) {
-	case 0x00:
-		printf("[0x01]: Camera shot taken!\n");
-		break;
-	case 0xe0 ... 0xef:
-	default:
-		printf("[0x01]: Camera shot NOT taken (err 0x%02x)!\n",
-			pkt->data[0]);
-		break;
+	if(s->lock)
+		pthread_mutex_unlock(s->lock);
+
+	if(off < s->len) {
+		s->len = 0;
+		return -1;
 	}
 
+	s->len = 0;
+	s->flushes++;
 	return 0;
 }
 
-/* Response to command 0x02 (start/stop recording) on port 0x08 */
-static int handle_packet_0x02(const struct pkt *pkt) {
+/* Returns room for at least n bytes at the end of the buffer */
+static char *sink_reserve(struct sink *s, size_t n) {
+	if(sizeof(s->buf) - s->len < n)
+		sink_flush(s);
+	return s->buf + s->len;
+}
+
+static void sink_vprintf(struct sink *s, const char *fmt, va_list ap) {
+	size_t room;
+	va_list aq;
 	int n;
 
-	n = pkt->len - 8;
-	if(n != 1) {
-		fprintf(stderr, "[0x02]: Expected payload len 1, got %d\n", n);
-		return -1;
+	room = sizeof(s->buf) - s->len;
+	va_copy(aq, ap);
+	n = vsnprintf(s->buf + s->len, room, fmt, aq);
+	va_end(aq);
+	if(n >= room) {
+		sink_flush(s);
+		room = sizeof(s->buf);
+		n = vsnprintf(s->buf, room, fmt, ap);
+		if(n >= room) n = room - 1;
 	}
 
-	switch(pkt->data[0]) {
-	case 0x00:
-		printf("[0x02]: Camera recording command OK\n");
-		break;
-	case 0xe0 ... 0xef:
-	default:
-		printf("[0x02]: Camera cannot record (err 0x%02x)!\n",
-			pkt->data[0]);
-		break;
-	}
+	if(n > 0)
+		s->len += n;
+}
 
-	return 0;
+static void __attribute__((format(printf, 2, 3)))
+sink_printf(struct sink *s, const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	sink_vprintf(s, fmt, ap);
+	va_end(ap);
 }
 
-/* Handle command 0x20 (set/ack camera time) on port 0x08 */
-static int handle_packet_0x20(const struct pkt *pkt) {
-	int n;
+/* Free form output that only makes sense to humans, dropped otherwise */
+static void __attribute__((format(printf, 1, 2)))
+text_printf(const char *fmt, ...) {
+	va_list ap;
 
-	n = pkt->len - 8;
-	if(n != 1 /* server ack */ && n != 7 /* client timestamp */) {
-		fprintf(stderr, "[0x20]: Unexpected payload len, got %d\n", n);
-		return -1;
+	if(out->format != SINK_TEXT)
+		return;
+
+	va_start(ap, fmt);
+	sink_vprintf(out, fmt, ap);
+	va_end(ap);
+}
+
+/**
+ * Flush if there's anything buffered and the flush interval has passed.
+ * Meant to be called once per event loop iteration so that output is
+ * written in batches rather than per frame.
+ */
+static void sink_tick(struct sink *s, uint64_t now) {
+	if(s->len > 0 && now - s->last >= s->interval) {
+		sink_flush(s);
+		s->last = now;
 	}
+}
+
+static void text_record(struct sink *s, const struct record *r) {
+	int dir = r->port >> 6;
+
+	if(s->tagged && session_names[r->session])
+		sink_printf(s, "%s: ", session_names[r->session]);
 
-	switch(pkt->data[0]) {
-	case 0x00:
-		printf("[0x20]: OK\n");
+	switch(r->type) {
+	case REC_FRAME:
+		sink_printf(s, "** %s port 0x%02x, seq % 5d, cmd 0x%02x,"
+			" error %d, payload len % 2d\n",
+			dir == 0? "Sent to ": dir == 1? "Rcv from": "UNKN DIR",
+			r->port & 0x3f, r->seq, r->cmd, r->u.frame.err,
+			r->u.frame.len - 8);
 		break;
-	case 0x10 ... 0x20:
-		printf("[0x20]: Camera time initialized to"
-			" %02x%02x-%02x-%02x %02x:%02x:%02x\n", pkt->data[1],
-			pkt->data[0], pkt->data[2], pkt->data[3],
-			pkt->data[4], pkt->data[5], pkt->data[6]);
+	case REC_STATUS:
+		switch(r->cmd) {
+		case 0x01:
+			if(r->u.status.code == 0)
+				sink_printf(s, "[0x01]: Camera shot taken!\n");
+			else
+				sink_printf(s, "[0x01]: Camera shot NOT taken"
+					" (err 0x%02x)!\n", r->u.status.code);
+			break;
+		case 0x02:
+			if(r->u.status.code == 0)
+				sink_printf(s, "[0x02]: Camera recording command OK\n");
+			else
+				sink_printf(s, "[0x02]: Camera cannot record"
+					" (err 0x%02x)!\n", r->u.status.code);
+			break;
+		case 0x04:
+			sink_printf(s, "0x04: server says hello!\n");
+			break;
+		case 0x20:
+			if(r->u.status.code == 0)
+				sink_printf(s, "[0x20]: OK\n");
+			else
+				sink_printf(s, "[0x20]: Unknown response"
+					" (err 0x%02x)!\n", r->u.status.code);
+			break;
+		case 0x2d:
+			if(r->u.status.code == 0)
+				sink_printf(s, "[0x2d]: Data recevied: 0x%04x\n",
+					r->u.status.code << 8 | r->u.status.arg);
+			else
+				sink_printf(s, "[0x2d]: Unexpected response with"
+					" payload: 0x%04x\n",
+					r->u.status.code << 8 | r->u.status.arg);
+			break;
+		case 0x32:
+			sink_printf(s, "[0x32]: Coordinates received, status:"
+				" 0x%02x!\n", r->u.status.code);
+			break;
+		case 0x41:
+			sink_printf(s, "[0x41]: Camera firmware version check\n");
+			break;
+		case 0x90:
+			if(r->u.status.code == 0)
+				sink_printf(s, "[0x90]: Started compass calibration,"
+					" status: 0x%02x\n", r->u.status.arg);
+			else
+				sink_printf(s, "[0x90]: Unexpected response with"
+					" payload: 0x%04x\n",
+					r->u.status.code << 8 | r->u.status.arg);
+			break;
+		default:
+			sink_printf(s, "[0x%02x]: Status 0x%02x 0x%02x\n", r->cmd,
+				r->u.status.code, r->u.status.arg);
+			break;
+		}
 		break;
-	case 0xe0 ... 0xef:
-	default:
-		printf("[0x20]: Unknown response (err 0x%02x)!\n",
-			pkt->data[0]);
+	case REC_CAMERA_TIME:
+		sink_printf(s, "[0x20]: Camera time initialized to %s\n",
+			r->u.camera_time.time);
+		break;
+	case REC_POSITION:
+		sink_printf(s, "[0x32]: Coordinates [%+3.6f, %+3.6f]\n",
+			r->u.position.lat, r->u.position.lon);
+		break;
+	case REC_VERSION:
+		sink_printf(s, "[0x41]: Camera firmware version: %s\n",
+			r->u.version.version);
+		break;
+	case REC_TELEMETRY:
+		sink_printf(s, "[0x49]: Seq %5u, GPS sats %d,"
+			" home [%+3.6f, %+3.6f] loc [%+3.6f, %+3.6f],"
+			" accel xyz [%+03d, %+03d, %+03d], ag %+3.1f meter,"
+			" compass roll/pitch/heading [%03d, %03d, %03d],"
+			" batt %5umV (%2.0f%%), unknown %-3d\n",
+			r->seq, r->u.telemetry.sats,
+			r->u.telemetry.home_lat, r->u.telemetry.home_lon,
+			r->u.telemetry.lat, r->u.telemetry.lon,
+			r->u.telemetry.accel_x, r->u.telemetry.accel_y,
+			r->u.telemetry.accel_z, r->u.telemetry.alt,
+			r->u.telemetry.roll, r->u.telemetry.pitch,
+			r->u.telemetry.heading, r->u.telemetry.millivolts,
+			r->u.telemetry.millivolts?
+			(r->u.telemetry.millivolts - 10800)/17.0: 0,
+			r->u.telemetry.unknown);
+		break;
+	case REC_FLIGHT_MODE:
+		sink_printf(s, "[0x52]: Seq %5u, Flight mode: %s"
+			" (%02x %02x %02x %02x %02x)\n", r->seq,
+			r->u.flight_mode.mode == 0x00? "Manual":
+			r->u.flight_mode.mode == 0x01? "GPS":
+			r->u.flight_mode.mode == 0x02? "Fail safe (RTH)":
+			r->u.flight_mode.mode == 0x03? "ATTI": "Unknown",
+			r->u.flight_mode.mode,
+			r->u.flight_mode.unknown & 0xff,
+			r->u.flight_mode.unknown >> 8 & 0xff,
+			r->u.flight_mode.unknown >> 16 & 0xff,
+			r->u.flight_mode.unknown >> 24);
+		break;
+	case REC_POWER:
+		sink_printf(s, "[0x53]: Seq %5u, battery capacity design/full/now"
+			" %4u/%4u/%4umAh, status <%5umV, % 5dmA>, discharges %3u,"
+			" temp %2uC, battery life/charge %2u%%/%2u%%\n",
+			r->seq, r->u.power.cap_design, r->u.power.cap_full,
+			r->u.power.cap_cur, r->u.power.millivolts,
+			r->u.power.current, r->u.power.discharges,
+			r->u.power.temp, r->u.power.life, r->u.power.charge);
+		break;
+	case REC_ERROR:
+		sink_printf(s, "[0xff]: Seq %5u, error reply from port 0x%02x:"
+			" code 0x%02x, %d bytes payload\n", r->seq,
+			r->port & 0x3f, r->u.error.code, r->u.error.len);
+		break;
+	case REC_GS_WAYPOINT:
+		sink_printf(s, "[0x%02x] [GS 0x%04x] Waypoint number %-2d,"
+			" turn mode %d, location [%+3.6f, %+3.6f], altitude %3.1f,"
+			" velocity %3.1fm/s, heading %3.1f\n",
+			r->cmd, 0x301, r->u.waypoint.id, r->u.waypoint.turn_mode,
+			r->u.waypoint.lat, r->u.waypoint.lon, r->u.waypoint.alt,
+			r->u.waypoint.vel, r->u.waypoint.heading);
+		break;
+	case REC_GS_STATUS:
+		sink_printf(s, "[0x%02x] [GS 0x%04x] General status location"
+			" [%+3.6f, %+3.6f], u16 %-5d (0x%04x), float %+3.3f\n",
+			r->cmd, 0x341, r->u.gs_status.lat, r->u.gs_status.lon,
+			r->u.gs_status.u, r->u.gs_status.u, r->u.gs_status.f);
+		break;
+	case REC_GS_ATTI:
+		sink_printf(s, "[0x%02x] [GS 0x%04x] Attitude mode location"
+			" [%+3.6f, %+3.6f], deg %+3.3f\n", r->cmd, 0x342,
+			r->u.gs_atti.lat, r->u.gs_atti.lon, r->u.gs_atti.deg);
 		break;
 	}
-
-	return 0;
 }
 
-/* Response to command 0x2d (unknown) on port 0x08 */
-static int handle_packet_0x2d(const struct pkt *pkt) {
-	int n;
+/* Format an unsigned integer, returns the end of it */
+static char *fmt_uint(char *d, uint64_t v) {
+	char tmp[20], *t = tmp + sizeof(tmp);
 
-	n = pkt->len - 8;
-	if(n != 2) {
-		fprintf(stderr, "[0x2d]: Expected payload len 2, got %d\n", n);
-		return -1;
-	}
+	do {
+		*--t = '0' + v % 10;
+		v /= 10;
+	} while(v);
 
-	switch(pkt->data[0]) {
-	case 0x00:
-		printf("[0x2d]: Data recevied: 0x%04x\n",
-			pkt->data[0] << 8 | pkt->data[1]);
-		break;
-	case 0xe0 ... 0xef:
-	default:
-		printf("[0x2d]: Unexpected response with payload: 0x%04x",
-			pkt->data[0] << 8 | pkt->data[1]);
-		break;
+	memcpy(d, t, tmp + sizeof(tmp) - t);
+	return d + (tmp + sizeof(tmp) - t);
+}
+
+static char *fmt_int(char *d, int64_t v) {
+	if(v < 0) {
+		*d++ = '-';
+		return fmt_uint(d, -(uint64_t)v);
 	}
 
-	return 0;
+	return fmt_uint(d, v);
 }
 
-/* Handle command 0x32 (report position) on port 0x0a */
-static int handle_packet_0x32(const struct pkt *pkt) {
-	int n;
-	double lat, lon;
-	const uint8_t *p = pkt->data;
+static char *fmt_str(char *d, const char *s) {
+	size_t n = strlen(s);
 
-	n = pkt->len - 8;
-	if((pkt->port & 0x40) && n != 16) {
-		fprintf(stderr, "[0x32]: Expected payload len 16, got %d\n", n);
-		return -1;
-	}
-	else if((pkt->port & 0x40) == 0 && n != 1) {
-		fprintf(stderr, "[0x32]: Expected payload len 1, got %d\n", n);
-		return -1;
-	}
+	memcpy(d, s, n);
+	return d + n;
+}
 
-	if(pkt->port & 0x40) {
-		/* Parse command from client */
-		lon = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
-		lat = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
-		printf("[0x32]: Coordinates [%+3.6f, %+3.6f]\n", lat, lon);
-	}
-	else {
-		printf("[0x32]: Coordinates received, status: 0x%02x!\n",
-			pkt->data[0]);
+/**
+ * Format a field value as JSON (or CSV, where strings aren't quoted).
+ * Needs room for 3 + 6 * f->size bytes.
+ */
+static char *fmt_value(char *d, const struct record *r,
+		const struct rec_field *f, int json) {
+	const uint8_t *p = (const uint8_t *)r + f->off;
+	uint16_t u16;
+	uint32_t u32;
+	float f32;
+	double f64;
+	int i;
+
+	switch(f->kind) {
+	case F_U8:
+		return fmt_uint(d, p[0]);
+	case F_U16:
+		memcpy(&u16, p, 2);
+		return fmt_uint(d, u16);
+	case F_I16:
+		memcpy(&u16, p, 2);
+		return fmt_int(d, (int16_t)u16);
+	case F_U32:
+		memcpy(&u32, p, 4);
+		return fmt_uint(d, u32);
+	case F_F32:
+		memcpy(&f32, p, 4);
+		f64 = f32;
+		break;
+	case F_F64:
+		memcpy(&f64, p, 8);
+		break;
+	default:
+		/* F_STR */
+		if(json) *d++ = '"';
+		for(i = 0; i < f->size && p[i]; i++) {
+			if(p[i] >= 0x20 && p[i] < 0x7f && p[i] != '"' &&
+				p[i] != '\\' && (json || p[i] != ','))
+				*d++ = p[i];
+			else if(!json)
+				*d++ = '.';
+			else {
+				sprintf(d, "\\u%04x", p[i]);
+				d += 6;
+			}
+		}
+		if(json) *d++ = '"';
+		return d;
 	}
 
-	return 0;
-}
+	/* JSON has no NaN or infinity */
+	if(json && (f64 != f64 || f64 - f64 != 0))
+		return fmt_str(d, "null");
 
-/* Handle command 0x41 (camera firmware version) on port 0x08 */
-static int handle_packet_0x41(const struct pkt *pkt) {
-	int n;
-	char buf[17];
+	return d + sprintf(d, f->kind == F_F32? "%.7g": "%.10g", f64);
+}
 
-	n = pkt->len - 8;
-	if((pkt->port & 0x40) && n != 17) {
-		fprintf(stderr, "[0x41]: Expected payload len 17, got %d\n", n);
-		return -1;
+static void json_record(struct sink *s, const struct record *r) {
+	const struct rec_field *f;
+	char *d;
+
+	d = sink_reserve(s, SINK_MAXREC);
+	d = fmt_uint(fmt_str(d, "{\"ts\":"), r->ts);
+	d = fmt_str(fmt_str(d, ",\"type\":\""), rec_descs[r->type].name);
+	d = fmt_uint(fmt_str(d, "\",\"port\":"), r->port);
+	d = fmt_uint(fmt_str(d, ",\"seq\":"), r->seq);
+	d = fmt_uint(fmt_str(d, ",\"cmd\":"), r->cmd);
+	if(s->tagged && session_names[r->session]) {
+		d = fmt_str(fmt_str(d, ",\"session\":\""),
+			session_names[r->session]);
+		*d++ = '"';
 	}
-	else if((pkt->port & 0x40) == 0 && n != 1) {
-		fprintf(stderr, "[0x41]: Expected payload len 1, got %d\n", n);
-		return -1;
+	for(f = rec_descs[r->type].fields; f->name != NULL; f++) {
+		*d++ = ',';
+		*d++ = '"';
+		d = fmt_str(d, f->name);
+		*d++ = '"';
+		*d++ = ':';
+		d = fmt_value(d, r, f, 1);
 	}
+	*d++ = '}';
+	*d++ = '\n';
+	s->len = d - s->buf;
+}
 
-	if(pkt->port & 0x40) {
-		/* Parse command from server */
-		memcpy(buf, pkt->data + 1, 16);
-		buf[16] = 0;
-		printf("[0x41]: Camera firmware version: %s\n", buf);
+static void csv_record(struct sink *s, const struct record *r) {
+	const struct rec_field *f;
+	char *d;
+
+	d = sink_reserve(s, SINK_MAXREC);
+	d = fmt_uint(d, r->ts);
+	*d++ = ',';
+	d = fmt_str(d, rec_descs[r->type].name);
+	*d++ = ',';
+	d = fmt_uint(d, r->port);
+	*d++ = ',';
+	d = fmt_uint(d, r->seq);
+	*d++ = ',';
+	d = fmt_uint(d, r->cmd);
+	if(s->tagged) {
+		*d++ = ',';
+		if(session_names[r->session])
+			d = fmt_str(d, session_names[r->session]);
 	}
-	else {
-		printf("[0x41]: Camera firmware version check\n");
+	for(f = rec_descs[r->type].fields; f->name != NULL; f++) {
+		*d++ = ',';
+		d = fmt_value(d, r, f, 0);
 	}
-
-	return 0;
+	*d++ = '\n';
+	s->len = d - s->buf;
 }
 
-/* Response to command 0x49 (GPS/telemetry data) on port 0x0a */
-static int handle_packet_0x49(const struct pkt *pkt) {
-	int n;
-	float ag;
-	double hlat, hlon, lat, lon;
-	uint16_t satellites, volts;
-	uint16_t compass_x, compass_y, compass_z;
-	uint16_t accel_x, accel_y, accel_z;
-	const uint8_t *p = pkt->data;
-
-	n = pkt->len - 8;
-	if(n != 53) {
-		fprintf(stderr, "[0x49]: Expected payload len 53, got %d\n", n);
-		return -1;
+/* Encode a record as in binary output, returns its size */
+static uint16_t bin_encode(uint8_t *start, const struct record *r) {
+	const struct rec_field *f;
+	const uint8_t *src;
+	uint8_t *p = start;
+	uint16_t size;
+
+	p += 2;
+	*p++ = r->type;
+	*p++ = r->port;
+	*p++ = r->seq & 0xff;
+	*p++ = r->seq >> 8;
+	*p++ = r->cmd;
+	*p++ = r->session;
+	memcpy(p, &r->ts, 8);
+	p += 8;
+	/* Fixed size copies, a variable one is a slow rep movsb per field */
+	for(f = rec_descs[r->type].fields; f->name != NULL; f++) {
+		src = (const uint8_t *)r + f->off;
+		switch(f->size) {
+		case 1: *p = *src; break;
+		case 2: memcpy(p, src, 2); break;
+		case 4: memcpy(p, src, 4); break;
+		case 8: memcpy(p, src, 8); break;
+		default: memcpy(p, src, f->size); break;
+		}
+		p += f->size;
 	}
 
-	/* Always zero */
-	p++;
-
-	/* Number of GPS satellites locked */
-	satellites = *p++;
-	/* Home location */
-	hlon = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
-	hlat = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
-	/* Current location */
-	lon = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
-	lat = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
-
-	/**
-	 * Velocity..?
-	 * Never seen x or y change but z is positive in free
-	 * fall and negative when the aircraft is lifted quickly
-	 */
-	accel_x = p[0] | p[1] << 8; p += 2;
-	accel_y = p[0] | p[1] << 8; p += 2;
-	accel_z = p[0] | p[1] << 8; p += 2;
-
-	/* Altitude above home location (meters) */
-	ag = load_le_float(p); p += 4;
+	size = p - start;
+	start[0] = size & 0xff;
+	start[1] = size >> 8;
+	return size;
+}
 
-	/* Compass pitch, roll, yaw (degrees) */
-	compass_x = p[0] | p[1] << 8; p += 2;
-	compass_y = p[0] | p[1] << 8; p += 2;
-	compass_z = p[0] | p[1] << 8; p += 2;
+static void bin_record(struct sink *s, const struct record *r) {
+	s->len += bin_encode((uint8_t *)sink_reserve(s, SINK_MAXREC), r);
+}
 
-	/* Three remaining bytes.. assuming millivolts and an unknown byte */
-	volts = p[0] | p[1] << 8; p += 2;
-
-	printf("[0x49]: Seq %5u, GPS sats %d,"
-		" home [%+3.6f, %+3.6f] loc [%+3.6f, %+3.6f],"
-		" accel xyz [%+03d, %+03d, %+03d], ag %+3.1f meter,"
-		" compass roll/pitch/heading [%03d, %03d, %03d],"
-		" batt %5umV (%2.0f%%), unknown %-3d\n",
-		pkt->seq, satellites, hlat, hlon, lat, lon,
-		(int16_t)accel_x, (int16_t)accel_y, (int16_t)accel_z, ag,
-		compass_x, compass_y, compass_z,
-		volts, volts? (volts - 10800)/17.0: 0, p[0]);
+static void sink_record(struct sink *s, const struct record *r) {
+	s->records++;
+	switch(s->format) {
+	case SINK_TEXT:
+		text_record(s, r);
+		break;
+	case SINK_JSON:
+		json_record(s, r);
+		break;
+	case SINK_CSV:
+		csv_record(s, r);
+		break;
+	case SINK_BINARY:
+		bin_record(s, r);
+		break;
+	}
+}
 
-	return 0;
+/**
+ * Aircraft state
+ *
+ * The latest telemetry (0x49), flight mode (0x52) and battery status
+ * (0x53) of each session, updated in place as records are emitted so
+ * that other threads can ask where an aircraft is without following
+ * the output.  Each state has a single writer, the thread decoding the
+ * session's link, and any number of readers that never hold it up: the
+ * state is guarded by a sequence lock, odd while an update is under way,
+ * and a reader copies the line and tries again if the sequence number
+ * moved meanwhile.  Updates are wait-free, reads are only lock-free: a
+ * reader that keeps racing updates, or finds the writer descheduled in
+ * the middle of one, spins until it gets a clean copy.  An update takes
+ * nanoseconds and comes at most a few hundred times a second, so a read
+ * is in practice a single copy of one cache line.  See state_read().
+ */
+struct aircraft_state {
+	/* Even in snapshots, grows by 2 with every update */
+	uint32_t seq;
+	uint8_t sats, flight_mode, charge, batt_temp;
+	double lat, lon, home_lat, home_lon;
+	float alt;
+	uint16_t roll, pitch, heading, millivolts;
+	int16_t batt_current;
+	uint16_t batt_millivolts;
+	/* Time of the latest update, as in struct record */
+	uint64_t ts;
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct aircraft_state) == 64,
+	"aircraft state should fit in a cache line");
+
+/* Indexed by session number, as session_names */
+static struct aircraft_state states[256];
+
+static void state_update(const struct record *r) {
+	struct aircraft_state *st = &states[r->session];
+	uint32_t seq = st->seq;
+
+	if(r->type != REC_TELEMETRY && r->type != REC_FLIGHT_MODE &&
+		r->type != REC_POWER)
+		return;
+
+	__atomic_store_n(&st->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	switch(r->type) {
+	case REC_TELEMETRY:
+		st->sats = r->u.telemetry.sats;
+		st->lat = r->u.telemetry.lat;
+		st->lon = r->u.telemetry.lon;
+		st->home_lat = r->u.telemetry.home_lat;
+		st->home_lon = r->u.telemetry.home_lon;
+		st->alt = r->u.telemetry.alt;
+		st->roll = r->u.telemetry.roll;
+		st->pitch = r->u.telemetry.pitch;
+		st->heading = r->u.telemetry.heading;
+		st->millivolts = r->u.telemetry.millivolts;
+		break;
+	case REC_FLIGHT_MODE:
+		st->flight_mode = r->u.flight_mode.mode;
+		break;
+	default:
+		st->charge = r->u.power.charge;
+		st->batt_temp = r->u.power.temp;
+		st->batt_current = r->u.power.current;
+		st->batt_millivolts = r->u.power.millivolts;
+		break;
+	}
+	st->ts = r->ts;
+	__atomic_store_n(&st->seq, seq + 2, __ATOMIC_RELEASE);
 }
 
-/* Response to command 0x52 (flight mode) on port 0x0a */
-static int handle_packet_0x52(const struct pkt *pkt) {
-	int n;
+/**
+ * Copy a consistent snapshot of a session's state, from any thread,
+ * spinning while an update is under way.  Returns its sequence number,
+ * which is 0 until the first update and tells whether anything changed
+ * since an earlier snapshot.
+ */
+static uint32_t state_read(int session, struct aircraft_state *snap) {
+	const struct aircraft_state *st = &states[session];
+	uint32_t seq;
+
+	do {
+		while((seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		memcpy(snap, st, sizeof(*snap));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while(__atomic_load_n(&st->seq, __ATOMIC_RELAXED) != seq);
+
+	snap->seq = seq;
+	return seq;
+}
 
-	n = pkt->len - 8;
-	if(n != 6) {
-		fprintf(stderr, "[0x52]: Expected payload len 6, got %d\n", n);
-		return -1;
-	}
+static void state_print(int session, FILE *fp) {
+	struct aircraft_state st;
 
-	printf("[0x52]: Seq %5u, Flight mode: %s (%02x %02x %02x %02x %02x)\n",
-		pkt->seq,
-		pkt->data[1] == 0x00? "Manual":
-		pkt->data[1] == 0x01? "GPS":
-		pkt->data[1] == 0x02? "Fail safe (RTH)":
-		pkt->data[1] == 0x03? "ATTI": "Unknown", pkt->data[1],
-		pkt->data[2], pkt->data[3], pkt->data[4], pkt->data[5]);
+	if(state_read(session, &st) == 0)
+		return;
 
-	return 0;
+	fprintf(fp, "* State: [%+f, %+f] at %.1f m, heading %u, %u sats,"
+		" flight mode %u, battery %u%% %u mV %d mA, %u updates\n",
+		st.lat, st.lon, st.alt, st.heading, st.sats, st.flight_mode,
+		st.charge, st.batt_millivolts, st.batt_current, st.seq / 2);
 }
 
 /**
- * Response to command 0x53 (power status) on port 0x0a
- * The millivolt reading is generally slightly above the one seen in
- * response to command 0x49 (GPS/telemetry).
+ * Shared memory publisher
+ *
+ * With -P name the telemetry, flight mode, power and ground station
+ * records of each session are also written to a ring in /dev/shm, for
+ * other processes on the machine to map and follow.  See
+ * dji-phantom-shm.h for the layout and the reader side.  A session's
+ * ring is only written by the thread decoding it, which never waits
+ * for readers: publishing a record is a copy into the next slot and two
+ * release stores.
  */
-static int handle_packet_0x53(const struct pkt *pkt) {
-	int n;
-	uint16_t cap_design, cap_full, cap_cur, millivolts;
-	int16_t discharge_current;
-	uint8_t num_discharges, temperature, pct_life, pct_charge;
+#define SHM_SLOTS 4096
+
+static struct dji_shm_ring *shm_rings[256];
+static char shm_paths[256][80];
+
+_Static_assert(REC_TELEMETRY == DJI_SHM_TELEMETRY &&
+	REC_FLIGHT_MODE == DJI_SHM_FLIGHT_MODE && REC_POWER == DJI_SHM_POWER &&
+	REC_GS_WAYPOINT == DJI_SHM_GS_WAYPOINT &&
+	REC_GS_STATUS == DJI_SHM_GS_STATUS && REC_GS_ATTI == DJI_SHM_GS_ATTI,
+	"record types in dji-phantom-shm.h are out of date");
+
+static const uint8_t shm_published[REC_TYPES] = {
+	[REC_TELEMETRY] = sizeof(struct dji_shm_telemetry),
+	[REC_FLIGHT_MODE] = sizeof(struct dji_shm_flight_mode),
+	[REC_POWER] = sizeof(struct dji_shm_power),
+	[REC_GS_WAYPOINT] = sizeof(struct dji_shm_gs_waypoint),
+	[REC_GS_STATUS] = sizeof(struct dji_shm_gs_status),
+	[REC_GS_ATTI] = sizeof(struct dji_shm_gs_atti),
+};
 
-	n = pkt->len - 8;
-	if(n != 16) {
-		fprintf(stderr, "[0x53]: Expected payload len 16, got %d\n", n);
-		return -1;
+/**
+ * Create the ring of a session, named name or name.suffix, replacing
+ * any earlier one.  Readers of that keep what they have mapped.
+ */
+static int shm_ring_create(const char *name, int session, const char *suffix) {
+	const struct rec_field *f;
+	struct dji_shm_ring *ring;
+	char *path = shm_paths[session];
+	size_t size;
+	int fd, t, n;
+
+	/* The packed structs in the header mirror the field tables */
+	for(t = 0; t < REC_TYPES; t++) {
+		for(n = 0, f = rec_descs[t].fields; f->name != NULL; f++)
+			n += f->size;
+		if(shm_published[t] && shm_published[t] != n) {
+			fprintf(stderr, "ERROR: %s records differ from"
+				" dji-phantom-shm.h\n", rec_descs[t].name);
+			return -1;
+		}
 	}
 
-	/* Battery capacity */
-	cap_design = pkt->data[1] | pkt->data[2] << 8;
-	cap_full = pkt->data[3] | pkt->data[4] << 8;
-	cap_cur = pkt->data[5] | pkt->data[6] << 8;
-
-	/* Current status */
-	millivolts = pkt->data[7] | pkt->data[8] << 8;
-	discharge_current = pkt->data[9] | pkt->data[10] << 8;
-	/* Battery lifetime and charge left */
-	pct_life = pkt->data[11];
-	pct_charge = pkt->data[12];
-	/* Internal temperature and number of discharges */
-	temperature = pkt->data[13];
-	num_discharges = pkt->data[14] | pkt->data[15] << 8;
-
-	printf("[0x53]: Seq %5u, battery capacity design/full/now %4u/%4u/%4umAh,"
-		" status <%5umV, % 5dmA>, discharges %3u, temp %2uC,"
-		" battery life/charge %2u%%/%2u%%\n",
-		pkt->seq, cap_design, cap_full, cap_cur,
-		millivolts, discharge_current, num_discharges, temperature,
-		pct_life, pct_charge);
+	snprintf(path, sizeof(shm_paths[0]), suffix? "/%s.%s": "/%s", name,
+		suffix);
+	shm_unlink(path);
+	size = sizeof(*ring) + SHM_SLOTS * sizeof(ring->slots[0]);
+	if((fd = shm_open(path, O_RDWR|O_CREAT|O_EXCL, 0644)) < 0 ||
+		ftruncate(fd, size) < 0 ||
+		(ring = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+			0)) == MAP_FAILED) {
+		fprintf(stderr, "ERROR: Failed to create /dev/shm%s: %s\n", path,
+			strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		path[0] = 0;
+		return -1;
+	}
 
+	close(fd);
+	ring->nslots = SHM_SLOTS;
+	ring->slot_size = sizeof(ring->slots[0]);
+	__atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+	memcpy(ring->magic, DJI_SHM_MAGIC, 8);
+	shm_rings[session] = ring;
 	return 0;
 }
 
-static uint32_t gs_key[] = { 0x0100020f, 0x09301200, 0x12060109, 0x9007050d };
+static void shm_publish(const struct record *r) {
+	struct dji_shm_ring *ring = shm_rings[r->session];
+	struct dji_shm_slot *slot;
+	uint64_t head;
+
+	if(ring == NULL || !shm_published[r->type])
+		return;
+
+	head = ring->head;
+	slot = &ring->slots[head & (SHM_SLOTS - 1)];
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	bin_encode(slot->rec, r);
+	__atomic_store_n(&slot->seq, head + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
 
-#define DELTA 0x9e3779b9
-#define MX (((z>>5^y<<2) + (y>>3^z<<4)) ^ ((sum^y) + (key[(p&3)^e] ^ z)))
+/* Remove the rings, readers keep what they have mapped */
+static void shm_unlink_all(void) {
+	int i;
 
-/* Modified Corrected Block TEA (XXTEA) */
-void btea(uint32_t *v, int n, uint32_t const key[4]) {
-	uint32_t y, z, sum;
-	unsigned p, rounds, e;
-	if (n > 1) {          /* Coding Part */
-		rounds = 1 + 52/n;
-		sum = 0;
-		z = v[n-1];
-		do {
-			sum += DELTA;
-			e = (sum >> 2) & 3;
-			for (p=0; p<n-1; p++) {
-				y = v[p+1];
-				z = v[p] += MX;
-			}
-			y = v[0];
-			z = v[n-1] += MX;
-		} while (--rounds);
-	}
-	else if (n < -1) {  /* Decoding Part */
-		n = -n;
-		rounds = 1 + 52/n;
-		sum = rounds*DELTA;
-		y = v[0];
-		do {
-			e = (sum >> 2) & 3;
-			for (p=n-1; p>0; p--) {
-				z = v[p-1];
-				y = v[p] -= MX;
-			}
-			z = v[n-1];
-			y = v[0] -= MX;
-		} while ((sum -= DELTA) != 0);
-	}
+	for(i = 0; i < 256; i++)
+		if(shm_paths[i][0])
+			shm_unlink(shm_paths[i]);
 }
 
-static int gs_handle_set_waypoint_0x301(const struct pkt *pkt, const uint8_t *data, uint16_t len) {
-	struct {
-		uint32_t id;
-		/* 0 == stop and turn, 1 == bank turn, 2 == adaptive bank turn */
-		uint8_t turn_mode;
-		double lat, lon;
-		float alt, vel;
-		uint16_t timelimit;
-		float heading;
-		uint16_t stationary_time;
-		uint32_t start_delay, period, repeat_time, repeat_distance;
-	} w;
-
-	const uint8_t *p = data;
+/**
+ * Telemetry archive
+ *
+ * With -A file the telemetry (0x49) and power (0x53) records of every
+ * session are also appended to a columnar archive, for keeping months
+ * of flights around.  Records are collected per session and type into
+ * blocks of up to ARC_BLOCK_RECORDS, or a minute's worth, and a block
+ * is stored column by column since consecutive values of a field barely
+ * change:
+ *
+ * - timestamps as zigzag varints of their delta of deltas, which is
+ *   zero for a steady poll rate
+ * - seq, port, cmd and integer fields as zigzag varint deltas
+ * - floats and doubles Gorilla style, XORed with the previous value: a
+ *   0 bit when unchanged, otherwise the meaningful bits of the XOR and,
+ *   unless the previous window of leading and trailing zeros still
+ *   fits, the new window
+ *
+ * Every block starts with an index of the min and max of each column,
+ * the time range included.  A column whose values are all the same
+ * (home point, design capacity, ...) is stored as just that and takes
+ * nothing beyond its index entry.  The file is the 8 byte magic
+ * "DJIARC1\n" followed by blocks, and archives are only ever appended
+ * to: each block goes out in a single write(), so sessions decoded on
+ * different threads never interleave.
+ *
+ * -a file maps an archive and emits its records in the usual output
+ * formats, block by block.  With -i from[,to], in seconds since the
+ * epoch, blocks whose time range is outside that aren't even decoded.
+ *
+ * Blocks are little-endian: <u32 size (including this header), u8 type,
+ * u8 session, u16 records, u8 columns, 7 bytes zero> followed by <i64
+ * or f64 min, max, u32 data size> per column, ts first, then seq, port,
+ * cmd and the fields of the record type in rec_descs[] order, and then
+ * the data of the columns back to back.
+ */
+#define ARC_MAGIC "DJIARC1\n"
+#define ARC_BLOCK_RECORDS 1024
+#define ARC_BLOCK_NS (60 * 1000000000ull)
+#define ARC_MAX_COLUMNS 24
+#define ARC_HDRSZ 16
+#define ARC_COLSZ 20
+
+static const struct rec_field arc_header_fields[] = {
+	{ "seq", F_U16, 2, offsetof(struct record, seq) },
+	{ "port", F_U8, 1, offsetof(struct record, port) },
+	{ "cmd", F_U8, 1, offsetof(struct record, cmd) },
+	{ NULL }
+};
 
-	p += 3;
-	w.id = p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24; p += 4;
-	w.turn_mode = p[0]; p += 1;
-	w.lat = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
-	w.lon = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
-	w.alt = load_le_float(p); p += 4;
-	w.vel = load_le_float(p); p += 4;
-	w.timelimit = p[0] | p[1] << 8; p += 2;
-	w.heading = load_le_float(p);
-
-	printf("[0x%02x] [GS 0x%04x] Waypoint number %-2d, turn mode %d,"
-		" location [%+3.6f, %+3.6f], altitude %3.1f,"
-		" velocity %3.1fm/s, heading %3.1f\n",
-		pkt->cmd, 0x301, w.id, w.turn_mode, w.lat, w.lon,
-		w.alt, w.vel, w.heading);
+static const uint8_t arc_archived[REC_TYPES] = {
+	[REC_TELEMETRY] = 1, [REC_POWER] = 1,
+};
 
-	return 0;
-}
+/* Records waiting to fill a block */
+struct arc_series {
+	int n;
+	struct record r[ARC_BLOCK_RECORDS];
+};
 
-static int gs_handle_send_general_status_0x341(const struct pkt *pkt, const uint8_t *data, uint16_t len) {
-	const uint8_t *p = data;
-	double lat, lon;
-	float f;
-	uint16_t u;
+static int arc_fd = -1;
+static struct arc_series *arc_series[256][REC_TYPES];
+static unsigned long long arc_records, arc_blocks, arc_bytes;
 
-	p += 9;
-	u = p[0] | p[1] << 8; p += 2;
-	p += 12;
-	lat = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
-	lon = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
-	p += 3;
-	f = load_be_float(p); p += 4;
+/* Column values as bits */
+struct arc_bits {
+	uint8_t *buf;
+	size_t pos, len;
+};
 
-	printf("[0x%02x] [GS 0x%04x] General status location [%+3.6f, %+3.6f],"
-		" u16 %-5d (0x%04x), float %+3.3f\n", pkt->cmd, 0x341,
-		lat, lon, u, u, f);
+static void bits_put(struct arc_bits *b, uint64_t v, int n) {
+	int room, k;
 
-	return 0;
+	while(n > 0) {
+		room = 8 - (b->pos & 7);
+		k = n < room? n: room;
+		n -= k;
+		b->buf[b->pos >> 3] |= (v >> n & ((1u << k) - 1)) << (room - k);
+		b->pos += k;
+	}
 }
 
-static int gs_handle_send_atti_pos_0x342(const struct pkt *pkt, const uint8_t *data, uint16_t len) {
-	const uint8_t *p = data;
-	double lat, lon;
-	float deg;
+/* Past the end reads as zeros and leaves pos beyond len */
+static uint64_t bits_get(struct arc_bits *b, int n) {
+	uint64_t v = 0;
+	int room, k;
 
-	p += 15;
-	lat = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
-	lon = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
-	deg = load_le_float(p) * 180.0 / 3.141592653589793; p += 4;
+	if(b->pos + n > b->len * 8) {
+		b->pos = b->len * 8 + 1;
+		return 0;
+	}
 
-	printf("[0x%02x] [GS 0x%04x] Attitude mode location [%+3.6f, %+3.6f],"
-		" deg %+3.3f\n", pkt->cmd, 0x342, lat, lon, deg);
-	return 0;
-}
+	while(n > 0) {
+		room = 8 - (b->pos & 7);
+		k = n < room? n: room;
+		n -= k;
+		v = v << k | (b->buf[b->pos >> 3] >> (room - k) & ((1u << k) - 1));
+		b->pos += k;
+	}
 
-static int gs_decrypt_packet(const struct pkt *pkt) {
-	uint8_t data[255], n;
-	uint16_t len, seq, cmd;
-	const uint8_t *p;
-	int32_t blocks;
+	return v;
+}
 
-	p = pkt->data;
-	n = pkt->len - 8;
-	if(pkt->cmd == 0x81) {
-		p++;
-		n--;
+static uint8_t *put_varint(uint8_t *p, uint64_t v) {
+	while(v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
 	}
 
-	len = p[0] | p[1] << 8; p += 2; len -= 2;
-	printf("[0x%02x] GS: Decrypting packet with len %d (0x%02x), data len %d (0x%02x), encrypted payload len is %d (0x%04x), last bytes %02x%02x\n",
-		pkt->cmd, pkt->len, pkt->len, n, n, len, len, p[len - 2], p[len - 1]);
+	*p++ = v;
+	return p;
+}
 
-	if(len + 2 != n) {
-		printf("[0x%02x] GS: Packet data length %d (0x%04x) differs from encrypted payload length %d (0x%04x)\n",
-			pkt->cmd, n, n, len + 2, len + 2);
-		dump_packet(pkt);
-		// return -1;
+/* Returns NULL if the varint runs past end */
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end,
+		uint64_t *v) {
+	int shift = 0;
+
+	*v = 0;
+	while(p < end && shift < 64) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if(!(*p++ & 0x80))
+			return p;
+		shift += 7;
 	}
 
-	if(pkt->cmd == 0x81) {
-		printf("[0x%02x] GS: Checksum bytes %02x%02x (0x%04x), footer %02x%02x\n",
-			pkt->cmd,
-			p[len - 4], p[len - 3], p[len - 4] | p[len - 3] << 8,
-			p[len - 2], p[len - 1]);
-		len -= 4;
-	}
+	return NULL;
+}
 
-	blocks = len / 4;
-	memcpy(data, p, len);
-	printf("[0x%02x] GS: Decrypting %d dwords, %d (0x%02x) bytes of %d bytes encrypted payload\n",
-		pkt->cmd, blocks, blocks * 4, blocks * 4, len);
+static uint64_t zigzag(int64_t v) {
+	return (uint64_t)v << 1 ^ (uint64_t)(v >> 63);
+}
 
-	btea((uint32_t *)data, -blocks, gs_key);
-	printf("[0x%02x] GS: Decrypted ", pkt->cmd);
-	for(int i = 0; i < blocks * 4; i++) printf("%02x", data[i]);
-	printf("  ");
-	for(int i = blocks * 4; i < len; i++) printf("%02x", data[i]);
-	printf(" (remaining)\n");
-
-#if 0
-	/* Old checksum tests.. perhaps CRC-16? */
-	p = temp;
-	memcpy(temp, pkt, 8);
-	memcpy(temp + 8, pkt->data, 2);
-	memcpy(temp + 10, data, len);
-	p += 18;
-	for(cs32 = i = 0; i < blocks + 3; i++) {
-		cs32 ^= ((uint32_t *)p)[i];
-		printf("cs32: adding 0x%08x (%08x)\n", ((uint32_t *)p)[i], cs32);
-	}
-	for(cs16 = i = 0; i < 2*blocks + 12/2; i++) {
-		cs16 ^= ((uint16_t *)p)[i];
-		printf("cs16: adding 0x%04x (%04x)\n", ((uint16_t *)p)[i], cs16);
-	}
-	for(cs_a = cs_b = i = 0; i < 4*blocks + 12; i++) {
-		cs_a += p[i];
-		cs_b += cs_a;
-		printf("csab: added 0x%02x (%02x %02x)\n", p[i], cs_a, cs_b);
-	}
-	printf("[0x%02x] GS: Sequence %-5u, command %-5u (0x%04x), cs32=%08x, cs16=%04x cs_a=%02x cs_b=%02x\n", pkt->cmd, seq, cmd, cmd, cs32, cs16, cs_a, cs_b);
-#endif
+static int64_t unzigzag(uint64_t v) {
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
 
-	p = data;
-	p++; /* always zero */
-	seq = p[0] | p[1] << 8; p += 2;
-	cmd = p[0] | p[1] << 8; p += 2;
+static int arc_is_float(const struct rec_field *f) {
+	return f->kind == F_F32 || f->kind == F_F64;
+}
 
-	printf("[0x%02x] GS: Sequence %-5u, command %-5u (0x%04x)\n", pkt->cmd, seq, cmd, cmd);
+/* A field as a signed integer, or the bits of a float */
+static uint64_t arc_load(const struct record *r, const struct rec_field *f) {
+	const uint8_t *p = (const uint8_t *)r + f->off;
+	uint64_t v = 0;
 
-	switch(cmd) {
-	case 0x301:
-		gs_handle_set_waypoint_0x301(pkt, p, len - 5);
-		break;
-	case 0x341:
-		gs_handle_send_general_status_0x341(pkt, p, len -5);
-		break;
-	case 0x342:
-		gs_handle_send_atti_pos_0x342(pkt, p, len - 5);
-		break;
+	memcpy(&v, p, f->size);
+	switch(f->kind) {
+	case F_I16:
+		return (int64_t)(int16_t)v;
+	default:
+		return v;
 	}
-
-	return 0;
 }
 
-/* Response to command 0x90 (start compass calibration) on port 0x0a */
-static int handle_packet_0x90(const struct pkt *pkt) {
-	int n;
+/* Little-endian, the low bytes of either */
+static void arc_store(struct record *r, const struct rec_field *f, uint64_t v) {
+	memcpy((uint8_t *)r + f->off, &v, f->size);
+}
 
-	n = pkt->len - 8;
-	if(n != 2) {
-		fprintf(stderr, "[0x90]: Expected payload len 2, got %d\n", n);
-		return -1;
-	}
+static double arc_double(const struct rec_field *f, uint64_t v) {
+	float f32;
+	double f64;
 
-	switch(pkt->data[0]) {
-	case 0x00:
-		printf("[0x90]: Started compass calibration, status: 0x%02x\n",
-			pkt->data[1]);
-		break;
-	case 0xe0 ... 0xef:
-	default:
-		printf("[0x90]: Unexpected response with payload: 0x%04x",
-			pkt->data[0] << 8 | pkt->data[1]);
-		break;
+	if(f->kind == F_F32) {
+		memcpy(&f32, &v, 4);
+		return f32;
 	}
 
-	return 0;
+	memcpy(&f64, &v, 8);
+	return f64;
 }
 
-/* Handle errors */
-static int handle_packet_0xff(const struct pkt *pkt) {
-
-	printf("[0xff]: Seq %5u, error reply from port 0x%02x:"
-		" code 0x%02x, %d bytes payload\n", pkt->seq,
-		pkt->port & 0x3f, pkt->data[0], pkt->len - 8);
-	dump_packet(pkt);
+static uint64_t arc_from_double(const struct rec_field *f, double d) {
+	uint64_t v = 0;
+	float f32 = d;
 
-	return 0;
+	if(f->kind == F_F32)
+		memcpy(&v, &f32, 4);
+	else
+		memcpy(&v, &d, 8);
+	return v;
 }
 
-/* Print generic packet information */
-static int filter_packet(const struct pkt *pkt) {
-	int err = 0;
+static int arc_columns(int type, const struct rec_field **cols) {
+	const struct rec_field *f;
+	int n = 0;
 
-	if((pkt->data[0] & 0xe0) == 0xe0) err = pkt->data[0] & 0x1f;
-	printf("** %s port 0x%02x, seq % 5d, cmd 0x%02x,"
-		" error %d, payload len % 2d\n",
-		(pkt->port >> 6) == 0? "Sent to ":
-		(pkt->port >> 6) == 1? "Rcv from": "UNKN DIR",
-		pkt->port & 0x3f, pkt->seq,
-		pkt->cmd, err, pkt->len - 8);
-	fflush(stdout);
+	for(f = arc_header_fields; f->name != NULL; f++)
+		cols[n++] = f;
+	for(f = rec_descs[type].fields; f->name != NULL && n < ARC_MAX_COLUMNS;
+		f++)
+		cols[n++] = f;
+	return n;
+}
 
-	if(pkt->magic != DJI_PHANTOM_MAGIC)
-		printf("** Packet error: Invalid magic <0x%02x, 0x%02x>"
-			" (expected: 55 bb)\n", pkt->magic >> 8, pkt->magic & 0xff);
-	if(pkt->len < 9)
-		printf("** Packet error: Invalid length %u (expected >= 9)\n",
-			pkt->len);
+static void gorilla_encode(struct arc_bits *b, const struct record *r, int n,
+		const struct rec_field *f) {
+	int width = f->size * 8, lead, trail, plead = -1, ptrail = 0, sig;
+	uint64_t v, prev, x;
+	int i;
+
+	prev = arc_load(&r[0], f);
+	bits_put(b, prev, width);
+	for(i = 1; i < n; i++, prev = v) {
+		v = arc_load(&r[i], f);
+		if((x = v ^ prev) == 0) {
+			bits_put(b, 0, 1);
+			continue;
+		}
 
-	if(err || pkt->magic != DJI_PHANTOM_MAGIC || pkt->len < 9)
-		dump_packet(pkt);
+		lead = __builtin_clzll(x) - (64 - width);
+		if(lead > 31) lead = 31;
+		trail = __builtin_ctzll(x);
+		if(plead >= 0 && lead >= plead && trail >= ptrail) {
+			bits_put(b, 2, 2);
+			bits_put(b, x >> ptrail, width - plead - ptrail);
+			continue;
+		}
 
-	return 0;
+		sig = width - lead - trail;
+		bits_put(b, 3, 2);
+		bits_put(b, lead, 5);
+		bits_put(b, sig - 1, width == 64? 6: 5);
+		bits_put(b, x >> trail, sig);
+		plead = lead;
+		ptrail = trail;
+	}
 }
 
-/* Route packet to appropriate handlers */
-static int decode_packet(const struct pkt *pkt) {
+static int gorilla_decode(struct arc_bits *b, struct record *r, int n,
+		const struct rec_field *f) {
+	int width = f->size * 8, lead, trail = 0, plead = -1, sig = 0;
+	uint64_t v;
+	int i;
+
+	v = bits_get(b, width);
+	arc_store(&r[0], f, v);
+	for(i = 1; i < n; i++) {
+		if(bits_get(b, 1)) {
+			if(bits_get(b, 1)) {
+				lead = bits_get(b, 5);
+				sig = bits_get(b, width == 64? 6: 5) + 1;
+				if((trail = width - lead - sig) < 0)
+					return -1;
+				plead = lead;
+			}
+			else if(plead < 0)
+				return -1;
 
-	switch(pkt->cmd) {
-	case 0x04:
-		printf("0x04: server says hello!\n");
-		break;
-	case 0x01:
-		handle_packet_0x01(pkt);
-		break;
-	case 0x02:
-		handle_packet_0x02(pkt);
-		break;
-	case 0x20:
-		handle_packet_0x20(pkt);
-		break;
-	case 0x2d:
-		handle_packet_0x2d(pkt);
-		break;
-	case 0x32:
-		handle_packet_0x32(pkt);
-		break;
-	case 0x41:
-		handle_packet_0x41(pkt);
-		break;
-	case 0x49:
-		handle_packet_0x49(pkt);
-		break;
-	case 0x52:
-		handle_packet_0x52(pkt);
-		break;
-	case 0x53:
-		handle_packet_0x53(pkt);
-		break;
-	case 0x80:
-	case 0x81:
-		return gs_decrypt_packet(pkt);
-		break;
-	case 0x90:
-		handle_packet_0x90(pkt);
-		break;
-	case 0xff:
-		handle_packet_0xff(pkt);
-		break;
-	default:
-		printf("[0x%02x]: Seq %5u, unhandled cmd 0x%02x from"
-			" port 0x%02x (%d bytes payload)\n", pkt->cmd >> 8,
-			pkt->seq, pkt->cmd, pkt->port & 0x3f, pkt->len - 9);
-		dump_packet(pkt);
-		break;
+			v ^= bits_get(b, sig) << trail;
+		}
+		arc_store(&r[i], f, v);
 	}
 
-	return 0;
+	return b->pos > b->len * 8? -1: 0;
 }
 
-static ssize_t read_block(int fd, uint8_t *dst, size_t len) {
-	uint8_t *p = dst;
+/* Encode and append a series' records as a block */
+static int arc_flush(struct arc_series *sr, int type, int session) {
+	const struct rec_field *cols[ARC_MAX_COLUMNS], *f;
+	const struct record *r = sr->r;
+	uint8_t *buf, *p, *col, *start;
+	uint64_t v, prev, tsmin, tsmax;
+	int64_t delta, pdelta = 0, imin, imax;
+	double d, dmin, dmax;
+	struct arc_bits b;
+	size_t size;
 	ssize_t ret;
+	int ncols, c, i, n = sr->n, same;
+	uint32_t len;
 
-	while(len > 0) {
-		if((ret = recv(fd, p, len, 0)) <= 0) {
-			fprintf(stderr, "recv() returned %zd\n", ret);
-			return -1;
+	if(n == 0)
+		return 0;
+
+	ncols = arc_columns(type, cols);
+	size = ARC_HDRSZ + (ncols + 1) * ARC_COLSZ + n * 10 * (ncols + 1);
+	if((buf = calloc(1, size)) == NULL)
+		return -1;
+
+	/* Timestamps, the first as is */
+	col = buf + ARC_HDRSZ;
+	p = start = col + (ncols + 1) * ARC_COLSZ;
+	tsmin = tsmax = prev = r[0].ts;
+	p = put_varint(p, prev);
+	for(i = 1; i < n; prev = r[i++].ts) {
+		delta = r[i].ts - prev;
+		p = put_varint(p, zigzag(delta - pdelta));
+		pdelta = delta;
+		if(r[i].ts < tsmin) tsmin = r[i].ts;
+		if(r[i].ts > tsmax) tsmax = r[i].ts;
+	}
+
+	len = p - start;
+	memcpy(col, &tsmin, 8);
+	memcpy(col + 8, &tsmax, 8);
+	memcpy(col + 16, &len, 4);
+
+	for(c = 0; c < ncols; c++) {
+		f = cols[c];
+		col += ARC_COLSZ;
+		start = p;
+		prev = arc_load(&r[0], f);
+		imin = imax = prev;
+		dmin = dmax = arc_double(f, prev);
+		for(i = 1, same = 1; i < n; i++) {
+			v = arc_load(&r[i], f);
+			same &= v == prev;
+			if(!arc_is_float(f)) {
+				if((int64_t)v < imin) imin = v;
+				if((int64_t)v > imax) imax = v;
+			}
+			else if(!isnan(d = arc_double(f, v))) {
+				/* NaN is neither */
+				if(d < dmin || isnan(dmin)) dmin = d;
+				if(d > dmax || isnan(dmax)) dmax = d;
+			}
 		}
 
-		p += ret;
-		len -= ret;
+		if(arc_is_float(f)) {
+			memcpy(col, &dmin, 8);
+			memcpy(col + 8, &dmax, 8);
+			/* Constants are restored from min, which can't be NaN */
+			same &= !isnan(dmin);
+		}
+		else {
+			memcpy(col, &imin, 8);
+			memcpy(col + 8, &imax, 8);
+		}
+
+		if(same)
+			;
+		else if(arc_is_float(f)) {
+			b.buf = p;
+			b.pos = 0;
+			gorilla_encode(&b, r, n, f);
+			p += (b.pos + 7) / 8;
+		}
+		else {
+			for(i = 0, prev = 0; i < n; prev = v, i++) {
+				v = arc_load(&r[i], f);
+				p = put_varint(p, zigzag(v - prev));
+			}
+		}
+
+		len = p - start;
+		memcpy(col + 16, &len, 4);
+	}
+
+	size = p - buf;
+	len = size;
+	memcpy(buf, &len, 4);
+	buf[4] = type;
+	buf[5] = session;
+	buf[6] = n & 0xff;
+	buf[7] = n >> 8;
+	buf[8] = ncols + 1;
+	ret = write(arc_fd, buf, size);
+	free(buf);
+	sr->n = 0;
+	if(ret != (ssize_t)size) {
+		fprintf(stderr, "ERROR: Failed to write to archive: %s\n",
+			ret < 0? strerror(errno): "Short write");
+		return -1;
 	}
 
+	__atomic_add_fetch(&arc_records, n, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&arc_blocks, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&arc_bytes, size, __ATOMIC_RELAXED);
 	return 0;
 }
 
-static struct pkt *read_packet(int fd) {
-	static uint16_t seq = 0;
-	static struct pkt pkt;
-	uint8_t buf[255], cksum, i, *p = buf;
+/**
+ * Decode a block into r, which has room for ARC_BLOCK_RECORDS.  Returns
+ * the number of records or -1 if the block is corrupt.
+ */
+static int arc_decode(const uint8_t *blk, size_t size, struct record *r) {
+	const struct rec_field *cols[ARC_MAX_COLUMNS], *f;
+	const uint8_t *col, *p, *end;
+	uint64_t v, u;
+	int64_t delta = 0, imin;
+	double dmin;
+	struct arc_bits b;
+	uint32_t len;
+	int ncols, c, i, n, type = blk[4];
+
+	n = blk[6] | blk[7] << 8;
+	if(type >= REC_TYPES || n == 0 || n > ARC_BLOCK_RECORDS)
+		return -1;
+	ncols = arc_columns(type, cols);
+	if(blk[8] != ncols + 1 || size < ARC_HDRSZ + (ncols + 1) * ARC_COLSZ)
+		return -1;
 
-	memset(buf, 0xaa, sizeof(buf));
-	if(read_block(fd, p, 9) < 0)
-		return NULL;
+	memset(r, 0, n * sizeof(*r));
+	col = blk + ARC_HDRSZ;
+	p = col + (ncols + 1) * ARC_COLSZ;
+	for(c = -1; c < ncols; c++, col += ARC_COLSZ, p = end) {
+		memcpy(&len, col + 16, 4);
+		if(len > blk + size - p)
+			return -1;
+		end = p + len;
+
+		if(c < 0) {
+			/* Timestamps */
+			for(i = 0, v = 0; i < n; i++) {
+				if((p = get_varint(p, end, &u)) == NULL)
+					return -1;
+				if(i == 0)
+					v = u;
+				else
+					v += delta += unzigzag(u);
+				r[i].ts = v;
+				r[i].type = type;
+				r[i].session = blk[5];
+			}
+			continue;
+		}
 
-	pkt.magic = buf[0] | buf[1] << 8;
-	pkt.len = buf[2];
-	pkt.port = buf[3];
-	pkt.seq = buf[4] | buf[5] << 8;
-	pkt.cmd = buf[6];
-	if(pkt.magic != DJI_PHANTOM_MAGIC || pkt.len < 9) {
-		filter_packet(&pkt);
-		return NULL;
+		f = cols[c];
+		if(len == 0) {
+			memcpy(&imin, col, 8);
+			memcpy(&dmin, col, 8);
+			v = arc_is_float(f)? arc_from_double(f, dmin): (uint64_t)imin;
+			for(i = 0; i < n; i++)
+				arc_store(&r[i], f, v);
+		}
+		else if(arc_is_float(f)) {
+			b.buf = (uint8_t *)p;
+			b.pos = 0;
+			b.len = len;
+			if(gorilla_decode(&b, r, n, f) < 0)
+				return -1;
+		}
+		else {
+			for(i = 0, v = 0; i < n; i++) {
+				if((p = get_varint(p, end, &u)) == NULL)
+					return -1;
+				v += unzigzag(u);
+				arc_store(&r[i], f, v);
+			}
+		}
 	}
 
-	if(pkt.seq != seq) {
-		fprintf(stderr, "read_packet(): Out of sequence packet"
-			" <seq %u, port 0x%02x, len %u, cmd 0x%02x>, expected"
-			" seq %u\n", pkt.seq, pkt.port, pkt.len, pkt.cmd, seq);
-		/* Attempt to synchronize */
-		if(seq != 0xffff) seq = pkt.seq;
-	}
+	return n;
+}
 
-	if(read_block(fd, p + 9, pkt.len - 9) < 0)
-		return NULL;
+/* Collect a record, writing its series out once there's a block of it */
+static void arc_append(const struct record *r) {
+	struct arc_series **sp = &arc_series[r->session][r->type];
+	struct arc_series *sr = *sp;
 
-	seq++;
-	memcpy(pkt.data, buf + 7, pkt.len - 7);
-	pkt.status = pkt.data[0];
-	for(i = cksum = 0; i < pkt.len; i++) cksum ^= buf[i];
-	if(cksum != 0) {
-		fprintf(stderr, "Invalid checksum 0x%02x (expected 0x%02x)\n",
-			pkt.data[pkt.len - 9], pkt.data[pkt.len - 9] ^ cksum);
-		return NULL;
-	}
+	if(arc_fd < 0 || !arc_archived[r->type])
+		return;
 
-	filter_packet(&pkt);
-	return &pkt;
+	if(sr == NULL && (sr = *sp = calloc(1, sizeof(*sr))) == NULL)
+		return;
+
+	if(sr->n > 0 && r->ts - sr->r[0].ts >= ARC_BLOCK_NS)
+		arc_flush(sr, r->type, r->session);
+	sr->r[sr->n++] = *r;
+	if(sr->n == ARC_BLOCK_RECORDS)
+		arc_flush(sr, r->type, r->session);
 }
 
-static struct pkt *read_packet_from_hex_string(char *arg) {
-	static struct pkt pkt;
-	int j;
+/* Open an archive for appending, creating it if need be */
+static int arc_open(const char *path) {
+	char magic[8];
+	ssize_t n;
 
-	/**
-	 * If arg doesn't start with "55bb" (complete packet), it's assumed
-	 * the data is only command bytes and payload.  Examples:
-	 * $ ./dji-phantom -x 4900.......... to debug cmd 49
-	 * $ cat packets.txt | xargs ./dji-phantom -x
-	 */
-	memset(&pkt, 0, sizeof(pkt));
-	pkt.magic = DJI_PHANTOM_MAGIC;
-	if(!strncmp(arg, "55bb", 4)) {
-		arg += 4;
-		sscanf(arg, "%02hhx", &pkt.len); arg += 2;
-		sscanf(arg, "%02hhx", &pkt.port); arg += 2;
-		sscanf(arg, "%04hx", &pkt.seq); arg += 4;
-		pkt.seq = pkt.seq >> 8 | (pkt.seq & 0xff) << 8;
+	if((arc_fd = open(path, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0644)) < 0) {
+		fprintf(stderr, "ERROR: Failed to open %s: %s\n", path,
+			strerror(errno));
+		return -1;
 	}
-	else {
-		pkt.port = 0x40;  /* Assume reply on unknown port */
-		if(arg[0] == '0') {
-			/**
-			 * Kludge to load %06u sequence numbers, i.e
-			 * ./dji-phantom -x 0123454900... to debug cmd 49
-			 */
-			if(sscanf(arg, "%06hu", &pkt.seq) == 1)
-				arg += 6;
-		}
+
+	if((n = pread(arc_fd, magic, 8, 0)) == 0)
+		n = write(arc_fd, ARC_MAGIC, 8) == 8? 8: -1;
+	else if(n != 8 || memcmp(magic, ARC_MAGIC, 8)) {
+		fprintf(stderr, "ERROR: %s is not an archive\n", path);
+		goto fail;
 	}
 
-	sscanf(arg, "%02hhx", &pkt.cmd); arg += 2;
-	if(!pkt.len) pkt.len = 8 + strlen(arg) / 2;
+	if(n < 0) {
+		fprintf(stderr, "ERROR: Failed to write to %s: %s\n", path,
+			strerror(errno));
+		goto fail;
+	}
 
-	for(j = 0; j < pkt.len - 8; j++, arg += 2)
-		sscanf(arg, "%02hhx", pkt.data + j);
+	return 0;
 
-	filter_packet(&pkt);
-	return &pkt;
+fail:
+	close(arc_fd);
+	arc_fd = -1;
+	return -1;
 }
 
-static int send_packet(int fd, uint8_t port, uint8_t cmd, const uint8_t *data, uint8_t size) {
-	static uint16_t seq = 0;
-	uint8_t buf[255], i, len, n, *p = buf;
-	struct pkt pkt;
+/* Write out what's been collected, at exit */
+static void arc_close(void) {
+	int s, t;
 
-	len = 0;
-	buf[len++] = DJI_PHANTOM_MAGIC & 0xff;
-	buf[len++] = DJI_PHANTOM_MAGIC >> 8;
-	buf[len++] = 2 + 1 + 1 + 2 + 2 + size + 1;
-	buf[len++] = port & 0x3f;
-	buf[len++] = seq & 0xff;
-	buf[len++] = seq >> 8;
-	buf[len++] = cmd;
-	if(size > 0) {
-		memcpy(buf + len, data, size);
-		len += size;
-	}
+	if(arc_fd < 0)
+		return;
 
-	for(i = buf[len] = 0; i < len; i++) buf[len] ^= buf[i];
-	len++;
-	memcpy(&pkt, buf, len);
-	while(len > 0) {
-		if((n = send(fd, p, len, 0)) <= 0) return -1;
-		len -= n;
-		p += n;
-	}
+	for(s = 0; s < 256; s++)
+		for(t = 0; t < REC_TYPES; t++) {
+			if(arc_series[s][t] == NULL)
+				continue;
+			arc_flush(arc_series[s][t], t, s);
+			free(arc_series[s][t]);
+			arc_series[s][t] = NULL;
+		}
 
-	seq++;
+	close(arc_fd);
+	arc_fd = -1;
+}
 
-	return filter_packet(&pkt);
+static void arc_stats(FILE *fp) {
+	if(arc_blocks == 0)
+		return;
+
+	fprintf(fp, "* Archive: %llu records in %llu blocks, %llu bytes"
+		" (%.1f bytes per record)\n", arc_records, arc_blocks,
+		arc_bytes, (double)arc_bytes / arc_records);
 }
 
-static int connect_to_ser2net(void) {
-	int ret, s;
-	struct addrinfo hints, *ai, *ai0;
+/**
+ * Emit the records of an archive with timestamps in [from, to].  Blocks
+ * are walked by their headers and only decoded if their time range
+ * overlaps.
+ */
+static int arc_read(const char *path, uint64_t from, uint64_t to, int stats) {
+	unsigned long blocks = 0, skipped = 0, records = 0;
+	const uint8_t *base, *p, *end;
+	struct record *r;
+	struct stat st;
+	uint64_t tsmin, tsmax;
+	uint32_t size;
+	int fd, i, n, ret = 0;
+
+	if((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "ERROR: Failed to open %s: %s\n", path,
+			strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	if((ret = getaddrinfo("192.168.1.1", "2001", &hints, &ai0)) != 0) {
-		fprintf(stderr, "getaddrinfo(192.168.1.2:2001): %s",
-			gai_strerror(ret));
+	base = st.st_size > 0? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		fd, 0): MAP_FAILED;
+	close(fd);
+	if(base == MAP_FAILED || st.st_size < 8 || memcmp(base, ARC_MAGIC, 8)) {
+		fprintf(stderr, "ERROR: %s is not an archive\n", path);
+		if(base != MAP_FAILED)
+			munmap((void *)base, st.st_size);
 		return -1;
 	}
 
-	for(s = -1, ai = ai0; ai; ai = ai->ai_next) {
-		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if((r = malloc(ARC_BLOCK_RECORDS * sizeof(*r))) == NULL) {
+		munmap((void *)base, st.st_size);
+		return -1;
+	}
+
+	madvise((void *)base, st.st_size, MADV_SEQUENTIAL);
+	end = base + st.st_size;
+	for(p = base + 8; p < end; p += size) {
+		size = 0;
+		if(end - p >= ARC_HDRSZ + ARC_COLSZ)
+			memcpy(&size, p, 4);
+		if(size < ARC_HDRSZ + ARC_COLSZ || size > end - p) {
+			fprintf(stderr, "ERROR: %s: Truncated block at offset"
+				" %zu\n", path, (size_t)(p - base));
+			ret = -1;
+			break;
+		}
+
+		blocks++;
+		memcpy(&tsmin, p + ARC_HDRSZ, 8);
+		memcpy(&tsmax, p + ARC_HDRSZ + 8, 8);
+		if(tsmax < from || tsmin > to) {
+			skipped++;
+			continue;
+		}
+
+		if((n = arc_decode(p, size, r)) < 0) {
+			fprintf(stderr, "ERROR: %s: Corrupt block at offset %zu\n",
+				path, (size_t)(p - base));
+			ret = -1;
+			continue;
+		}
+
+		for(i = 0; i < n; i++) {
+			if(r[i].ts < from || r[i].ts > to)
+				continue;
+			sink_record(out, &r[i]);
+			records++;
+		}
+	}
+
+	if(stats)
+		fprintf(stderr, "* Archive: %lu records from %lu of %lu blocks,"
+			" %lu skipped\n", records, blocks - skipped, blocks,
+			skipped);
+	free(r);
+	munmap((void *)base, st.st_size);
+	return ret;
+}
+
+/* Hand a record filled in by a handler to the output sink */
+static int emit_record(const struct pkt *pkt, struct record *r, int type) {
+	r->ts = pkt->ts;
+	r->type = type;
+	r->port = pkt->port;
+	r->seq = pkt->seq;
+	r->cmd = pkt->cmd;
+	r->session = out_session;
+	state_update(r);
+	shm_publish(r);
+	arc_append(r);
+	sink_record(out, r);
+	return 0;
+}
+
+/**
+ * Direct output to path (or stdout for NULL or "-") in the named format
+ * and write the format's preamble.  Flushes happen at most every
+ * interval nanoseconds from sink_tick().
+ */
+static int sink_open(struct sink *s, const char *path, const char *format,
+		uint64_t interval) {
+	const struct rec_field *f;
+	int i;
+
+	for(i = 0; sink_formats[i] != NULL; i++)
+		if(!strcmp(sink_formats[i], format))
+			break;
+	if(sink_formats[i] == NULL) {
+		fprintf(stderr, "ERROR: Unknown output format '%s'\n", format);
+		return -1;
+	}
+
+	s->fd = 1;
+	if(path != NULL && strcmp(path, "-") &&
+		(s->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644)) < 0) {
+		fprintf(stderr, "ERROR: Failed to open %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	s->format = i;
+	s->interval = interval;
+	s->last = time_now_ns();
+	s->len = 0;
+	s->records = s->flushes = 0;
+	if(s->format == SINK_CSV) {
+		for(i = 0; i < REC_TYPES; i++) {
+			sink_printf(s, "#%s,ts,port,seq,cmd%s", rec_descs[i].name,
+				s->tagged? ",session": "");
+			for(f = rec_descs[i].fields; f->name != NULL; f++)
+				sink_printf(s, ",%s", f->name);
+			sink_printf(s, "\n");
+		}
+	}
+	else if(s->format == SINK_BINARY) {
+		memcpy(s->buf, SINK_BIN_MAGIC, 8);
+		s->len = 8;
+	}
+
+	return 0;
+}
+
+/* Set up s to write to the same place as the already open from */
+static void sink_share(struct sink *s, struct sink *from) {
+	from->lock = &sink_lock;
+	s->fd = from->fd;
+	s->format = from->format;
+	s->tagged = from->tagged;
+	s->interval = from->interval;
+	s->last = time_now_ns();
+	s->lock = from->lock;
+	s->len = 0;
+	s->records = s->flushes = 0;
+}
+
+static void sink_close(struct sink *s) {
+	sink_flush(s);
+	if(s->fd > 2)
+		close(s->fd);
+	s->fd = -1;
+}
+
+
+static void dump_packet(const struct pkt *pkt) {
+	uint8_t i;
+
+	if(out->format != SINK_TEXT)
+		return;
+
+	text_printf("** DUMP ");
+	for(i = 0; i < pkt->len; i++) {
+		text_printf("%s%02x%c", i % 16 == 0 && i? "\t": "", pkt->raw[i],
+			i % 16 == 15 && i != pkt->len - 1? '\n': ' ');
+	}
+	text_printf("\n");
+}
+
+/* Command 0x04 (hello) on port 0x08 */
+static int handle_packet_0x04(const struct pkt *pkt) {
+	struct record r;
+
+	r.u.status.code = r.u.status.arg = 0;
+	return emit_record(pkt, &r, REC_STATUS);
+}
+
+/* Response to command 0x01 (take picture) on port 0x08 */
+static int handle_packet_0x01(const struct pkt *pkt) {
+	struct record r;
+
+	r.u.status.code = pkt->data[0];
+	r.u.status.arg = pkt->len > 9? pkt->data[1]: 0;
+	return emit_record(pkt, &r, REC_STATUS);
+}
+
+/* Response to command 0x02 (start/stop recording) on port 0x08 */
+static int handle_packet_0x02(const struct pkt *pkt) {
+	struct record r;
+
+	r.u.status.code = pkt->data[0];
+	r.u.status.arg = pkt->len > 9? pkt->data[1]: 0;
+	return emit_record(pkt, &r, REC_STATUS);
+}
+
+/* Handle command 0x20 (set/ack camera time) on port 0x08 */
+static int handle_packet_0x20(const struct pkt *pkt) {
+	struct record r;
+
+	/* Only the full 7 bytes are a time, a 1 byte ack is a status */
+	switch(pkt->len - 8 == 7? pkt->data[0]: -1) {
+	case 0x10 ... 0x20:
+		snprintf(r.u.camera_time.time, sizeof(r.u.camera_time.time),
+			"%02x%02x-%02x-%02x %02x:%02x:%02x", pkt->data[1],
+			pkt->data[0], pkt->data[2], pkt->data[3],
+			pkt->data[4], pkt->data[5], pkt->data[6]);
+		return emit_record(pkt, &r, REC_CAMERA_TIME);
+	default:
+		r.u.status.code = pkt->data[0];
+		r.u.status.arg = 0;
+		return emit_record(pkt, &r, REC_STATUS);
+	}
+}
+
+/* Response to command 0x2d (unknown) on port 0x08 */
+static int handle_packet_0x2d(const struct pkt *pkt) {
+	struct record r;
+
+	r.u.status.code = pkt->data[0];
+	r.u.status.arg = pkt->len > 9? pkt->data[1]: 0;
+	return emit_record(pkt, &r, REC_STATUS);
+}
+
+/* Handle command 0x32 (report position) on port 0x0a */
+static int handle_packet_0x32(const struct pkt *pkt) {
+	struct record r;
+	const uint8_t *p = pkt->data;
+	int n;
+
+	n = pkt->len - 8;
+	if(n == 16) {
+		/* Parse command from client */
+		r.u.position.lon = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
+		r.u.position.lat = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
+		return emit_record(pkt, &r, REC_POSITION);
+	}
+
+	r.u.status.code = pkt->data[0];
+	r.u.status.arg = 0;
+	return emit_record(pkt, &r, REC_STATUS);
+}
+
+/* Handle command 0x41 (camera firmware version) on port 0x08 */
+static int handle_packet_0x41(const struct pkt *pkt) {
+	struct record r;
+	int n;
+
+	n = pkt->len - 8;
+	if(n == 17) {
+		/* Parse command from server */
+		memcpy(r.u.version.version, pkt->data + 1, 16);
+		r.u.version.version[16] = 0;
+		return emit_record(pkt, &r, REC_VERSION);
+	}
+
+	r.u.status.code = pkt->data[0];
+	r.u.status.arg = 0;
+	return emit_record(pkt, &r, REC_STATUS);
+}
+
+/* Response to command 0x49 (GPS/telemetry data) on port 0x0a */
+static int handle_packet_0x49(const struct pkt *pkt) {
+	struct record r;
+	const uint8_t *p = pkt->data;
+
+	/* Always zero */
+	p++;
+
+	/* Number of GPS satellites locked */
+	r.u.telemetry.sats = *p++;
+	/* Home location */
+	r.u.telemetry.home_lon = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
+	r.u.telemetry.home_lat = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
+	/* Current location */
+	r.u.telemetry.lon = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
+	r.u.telemetry.lat = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
+
+	/**
+	 * Velocity..?
+	 * Never seen x or y change but z is positive in free
+	 * fall and negative when the aircraft is lifted quickly
+	 */
+	r.u.telemetry.accel_x = p[0] | p[1] << 8; p += 2;
+	r.u.telemetry.accel_y = p[0] | p[1] << 8; p += 2;
+	r.u.telemetry.accel_z = p[0] | p[1] << 8; p += 2;
+
+	/* Altitude above home location (meters) */
+	r.u.telemetry.alt = load_le_float(p); p += 4;
+
+	/* Compass pitch, roll, yaw (degrees) */
+	r.u.telemetry.roll = p[0] | p[1] << 8; p += 2;
+	r.u.telemetry.pitch = p[0] | p[1] << 8; p += 2;
+	r.u.telemetry.heading = p[0] | p[1] << 8; p += 2;
+
+	/* Three remaining bytes.. assuming millivolts and an unknown byte */
+	r.u.telemetry.millivolts = p[0] | p[1] << 8; p += 2;
+	r.u.telemetry.unknown = p[0];
+
+	return emit_record(pkt, &r, REC_TELEMETRY);
+}
+
+/* Response to command 0x52 (flight mode) on port 0x0a */
+static int handle_packet_0x52(const struct pkt *pkt) {
+	struct record r;
+
+	/* 0 == Manual, 1 == GPS, 2 == Fail safe (RTH), 3 == ATTI */
+	r.u.flight_mode.mode = pkt->data[1];
+	r.u.flight_mode.unknown = pkt->data[2] | pkt->data[3] << 8 |
+		pkt->data[4] << 16 | (uint32_t)pkt->data[5] << 24;
+	return emit_record(pkt, &r, REC_FLIGHT_MODE);
+}
+
+/**
+ * Response to command 0x53 (power status) on port 0x0a
+ * The millivolt reading is generally slightly above the one seen in
+ * response to command 0x49 (GPS/telemetry).
+ */
+/* Fill in a power record from a 0x53 reply, also used by -Q battery */
+static void power_record(const struct pkt *pkt, struct record *r) {
+	/* Battery capacity */
+	r->u.power.cap_design = pkt->data[1] | pkt->data[2] << 8;
+	r->u.power.cap_full = pkt->data[3] | pkt->data[4] << 8;
+	r->u.power.cap_cur = pkt->data[5] | pkt->data[6] << 8;
+
+	/* Current status */
+	r->u.power.millivolts = pkt->data[7] | pkt->data[8] << 8;
+	r->u.power.current = pkt->data[9] | pkt->data[10] << 8;
+	/* Battery lifetime and charge left */
+	r->u.power.life = pkt->data[11];
+	r->u.power.charge = pkt->data[12];
+	/* Internal temperature and number of discharges */
+	r->u.power.temp = pkt->data[13];
+	r->u.power.discharges = pkt->data[14] | pkt->data[15] << 8;
+}
+
+static int handle_packet_0x53(const struct pkt *pkt) {
+	struct record r;
+
+	power_record(pkt, &r);
+	return emit_record(pkt, &r, REC_POWER);
+}
+
+static const uint32_t gs_key[] = { 0x0100020f, 0x09301200, 0x12060109, 0x9007050d };
+
+#define DELTA 0x9e3779b9
+#define MX (((z>>5^y<<2) + (y>>3^z<<4)) ^ ((sum^y) + (key[(p&3)^e] ^ z)))
+
+/**
+ * XXTEA specialized for gs_key
+ *
+ * Ground station payloads are short and come in a handful of lengths,
+ * where the round and index bookkeeping in btea() costs about as much
+ * as the arithmetic.  With the word count and the key known at compile
+ * time both loops unroll completely and the key words selected by
+ * (p&3)^e become immediates.  btea() hands gs_key buffers of up to
+ * BTEA_GS_MAX_WORDS words to one of these, the generated code is the
+ * same algorithm.
+ */
+#define BTEA_GS_MAX_WORDS 16
+
+static inline __attribute__((always_inline))
+void btea_unrolled(uint32_t *v, const int n, uint32_t const key[4]) {
+	const unsigned words = n < 0? -n: n, rounds = 1 + 52/words;
+	uint32_t y, z, sum;
+	unsigned p, r, e;
+	if (n > 1) {
+		sum = 0;
+		z = v[n-1];
+#pragma GCC unroll 32
+		for (r = 0; r < rounds; r++) {
+			sum += DELTA;
+			e = (sum >> 2) & 3;
+#pragma GCC unroll 16
+			for (p=0; p<words-1; p++) {
+				y = v[p+1];
+				z = v[p] += MX;
+			}
+			y = v[0];
+			z = v[words-1] += MX;
+		}
+	}
+	else {
+		sum = rounds*DELTA;
+		y = v[0];
+#pragma GCC unroll 32
+		for (r = 0; r < rounds; r++) {
+			e = (sum >> 2) & 3;
+#pragma GCC unroll 16
+			for (p=words-1; p>0; p--) {
+				z = v[p-1];
+				y = v[p] -= MX;
+			}
+			z = v[words-1];
+			y = v[0] -= MX;
+			sum -= DELTA;
+		}
+	}
+}
+
+#define BTEA_GS(n)							\
+static void btea_gs_enc##n(uint32_t *v) { btea_unrolled(v, n, gs_key); }	\
+static void btea_gs_dec##n(uint32_t *v) { btea_unrolled(v, -n, gs_key); }
+
+BTEA_GS(2) BTEA_GS(3) BTEA_GS(4) BTEA_GS(5) BTEA_GS(6) BTEA_GS(7)
+BTEA_GS(8) BTEA_GS(9) BTEA_GS(10) BTEA_GS(11) BTEA_GS(12) BTEA_GS(13)
+BTEA_GS(14) BTEA_GS(15) BTEA_GS(16)
+
+/* Indexed by n + BTEA_GS_MAX_WORDS, n as given to btea() */
+static void (*const btea_gs[2 * BTEA_GS_MAX_WORDS + 1])(uint32_t *v) = {
+	btea_gs_dec16, btea_gs_dec15, btea_gs_dec14, btea_gs_dec13,
+	btea_gs_dec12, btea_gs_dec11, btea_gs_dec10, btea_gs_dec9,
+	btea_gs_dec8, btea_gs_dec7, btea_gs_dec6, btea_gs_dec5,
+	btea_gs_dec4, btea_gs_dec3, btea_gs_dec2, NULL, NULL, NULL,
+	btea_gs_enc2, btea_gs_enc3, btea_gs_enc4, btea_gs_enc5,
+	btea_gs_enc6, btea_gs_enc7, btea_gs_enc8, btea_gs_enc9,
+	btea_gs_enc10, btea_gs_enc11, btea_gs_enc12, btea_gs_enc13,
+	btea_gs_enc14, btea_gs_enc15, btea_gs_enc16,
+};
+
+/* Modified Corrected Block TEA (XXTEA) */
+void btea(uint32_t *v, int n, uint32_t const key[4]) {
+	uint32_t y, z, sum;
+	unsigned p, rounds, e;
+	if (key == gs_key && n >= -BTEA_GS_MAX_WORDS && n <= BTEA_GS_MAX_WORDS &&
+		btea_gs[n + BTEA_GS_MAX_WORDS] != NULL) {
+		btea_gs[n + BTEA_GS_MAX_WORDS](v);
+		return;
+	}
+	if (n > 1) {          /* Coding Part */
+		rounds = 1 + 52/n;
+		sum = 0;
+		z = v[n-1];
+		do {
+			sum += DELTA;
+			e = (sum >> 2) & 3;
+			for (p=0; p<n-1; p++) {
+				y = v[p+1];
+				z = v[p] += MX;
+			}
+			y = v[0];
+			z = v[n-1] += MX;
+		} while (--rounds);
+	}
+	else if (n < -1) {  /* Decoding Part */
+		n = -n;
+		rounds = 1 + 52/n;
+		sum = rounds*DELTA;
+		y = v[0];
+		do {
+			e = (sum >> 2) & 3;
+			for (p=n-1; p>0; p--) {
+				z = v[p-1];
+				y = v[p] -= MX;
+			}
+			z = v[n-1];
+			y = v[0] -= MX;
+		} while ((sum -= DELTA) != 0);
+	}
+}
+
+/**
+ * Multi-buffer XXTEA
+ *
+ * Ground station payloads are usually processed in bulk (archived
+ * traffic, key and checksum searches) and are mostly of a handful of
+ * lengths, so several same-length buffers can be run through btea() at
+ * once, one buffer per SIMD lane.  All lanes share the key schedule so
+ * the algorithm is the same as above with y and z as vectors.  The
+ * buffers are transposed into lane-major order on the way in and back
+ * on the way out.  Uses AVX2 (8 lanes) when the CPU supports it, SSE2 or
+ * whatever the compiler makes of the generic vector types (4 lanes)
+ * otherwise, and the scalar btea() for the remainder.
+ */
+#define BTEA_MAX_WORDS 64
+
+typedef uint32_t btea_v4 __attribute__((vector_size(16)));
+typedef uint32_t btea_v8 __attribute__((vector_size(32)));
+
+#define BTEA_LANES(vtype) (sizeof(vtype) / sizeof(uint32_t))
+
+#define BTEA_VEC(name, vtype, attr)						\
+static attr void name(uint32_t *buf, int n, uint32_t const key[4]) {		\
+	vtype v[BTEA_MAX_WORDS], y, z;						\
+	uint32_t sum;								\
+	unsigned p, rounds, e, j, words = n < 0? -n: n;			\
+										\
+	for (j = 0; j < BTEA_LANES(vtype); j++)					\
+		for (p = 0; p < words; p++)					\
+			v[p][j] = buf[j*words + p];				\
+	if (n > 1) {								\
+		rounds = 1 + 52/n;						\
+		sum = 0;							\
+		z = v[n-1];							\
+		do {								\
+			sum += DELTA;						\
+			e = (sum >> 2) & 3;					\
+			for (p=0; p<n-1; p++) {					\
+				y = v[p+1];					\
+				z = v[p] += MX;					\
+			}							\
+			y = v[0];						\
+			z = v[n-1] += MX;					\
+		} while (--rounds);						\
+	}									\
+	else if (n < -1) {							\
+		n = -n;								\
+		rounds = 1 + 52/n;						\
+		sum = rounds*DELTA;						\
+		y = v[0];							\
+		do {								\
+			e = (sum >> 2) & 3;					\
+			for (p=n-1; p>0; p--) {					\
+				z = v[p-1];					\
+				y = v[p] -= MX;					\
+			}							\
+			z = v[n-1];						\
+			y = v[0] -= MX;						\
+		} while ((sum -= DELTA) != 0);					\
+	}									\
+	for (j = 0; j < BTEA_LANES(vtype); j++)					\
+		for (p = 0; p < words; p++)					\
+			buf[j*words + p] = v[p][j];				\
+}
+
+BTEA_VEC(btea_x4, btea_v4, )
+#if defined(__x86_64__) || defined(__i386__)
+BTEA_VEC(btea_x8, btea_v8, __attribute__((target("avx2"))))
+#else
+BTEA_VEC(btea_x8, btea_v8, )
+#endif
+
+/**
+ * Encrypt (n > 1) or decrypt (n < -1) count buffers of |n| words each,
+ * stored back to back in v.  Gives the same result as calling btea() on
+ * each of them.
+ */
+void btea_multi(uint32_t *v, int n, size_t count, uint32_t const key[4]) {
+	size_t words = n < 0? -n: n;
+	int wide = 0;
+
+	if(words < 2 || words > BTEA_MAX_WORDS) {
+		for(; count > 0; count--, v += words) btea(v, n, key);
+		return;
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	wide = __builtin_cpu_supports("avx2");
+#endif
+	for(; wide && count >= BTEA_LANES(btea_v8); count -= BTEA_LANES(btea_v8)) {
+		btea_x8(v, n, key);
+		v += words * BTEA_LANES(btea_v8);
+	}
+
+	for(; count >= BTEA_LANES(btea_v4); count -= BTEA_LANES(btea_v4)) {
+		btea_x4(v, n, key);
+		v += words * BTEA_LANES(btea_v4);
+	}
+
+	for(; count > 0; count--, v += words)
+		btea(v, n, key);
+}
+
+static int gs_handle_set_waypoint_0x301(const struct pkt *pkt, const uint8_t *data, uint16_t len) {
+	struct record r;
+	const uint8_t *p = data;
+
+	/* Feedback that merely names the command, see mission_feedback() */
+	if(len < 3 + 4 + 1 + 8 + 8 + 4 + 4 + 2 + 4) {
+		text_printf("[0x%02x] GS: No waypoint in %d bytes\n", pkt->cmd, len);
+		return -1;
+	}
+
+	p += 3;
+	r.u.waypoint.id = p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24; p += 4;
+	/* 0 == stop and turn, 1 == bank turn, 2 == adaptive bank turn */
+	r.u.waypoint.turn_mode = p[0]; p += 1;
+	r.u.waypoint.lat = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
+	r.u.waypoint.lon = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
+	r.u.waypoint.alt = load_le_float(p); p += 4;
+	r.u.waypoint.vel = load_le_float(p); p += 4;
+	r.u.waypoint.timelimit = p[0] | p[1] << 8; p += 2;
+	r.u.waypoint.heading = load_le_float(p);
+	/**
+	 * Followed by stationary time (u16), start delay, period, repeat
+	 * time and repeat distance (u32)
+	 */
+
+	return emit_record(pkt, &r, REC_GS_WAYPOINT);
+}
+
+/* Degrees to radians, the decoders above go the other way */
+#define GS_RAD (3.141592653589793 / 180.0)
+
+/**
+ * Encrypted 0x301 to set a waypoint, the inverse of the above.  The
+ * payload of the 0x80 frame is written to data, which needs room for
+ * GS_WAYPOINT_SIZE bytes.  The 5 byte header and 56 bytes of waypoint
+ * are padded to 16 words.
+ */
+#define GS_WAYPOINT_WORDS 16
+#define GS_WAYPOINT_SIZE (2 + GS_WAYPOINT_WORDS * 4 + 2)
+
+static int gs_encode_waypoint(uint8_t *data, uint16_t seq, const struct record *r) {
+	uint32_t buf[GS_WAYPOINT_WORDS];
+	uint8_t *p = (uint8_t *)buf;
+
+	memset(buf, 0, sizeof(buf));
+	p++;
+	put_le16(p, seq); p += 2;
+	put_le16(p, 0x301); p += 2;
+	p += 3;
+	p[0] = r->u.waypoint.id; p[1] = r->u.waypoint.id >> 8;
+	p[2] = r->u.waypoint.id >> 16; p[3] = r->u.waypoint.id >> 24; p += 4;
+	p[0] = r->u.waypoint.turn_mode; p += 1;
+	put_le_double(p, r->u.waypoint.lat * GS_RAD); p += 8;
+	put_le_double(p, r->u.waypoint.lon * GS_RAD); p += 8;
+	put_le_float(p, r->u.waypoint.alt); p += 4;
+	put_le_float(p, r->u.waypoint.vel); p += 4;
+	put_le16(p, r->u.waypoint.timelimit); p += 2;
+	put_le_float(p, r->u.waypoint.heading);
+	/* Stationary time, start delay, period and repeats are left at 0 */
+	btea(buf, GS_WAYPOINT_WORDS, gs_key);
+
+	put_le16(data, GS_WAYPOINT_SIZE);
+	memcpy(data + 2, buf, sizeof(buf));
+	/**
+	 * The checksum isn't known yet, see crc_search() (-K).  Whether the
+	 * aircraft checks it is unknown too.
+	 */
+	put_le16(data + 2 + sizeof(buf), 0);
+	return GS_WAYPOINT_SIZE;
+}
+
+static int gs_handle_send_general_status_0x341(const struct pkt *pkt, const uint8_t *data, uint16_t len) {
+	struct record r;
+	const uint8_t *p = data;
+
+	p += 9;
+	r.u.gs_status.u = p[0] | p[1] << 8; p += 2;
+	p += 12;
+	r.u.gs_status.lat = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
+	r.u.gs_status.lon = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
+	p += 3;
+	r.u.gs_status.f = load_be_float(p); p += 4;
+
+	return emit_record(pkt, &r, REC_GS_STATUS);
+}
+
+static int gs_handle_send_atti_pos_0x342(const struct pkt *pkt, const uint8_t *data, uint16_t len) {
+	struct record r;
+	const uint8_t *p = data;
+
+	p += 15;
+	r.u.gs_atti.lat = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
+	r.u.gs_atti.lon = load_le_double(p) * 180.0 / 3.141592653589793; p += 8;
+	r.u.gs_atti.deg = load_le_float(p) * 180.0 / 3.141592653589793; p += 4;
+
+	return emit_record(pkt, &r, REC_GS_ATTI);
+}
+
+static int gs_decrypt_packet(const struct pkt *pkt) {
+	/* Decryption is done in place so this is the one copy we need */
+	uint32_t buf[64];
+	uint8_t *data = (uint8_t *)buf, n;
+	uint16_t len, seq, cmd;
+	const uint8_t *p, *last;
+	int32_t blocks;
+
+	p = pkt->data;
+	n = pkt->len - 8;
+	if(pkt->cmd == 0x81) {
+		p++;
+		n--;
+	}
+
+	if(n < (pkt->cmd == 0x81? 8: 4) || n > pkt->len - 8) {
+		text_printf("[0x%02x] GS: Packet too short (%d bytes)\n", pkt->cmd, n);
+		return -1;
+	}
+
+	len = p[0] | p[1] << 8; p += 2; len -= 2;
+	/* Don't trust the length field to stay within the frame */
+	last = len + 2 == n? p + len: p + n - 2;
+	text_printf("[0x%02x] GS: Decrypting packet with len %d (0x%02x), data len %d (0x%02x), encrypted payload len is %d (0x%04x), last bytes %02x%02x\n",
+		pkt->cmd, pkt->len, pkt->len, n, n, len, len, last[-2], last[-1]);
+
+	if(len + 2 != n) {
+		text_printf("[0x%02x] GS: Packet data length %d (0x%04x) differs from encrypted payload length %d (0x%04x)\n",
+			pkt->cmd, n, n, len + 2, len + 2);
+		dump_packet(pkt);
+		// return -1;
+		len = n - 2;
+	}
+
+	if(pkt->cmd == 0x81) {
+		text_printf("[0x%02x] GS: Checksum bytes %02x%02x (0x%04x), footer %02x%02x\n",
+			pkt->cmd,
+			p[len - 4], p[len - 3], p[len - 4] | p[len - 3] << 8,
+			p[len - 2], p[len - 1]);
+		/* See crc_search() (-K) for attempts at figuring these out */
+		len -= 4;
+	}
+
+	/* XXTEA takes at least two words, the header is five bytes */
+	blocks = len / 4;
+	if(blocks < 2 || len < 5) {
+		text_printf("[0x%02x] GS: Encrypted payload too short (%d bytes)\n",
+			pkt->cmd, len);
+		return -1;
+	}
+
+	memcpy(data, p, len);
+	text_printf("[0x%02x] GS: Decrypting %d dwords, %d (0x%02x) bytes of %d bytes encrypted payload\n",
+		pkt->cmd, blocks, blocks * 4, blocks * 4, len);
+
+	btea(buf, -blocks, gs_key);
+	if(out->format == SINK_TEXT) {
+		text_printf("[0x%02x] GS: Decrypted ", pkt->cmd);
+		for(int i = 0; i < blocks * 4; i++) text_printf("%02x", data[i]);
+		text_printf("  ");
+		for(int i = blocks * 4; i < len; i++) text_printf("%02x", data[i]);
+		text_printf(" (remaining)\n");
+	}
+
+
+	p = data;
+	p++; /* always zero */
+	seq = p[0] | p[1] << 8; p += 2;
+	cmd = p[0] | p[1] << 8; p += 2;
+
+	text_printf("[0x%02x] GS: Sequence %-5u, command %-5u (0x%04x)\n", pkt->cmd, seq, cmd, cmd);
+
+	switch(cmd) {
+	case 0x301:
+		gs_handle_set_waypoint_0x301(pkt, p, len - 5);
+		break;
+	case 0x341:
+		gs_handle_send_general_status_0x341(pkt, p, len -5);
+		break;
+	case 0x342:
+		gs_handle_send_atti_pos_0x342(pkt, p, len - 5);
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * Decrypt a 0x80 or 0x81 frame into buf without printing anything, for
+ * code that acts on ground station traffic rather than decoding it.
+ * Returns the plaintext length, the header included, or -1.
+ */
+static int gs_open(const struct pkt *pkt, uint32_t buf[64], uint16_t *seq,
+		uint16_t *cmd) {
+	const uint8_t *p = pkt->data, *data = (const uint8_t *)buf;
+	int n = pkt->len - 8, len;
+
+	if(pkt->cmd == 0x81) {
+		p++;
+		n--;
+	}
+
+	len = n - (pkt->cmd == 0x81? 6: 4);
+	if(len < 8 || (p[0] | p[1] << 8) != n)
+		return -1;
+
+	len &= ~3;
+	memcpy(buf, p + 2, len);
+	btea(buf, -len / 4, gs_key);
+	*seq = data[1] | data[2] << 8;
+	*cmd = data[3] | data[4] << 8;
+	return len;
+}
+
+/* Response to command 0x90 (start compass calibration) on port 0x0a */
+static int handle_packet_0x90(const struct pkt *pkt) {
+	struct record r;
+
+	r.u.status.code = pkt->data[0];
+	r.u.status.arg = pkt->len > 9? pkt->data[1]: 0;
+	return emit_record(pkt, &r, REC_STATUS);
+}
+
+/* Handle errors */
+static int handle_packet_0xff(const struct pkt *pkt) {
+	struct record r;
+
+	r.u.error.code = pkt->data[0];
+	r.u.error.len = pkt->len - 8;
+	emit_record(pkt, &r, REC_ERROR);
+	dump_packet(pkt);
+
+	return 0;
+}
+
+/* Output generic packet information */
+static int filter_packet(const struct pkt *pkt) {
+	struct record r;
+	int err = 0;
+
+	if((pkt->data[0] & 0xe0) == 0xe0) err = pkt->data[0] & 0x1f;
+	r.u.frame.len = pkt->len;
+	r.u.frame.err = err;
+	emit_record(pkt, &r, REC_FRAME);
+
+	if(pkt->magic != DJI_PHANTOM_MAGIC)
+		text_printf("** Packet error: Invalid magic <0x%02x, 0x%02x>"
+			" (expected: 55 bb)\n", pkt->magic >> 8, pkt->magic & 0xff);
+	if(pkt->len < 9)
+		text_printf("** Packet error: Invalid length %u (expected >= 9)\n",
+			pkt->len);
+
+	if(err || pkt->magic != DJI_PHANTOM_MAGIC || pkt->len < 9)
+		dump_packet(pkt);
+
+	return 0;
+}
+
+/**
+ * Packet decoder registry
+ *
+ * Decoders are registered for a port, a direction (bit 0x40 of the port
+ * byte) and a command, together with the payload lengths they accept.
+ * decode_packet() finds them with a single lookup in a direct-mapped
+ * index so adding decoders doesn't make dispatch any slower, and keeps
+ * per-decoder hit, byte and error counts as well as counts of frames
+ * nobody claimed.  Register new decoders with register_decoder().
+ *
+ * Since the port isn't known for packets given on the command line (-x)
+ * the built-in decoders match any port.  Decoders registered for a
+ * specific port take precedence.
+ */
+#define PORT_ANY 0xff
+
+#define DIR_REQUEST 0
+#define DIR_REPLY 1
+#define DIR_ANY 2
+
+#define MAX_DECODERS 254
+#define STAT_INC(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+
+struct decoder {
+	uint8_t port, dir, cmd;
+	/* Accepted payload lengths, zero terminated, none means any */
+	uint8_t lens[4];
+	const char *name;
+	/* May be NULL for commands that are known but not decoded */
+	int (*handler)(const struct pkt *pkt);
+	/* Statistics, updated atomically as packets may be decoded in parallel */
+	unsigned long hits, bytes, errors;
+};
+
+static struct decoder builtin_decoders[] = {
+	{ PORT_ANY, DIR_REQUEST, 0x01, { 1 }, "take picture" },
+	{ PORT_ANY, DIR_REPLY, 0x01, { 1 }, "take picture", handle_packet_0x01 },
+	{ PORT_ANY, DIR_REQUEST, 0x02, { 1, 2 }, "start/stop recording" },
+	{ PORT_ANY, DIR_REPLY, 0x02, { 1 }, "start/stop recording", handle_packet_0x02 },
+	{ PORT_ANY, DIR_REQUEST, 0x04, { 1 }, "hello" },
+	{ PORT_ANY, DIR_REPLY, 0x04, { 0 }, "hello", handle_packet_0x04 },
+	{ PORT_ANY, DIR_ANY, 0x20, { 1, 7 }, "camera time", handle_packet_0x20 },
+	{ PORT_ANY, DIR_REQUEST, 0x24, { 6 }, "move camera" },
+	{ PORT_ANY, DIR_REQUEST, 0x2d, { 1 }, "unknown 0x2d" },
+	{ PORT_ANY, DIR_REPLY, 0x2d, { 2 }, "unknown 0x2d", handle_packet_0x2d },
+	{ PORT_ANY, DIR_ANY, 0x32, { 1, 16 }, "position", handle_packet_0x32 },
+	{ PORT_ANY, DIR_ANY, 0x41, { 1, 17 }, "firmware version", handle_packet_0x41 },
+	{ PORT_ANY, DIR_REQUEST, 0x49, { 1 }, "GPS/telemetry" },
+	{ PORT_ANY, DIR_REPLY, 0x49, { 53 }, "GPS/telemetry", handle_packet_0x49 },
+	{ PORT_ANY, DIR_REQUEST, 0x52, { 1 }, "flight mode" },
+	{ PORT_ANY, DIR_REPLY, 0x52, { 6 }, "flight mode", handle_packet_0x52 },
+	{ PORT_ANY, DIR_REQUEST, 0x53, { 1 }, "power status" },
+	{ PORT_ANY, DIR_REPLY, 0x53, { 16 }, "power status", handle_packet_0x53 },
+	{ PORT_ANY, DIR_ANY, 0x80, { 0 }, "ground station", gs_decrypt_packet },
+	{ PORT_ANY, DIR_ANY, 0x81, { 0 }, "ground station feedback", gs_decrypt_packet },
+	{ PORT_ANY, DIR_REQUEST, 0x90, { 1 }, "compass calibration" },
+	{ PORT_ANY, DIR_REPLY, 0x90, { 2 }, "compass calibration", handle_packet_0x90 },
+	{ PORT_ANY, DIR_REPLY, 0xff, { 0 }, "error", handle_packet_0xff },
+};
+
+static struct decoder decoders[MAX_DECODERS];
+static int num_decoders;
+
+/* Index + 1 into decoders[] by port, direction and command */
+static uint8_t decoder_index[64][2][256];
+/* Set where the index entry was registered for a specific port */
+static uint8_t decoder_exact[64][2][256 / 8];
+/* Frames without a decoder */
+static unsigned long decoder_unknown[64][2][256];
+
+/* Print unhandled packets, in addition to counting them */
+static int verbose;
+
+static int register_decoder(const struct decoder *d) {
+	int port, dir, idx;
+
+	if(num_decoders == MAX_DECODERS) {
+		fprintf(stderr, "register_decoder(): Too many decoders\n");
+		return -1;
+	}
+
+	idx = num_decoders++;
+	decoders[idx] = *d;
+	for(port = 0; port < 64; port++) {
+		if(d->port != PORT_ANY && d->port != port)
+			continue;
+
+		for(dir = 0; dir < 2; dir++) {
+			if(d->dir != DIR_ANY && d->dir != dir)
+				continue;
+
+			if(d->port != PORT_ANY)
+				decoder_exact[port][dir][d->cmd / 8] |= 1 << d->cmd % 8;
+			else if(decoder_exact[port][dir][d->cmd / 8] & 1 << d->cmd % 8)
+				continue;
+
+			decoder_index[port][dir][d->cmd] = idx + 1;
+		}
+	}
+
+	return 0;
+}
+
+static void register_builtin_decoders(void) {
+	int i;
+
+	if(num_decoders > 0)
+		return;
+
+	for(i = 0; i < sizeof(builtin_decoders) / sizeof(builtin_decoders[0]); i++)
+		register_decoder(&builtin_decoders[i]);
+}
+
+/**
+ * Route packet to appropriate handlers.  Returns what the handler did,
+ * anything but 0 is also counted as an error of the decoder.
+ */
+static int decode_packet(const struct pkt *pkt) {
+	struct decoder *d;
+	int dir = pkt->port >> 6 & 1, n = pkt->len - 8, i, ret = 0;
+	uint8_t idx;
+
+	idx = decoder_index[pkt->port & 0x3f][dir][pkt->cmd];
+	if(idx == 0) {
+		STAT_INC(decoder_unknown[pkt->port & 0x3f][dir][pkt->cmd], 1);
+		if(verbose) {
+			text_printf("[0x%02x]: Seq %5u, unhandled cmd 0x%02x from"
+				" port 0x%02x (%d bytes payload)\n", pkt->cmd,
+				pkt->seq, pkt->cmd, pkt->port & 0x3f, n);
+			dump_packet(pkt);
+		}
+
+		return 0;
+	}
+
+	d = &decoders[idx - 1];
+	STAT_INC(d->hits, 1);
+	STAT_INC(d->bytes, pkt->len);
+	for(i = 0; i < sizeof(d->lens) && d->lens[i] && d->lens[i] != n; i++);
+	if(d->lens[0] && (i == sizeof(d->lens) || !d->lens[i])) {
+		if(d->lens[1] == 0)
+			fprintf(stderr, "[0x%02x]: Expected payload len %d, got %d\n",
+				pkt->cmd, d->lens[0], n);
+		else
+			fprintf(stderr, "[0x%02x]: Unexpected payload len, got %d\n",
+				pkt->cmd, n);
+		STAT_INC(d->errors, 1);
+		return 0;
+	}
+
+	if(d->handler && (ret = d->handler(pkt)) != 0)
+		STAT_INC(d->errors, 1);
+
+	return ret;
+}
+
+/* Dump per-decoder statistics and counts of unhandled frames */
+static void decoder_stats(FILE *fp) {
+	struct decoder *d;
+	int i, port, dir, cmd;
+
+	fprintf(fp, "* Decoder statistics\n");
+	for(i = 0; i < num_decoders; i++) {
+		d = &decoders[i];
+		if(d->hits == 0)
+			continue;
+
+		fprintf(fp, "  [0x%02x] %-24s %-7s %8lu frames %10lu bytes %6lu errors\n",
+			d->cmd, d->name, d->dir == DIR_REQUEST? "request":
+			d->dir == DIR_REPLY? "reply": "", d->hits, d->bytes,
+			d->errors);
+	}
+
+	for(port = 0; port < 64; port++)
+		for(dir = 0; dir < 2; dir++)
+			for(cmd = 0; cmd < 256; cmd++) {
+				if(decoder_unknown[port][dir][cmd] == 0)
+					continue;
+
+				fprintf(fp, "  [0x%02x] unhandled, port 0x%02x %-7s %8lu frames\n",
+					cmd, port, dir == DIR_REQUEST? "request": "reply",
+					decoder_unknown[port][dir][cmd]);
+			}
+}
+
+/* XOR checksum over n bytes, computed a word at a time */
+static uint8_t cksum_xor(const uint8_t *p, size_t n) {
+	uint64_t a = 0, b = 0, w0, w1;
+	uint8_t c;
+
+	for(; n >= 16; n -= 16, p += 16) {
+		memcpy(&w0, p, 8);
+		memcpy(&w1, p + 8, 8);
+		a ^= w0;
+		b ^= w1;
+	}
+
+	if(n >= 8) {
+		memcpy(&w0, p, 8);
+		a ^= w0;
+		p += 8;
+		n -= 8;
+	}
+
+	a ^= b;
+	a ^= a >> 32;
+	a ^= a >> 16;
+	a ^= a >> 8;
+	for(c = a; n > 0; n--) c ^= *p++;
+
+	return c;
+}
+
+/**
+ * Find the next frame magic <0x55, 0xbb> at or after p.  A lone 0x55 in
+ * the last byte is returned as well since it may be the start of a frame,
+ * end is returned if there's nothing.
+ */
+static const uint8_t *scan_magic(const uint8_t *p, const uint8_t *end) {
+#ifdef __SSE2__
+	const __m128i m0 = _mm_set1_epi8(DJI_PHANTOM_MAGIC & 0xff);
+	const __m128i m1 = _mm_set1_epi8((char)(DJI_PHANTOM_MAGIC >> 8));
+	__m128i a, b;
+	unsigned mask;
+
+	while(end - p >= 17) {
+		a = _mm_loadu_si128((const __m128i *)p);
+		b = _mm_loadu_si128((const __m128i *)(p + 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, m0),
+			_mm_cmpeq_epi8(b, m1)));
+		if(mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	for(; end - p >= 2; p++)
+		if(p[0] == (DJI_PHANTOM_MAGIC & 0xff) && p[1] == DJI_PHANTOM_MAGIC >> 8)
+			return p;
+
+	return p < end && p[0] == (DJI_PHANTOM_MAGIC & 0xff)? p: end;
+}
+
+/* A verified frame in a receive buffer */
+struct frame_span {
+	uint32_t off;
+	uint8_t len;
+};
+
+struct frame_stats {
+	unsigned long frames, resyncs, skipped, bad_cksum;
+};
+
+/**
+ * Find and verify every complete frame in buf in a single pass.  Up to
+ * max frames are stored in spans and their number returned.  *used is
+ * set to where the scan stopped: anything before it was either returned
+ * or skipped as garbage, anything after it is a partial frame.
+ */
+static int frame_scan(const uint8_t *buf, size_t len, struct frame_span *spans,
+		int max, size_t *used, struct frame_stats *st) {
+	const uint8_t *p = buf, *end = buf + len, *q;
+	uint8_t cksum;
+	int n = 0;
+
+	while(end - p >= 9 && n < max) {
+		if(p[0] == (DJI_PHANTOM_MAGIC & 0xff) &&
+			p[1] == DJI_PHANTOM_MAGIC >> 8 && p[2] >= 9) {
+			if(end - p < p[2])
+				break;
+
+			if((cksum = cksum_xor(p, p[2])) == 0) {
+				spans[n].off = p - buf;
+				spans[n].len = p[2];
+				n++;
+				p += p[2];
+				continue;
+			}
+
+			fprintf(stderr, "Invalid checksum 0x%02x (expected 0x%02x)\n",
+				p[p[2] - 1], p[p[2] - 1] ^ cksum);
+			st->bad_cksum++;
+		}
+
+		/* Garbage, skip ahead to the next magic */
+		q = scan_magic(p + 1, end);
+		st->resyncs++;
+		st->skipped += q - p;
+		fprintf(stderr, "framer: Skipped %zu bytes to resync\n",
+			(size_t)(q - p));
+		p = q;
+	}
+
+	*used = p - buf;
+	return n;
+}
+
+/**
+ * Incremental stream framer
+ *
+ * Data from the socket is read into a large ring buffer, one recv() per
+ * wakeup, and every complete frame is then pulled out of it with
+ * framer_next().  Since a frame never exceeds 255 bytes the few bytes of
+ * a trailing partial frame are moved back to the start of the buffer
+ * when we get close to the end, so frames are always contiguous and can
+ * be handed to the decoders as is.
+ *
+ * All frames in the buffer are located and verified in one go by
+ * frame_scan() and then handed out one at a time.
+ *
+ * Garbage (bad magic, impossible length or bad checksum) no longer ends
+ * the session, instead we scan for the next <0x55, 0xbb> and resync.
+ */
+#define FRAMER_BUFSZ 65536
+#define FRAMER_MAX_SPANS 512
+
+struct framer {
+	uint8_t buf[FRAMER_BUFSZ];
+	/* Read and write offsets into buf */
+	size_t head, tail;
+	/* Frames found by the last scan and where it stopped */
+	struct frame_span span[FRAMER_MAX_SPANS];
+	int nspans, cur;
+	size_t scanned;
+	/* Expected sequence number of the next frame */
+	uint16_t seq;
+	/* Receive time of the data last added, stamped on packets */
+	uint64_t ts;
+	/* Bytes added since framer_init() */
+	unsigned long long bytes;
+	/* Leave filter_packet() to whoever takes the frames */
+	int deferred;
+	struct frame_stats stats;
+};
+
+static void framer_init(struct framer *fr) {
+	fr->head = fr->tail = fr->scanned = 0;
+	fr->nspans = fr->cur = 0;
+	fr->seq = 0;
+	fr->ts = 0;
+	fr->bytes = 0;
+	fr->deferred = 0;
+	memset(&fr->stats, 0, sizeof(fr->stats));
+}
+
+/* Throw away everything buffered, i.e after data was lost */
+static void framer_drop(struct framer *fr) {
+	fr->head = fr->tail = fr->scanned = 0;
+	fr->nspans = fr->cur = 0;
+}
+
+/* Make sure there's room for at least one maximum sized frame */
+static void framer_compact(struct framer *fr) {
+	int i;
+
+	if(fr->head == fr->tail) {
+		framer_drop(fr);
+		return;
+	}
+
+	if(sizeof(fr->buf) - fr->tail >= 255 && fr->head < sizeof(fr->buf) / 2)
+		return;
+
+	memmove(fr->buf, fr->buf + fr->head, fr->tail - fr->head);
+	for(i = fr->cur; i < fr->nspans; i++)
+		fr->span[i].off -= fr->head;
+	fr->scanned -= fr->head;
+	fr->tail -= fr->head;
+	fr->head = 0;
+}
+
+/* Read whatever is available on the socket, returns recv()'s result */
+static ssize_t framer_fill(struct framer *fr, int fd) {
+	ssize_t ret;
+
+	framer_compact(fr);
+	/* Not recv(), the relay's tap is a pipe */
+	ret = read(fd, fr->buf + fr->tail, sizeof(fr->buf) - fr->tail);
+	if(ret <= 0) {
+		if(ret < 0 && (errno == EINTR || errno == EAGAIN))
+			return 1;
+		if(ret < 0)
+			fprintf(stderr, "read() failed: %s\n", strerror(errno));
+		return ret;
+	}
+
+	fr->tail += ret;
+	fr->bytes += ret;
+	fr->ts = time_now_ns();
+	return ret;
+}
+
+/* Append data from memory, returns the number of bytes consumed */
+static size_t framer_feed(struct framer *fr, const uint8_t *data, size_t len) {
+	framer_compact(fr);
+	if(len > sizeof(fr->buf) - fr->tail)
+		len = sizeof(fr->buf) - fr->tail;
+
+	memcpy(fr->buf + fr->tail, data, len);
+	fr->tail += len;
+	fr->bytes += len;
+	return len;
+}
+
+/**
+ * Set up pkt as a view of the next complete frame in the buffer, returns
+ * NULL if more data is needed.  The frame stays valid until the framer
+ * is filled again.
+ */
+static struct pkt *framer_next(struct framer *fr, struct pkt *pkt) {
+	struct frame_span *sp;
+	uint8_t *buf;
+	size_t used;
+	int i;
+
+	if(fr->cur == fr->nspans) {
+		fr->head = fr->scanned;
+		fr->nspans = frame_scan(fr->buf + fr->head, fr->tail - fr->head,
+			fr->span, FRAMER_MAX_SPANS, &used, &fr->stats);
+		for(i = 0; i < fr->nspans; i++)
+			fr->span[i].off += fr->head;
+		fr->scanned = fr->head + used;
+		fr->cur = 0;
+		if(fr->nspans == 0) {
+			fr->head = fr->scanned;
+			return NULL;
+		}
+	}
+
+	sp = &fr->span[fr->cur++];
+	buf = fr->buf + sp->off;
+	fr->head = sp->off + sp->len;
+
+	pkt_view(pkt, buf);
+	pkt->ts = fr->ts;
+	if(pkt->seq != fr->seq) {
+		fprintf(stderr, "framer_next(): Out of sequence packet"
+			" <seq %u, port 0x%02x, len %u, cmd 0x%02x>, expected"
+			" seq %u\n", pkt->seq, pkt->port, pkt->len, pkt->cmd,
+			fr->seq);
+		/* Attempt to synchronize */
+		if(fr->seq != 0xffff) fr->seq = pkt->seq;
+	}
+
+	fr->seq++;
+	fr->stats.frames++;
+	if(!fr->deferred)
+		filter_packet(pkt);
+	return pkt;
+}
+
+/* Hex digit values, -1 for anything that isn't a hex digit */
+static const int8_t hex_digit[256] = {
+	[0 ... 255] = -1,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+/* Decode n bytes from 2*n hex digits, returns -1 on invalid input */
+static int hex_decode(uint8_t *dst, const char *src, size_t n) {
+	const uint8_t *s = (const uint8_t *)src;
+	int8_t hi, lo, bad = 0;
+
+	while(n--) {
+		hi = hex_digit[s[0]];
+		lo = hex_digit[s[1]];
+		bad |= hi | lo;
+		*dst++ = hi << 4 | lo;
+		s += 2;
+	}
+
+	return bad < 0? -1: 0;
+}
+
+/**
+ * Build a frame from a hex string in frame (at least 256 bytes) and set
+ * up pkt as a view of it.
+ */
+static struct pkt *hex_frame(const char *arg, size_t len, struct pkt *pkt,
+		uint8_t *frame) {
+	const char *str = arg;
+	uint16_t seq = 0;
+	size_t i, n;
+
+	/**
+	 * If arg doesn't start with "55bb" (complete packet), it's assumed
+	 * the data is only command bytes and payload.  Examples:
+	 * $ ./dji-phantom -x 4900.......... to debug cmd 49
+	 * $ cat packets.txt | xargs ./dji-phantom -x
+	 * $ ./dji-phantom -f packets.txt
+	 */
+	memset(frame, 0, 256);
+	frame[0] = DJI_PHANTOM_MAGIC & 0xff;
+	frame[1] = DJI_PHANTOM_MAGIC >> 8;
+	if(len >= 4 && !strncmp(arg, "55bb", 4)) {
+		/* Length, port, seq and cmd */
+		if(len < 14 || hex_decode(frame + 2, arg + 4, 5) < 0)
+			goto invalid;
+		arg += 14;
+		len -= 14;
+	}
+	else {
+		frame[3] = 0x40;  /* Assume reply on unknown port */
+		for(i = 0; i < 6 && i < len && arg[i] >= '0' && arg[i] <= '9'; i++);
+		if(arg[0] == '0' && i == 6 && len >= 8) {
+			/**
+			 * Kludge to load %06u sequence numbers, i.e
+			 * ./dji-phantom -x 0123454900... to debug cmd 49
+			 */
+			for(i = 0; i < 6; i++)
+				seq = seq * 10 + arg[i] - '0';
+			frame[4] = seq & 0xff;
+			frame[5] = seq >> 8;
+			arg += 6;
+			len -= 6;
+		}
+
+		if(len < 2 || hex_decode(frame + 6, arg, 1) < 0)
+			goto invalid;
+		arg += 2;
+		len -= 2;
+	}
+
+	if(len / 2 > 255 - 8)
+		goto invalid;
+	if(!frame[2]) frame[2] = 8 + len / 2;
+
+	/* Short input leaves the rest of the payload zeroed */
+	n = frame[2] > 8? frame[2] - 8: 0;
+	if(n > len / 2) n = len / 2;
+	if(hex_decode(frame + 7, arg, n) < 0)
+		goto invalid;
+
+	if(frame[2] >= 8)
+		frame[frame[2] - 1] = cksum_xor(frame, frame[2] - 1);
+	pkt_view(pkt, frame);
+	return pkt;
+
+invalid:
+	fprintf(stderr, "Invalid hex packet '%.*s'\n", (int)(arg - str + len), str);
+	return NULL;
+}
+
+/* As hex_frame(), then run it through the packet filter */
+static struct pkt *read_packet_from_hex_string(const char *arg, size_t len,
+		struct pkt *pkt, uint8_t *frame) {
+	if(hex_frame(arg, len, pkt, frame) == NULL)
+		return NULL;
+
+	filter_packet(pkt);
+	return pkt;
+}
+
+/**
+ * Call cb with every frame in a file of newline separated hex packets,
+ * skipping blank lines and # comments.  Stops when cb returns non-zero.
+ */
+static int read_hex_stream(FILE *fp, int (*cb)(void *arg, struct pkt *pkt),
+		void *arg) {
+	char *line = NULL, *p;
+	size_t size = 0;
+	ssize_t n;
+	int ret = 0;
+
+	while(ret == 0 && (n = getline(&line, &size, fp)) > 0) {
+		uint8_t frame[256];
+		struct pkt pkt;
+
+		for(p = line; *p == ' ' || *p == '\t'; p++, n--);
+		while(n > 0 && (p[n - 1] == '\n' || p[n - 1] == '\r' ||
+			p[n - 1] == ' ' || p[n - 1] == '\t'))
+			n--;
+		if(n == 0 || p[0] == '#')
+			continue;
+
+		if(hex_frame(p, n, &pkt, frame) != NULL)
+			ret = cb(arg, &pkt);
+	}
+
+	free(line);
+	return ret < 0 || ferror(fp)? -1: 0;
+}
+
+static int hex_decode_frame(void *arg, struct pkt *pkt) {
+	filter_packet(pkt);
+	decode_packet(pkt);
+	return 0;
+}
+
+/* Decode newline separated hex packets from a file (-f <file> or -x -) */
+static int decode_hex_stream(FILE *fp) {
+	return read_hex_stream(fp, hex_decode_frame, NULL);
+}
+
+/**
+ * Frame log
+ *
+ * With -L file every frame sent to or received from the aircraft, or
+ * relayed between it and the app, is also written to a binary log with
+ * a monotonic timestamp, its direction and its session.  Looking into
+ * an incident then takes a query rather than grepping gigabytes of
+ * text.  Frames go to the segment, file, which is buffered and written
+ * at least once a second while frames come in, and are indexed in the
+ * sidecar file.idx.
+ *
+ * The segment is the 8 byte magic "DJIFLOG1", <u64 wall clock and u64
+ * monotonic time when it was started, both ns, u64 zero> and then the
+ * frames, each <u64 monotonic time, u8 direction (0 to the aircraft, 1
+ * from it), u8 session> followed by the frame as on the wire.
+ *
+ * The index is the magic "DJIFIDX1" and chunks of <u8 kind, u8 key, u16
+ * entries, u32 zero> and u64 entries.  It holds a time index, (time,
+ * offset) pairs for every FLOG_TIME_STRIDE'th frame, and a posting list
+ * per command, the segment offset of every frame with it.  Chunks are
+ * written as they fill up, so all but the last chunk of a list are full
+ * and an entry is found by its number alone.  Closing the log adds an
+ * end chunk <segment size, frames>; an index without one, after a
+ * crash, is rebuilt from the segment the next time the log is read.
+ *
+ * -l file maps a log with its index and decodes the frames matching -q
+ * and -i.  All 0x81 frames between two times (-q cmd=81 -i t1,t2) are
+ * found with binary searches of the time index and the posting list of
+ * 0x81, and only those frames are read.
+ */
+#define FLOG_MAGIC "DJIFLOG1"
+#define FLOG_IDX_MAGIC "DJIFIDX1"
+#define FLOG_HDRSZ 32
+#define FLOG_FRAME_HDRSZ 10
+#define FLOG_BUFSZ (256 << 10)
+#define FLOG_CHUNK 512
+#define FLOG_TIME_STRIDE 64
+#define FLOG_FLUSH_NS 1000000000ull
+
+/* Directions, as DIR_TO_SERVER and DIR_FROM_SERVER */
+#define FLOG_TX 0
+#define FLOG_RX 1
+
+enum flog_chunk_kind { FLOG_TIME, FLOG_CMD, FLOG_END };
+
+struct flog_chunk {
+	int n;
+	uint64_t e[FLOG_CHUNK];
+};
+
+struct flog {
+	pthread_mutex_t lock;
+	int fd, idx;
+	/* Segment size including what's buffered, frames in it */
+	uint64_t size, frames;
+	/* When the buffer was last written out, monotonic ns */
+	uint64_t flushed;
+	size_t len;
+	uint8_t buf[FLOG_BUFSZ];
+	struct flog_chunk time, *cmd[256];
+};
+
+/* Written to by every thread that decodes, under its lock */
+static struct flog *flog;
+
+/* Any 0xe_ status rather than a particular one, see filter_packet() */
+#define FILTER_ERR_ANY 0x100
+
+/* Frames to pick from a log, -1 for any */
+struct frame_filter {
+	/* err is the status byte, 0xe0 to 0xff, or FILTER_ERR_ANY */
+	int port, cmd, seq, dir, err;
+	/* Wall clock, ns */
+	uint64_t from, to;
+};
+
+static int flog_write(int fd, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while(len > 0) {
+		if((n = write(fd, p, len)) < 0) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "ERROR: Frame log: write() failed: %s\n",
+				strerror(errno));
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int flog_chunk_flush(struct flog *fl, struct flog_chunk *c, int kind,
+		int key) {
+	uint8_t hdr[8] = { kind, key, c->n & 0xff, c->n >> 8 };
+	int ret;
+
+	if(c->n == 0)
+		return 0;
+
+	ret = flog_write(fl->idx, hdr, sizeof(hdr)) < 0 ||
+		flog_write(fl->idx, c->e, c->n * sizeof(c->e[0])) < 0? -1: 0;
+	c->n = 0;
+	return ret;
+}
+
+static void flog_chunk_add(struct flog *fl, struct flog_chunk *c, int kind,
+		int key, uint64_t v) {
+	c->e[c->n++] = v;
+	if(c->n == FLOG_CHUNK)
+		flog_chunk_flush(fl, c, kind, key);
+}
+
+/* Index the frame at off */
+static void flog_index(struct flog *fl, uint64_t off, uint64_t ts, uint8_t cmd) {
+	/* FLOG_CHUNK is even, pairs are never split */
+	if(fl->frames++ % FLOG_TIME_STRIDE == 0) {
+		flog_chunk_add(fl, &fl->time, FLOG_TIME, 0, ts);
+		flog_chunk_add(fl, &fl->time, FLOG_TIME, 0, off);
+	}
+
+	if(fl->cmd[cmd] == NULL &&
+		(fl->cmd[cmd] = calloc(1, sizeof(*fl->cmd[cmd]))) == NULL)
+		return;
+	flog_chunk_add(fl, fl->cmd[cmd], FLOG_CMD, cmd, off);
+}
+
+static int flog_flush(struct flog *fl) {
+	int ret;
+
+	ret = flog_write(fl->fd, fl->buf, fl->len);
+	fl->len = 0;
+	fl->flushed = time_mono_ns();
+	return ret;
+}
+
+/* Log a frame sent (FLOG_TX) or received (FLOG_RX) */
+static void flog_frame(const struct pkt *pkt, int dir) {
+	struct flog *fl = flog;
+	uint64_t ts;
+	uint8_t *p;
+
+	if(fl == NULL)
+		return;
+
+	pthread_mutex_lock(&fl->lock);
+	if(sizeof(fl->buf) - fl->len < FLOG_FRAME_HDRSZ + 255)
+		flog_flush(fl);
+
+	/* Taken under the lock so that the log is in order */
+	ts = time_mono_ns();
+	p = fl->buf + fl->len;
+	memcpy(p, &ts, 8);
+	p[8] = dir;
+	p[9] = out_session;
+	memcpy(p + FLOG_FRAME_HDRSZ, pkt->raw, pkt->len);
+	flog_index(fl, fl->size, ts, pkt->cmd);
+	fl->len += FLOG_FRAME_HDRSZ + pkt->len;
+	fl->size += FLOG_FRAME_HDRSZ + pkt->len;
+	if(ts - fl->flushed >= FLOG_FLUSH_NS)
+		flog_flush(fl);
+	pthread_mutex_unlock(&fl->lock);
+}
+
+/* Write what's left of the index and the end chunk */
+static int flog_finish(struct flog *fl) {
+	struct flog_chunk end = { 2, { fl->size, fl->frames } };
+	int i, ret = 0;
+
+	ret |= flog_chunk_flush(fl, &fl->time, FLOG_TIME, 0);
+	for(i = 0; i < 256; i++) {
+		if(fl->cmd[i] == NULL)
+			continue;
+		ret |= flog_chunk_flush(fl, fl->cmd[i], FLOG_CMD, i);
+		free(fl->cmd[i]);
+		fl->cmd[i] = NULL;
+	}
+
+	ret |= flog_chunk_flush(fl, &end, FLOG_END, 0);
+	return ret;
+}
+
+static int flog_create(const char *path, int *fd, const void *hdr, size_t len) {
+	if((*fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0 ||
+		flog_write(*fd, hdr, len) < 0) {
+		fprintf(stderr, "ERROR: Failed to create %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Start a new log in path and path.idx */
+static int flog_open(const char *path) {
+	uint8_t hdr[FLOG_HDRSZ] = FLOG_MAGIC;
+	char idx[PATH_MAX];
+	uint64_t t;
+	struct flog *fl;
+
+	if((fl = calloc(1, sizeof(*fl))) == NULL)
+		return -1;
+
+	snprintf(idx, sizeof(idx), "%s.idx", path);
+	t = time_now_ns();
+	memcpy(hdr + 8, &t, 8);
+	t = time_mono_ns();
+	memcpy(hdr + 16, &t, 8);
+	if(flog_create(path, &fl->fd, hdr, sizeof(hdr)) < 0 ||
+		flog_create(idx, &fl->idx, FLOG_IDX_MAGIC, 8) < 0) {
+		free(fl);
+		return -1;
+	}
+
+	pthread_mutex_init(&fl->lock, NULL);
+	fl->size = FLOG_HDRSZ;
+	fl->flushed = t;
+	flog = fl;
+	return 0;
+}
+
+static void flog_close(void) {
+	struct flog *fl = flog;
+
+	if(fl == NULL)
+		return;
+
+	flog = NULL;
+	flog_flush(fl);
+	flog_finish(fl);
+	close(fl->fd);
+	close(fl->idx);
+	free(fl);
+}
+
+/* A log being read, along with where its index chunks are */
+struct flog_reader {
+	const uint8_t *seg, *idx;
+	size_t seglen, idxlen;
+	/* End of the last complete frame */
+	uint64_t end;
+	uint64_t wall0, mono0;
+	const uint8_t **time, **cmd[256];
+	int ntime, ncmd[256];
+};
+
+static const uint8_t *flog_map(const char *path, size_t *len) {
+	struct stat st;
+	void *p;
+	int fd;
+
+	if((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0)
+		return NULL;
+	if(fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	*len = st.st_size;
+	return p == MAP_FAILED? NULL: p;
+}
+
+static int flog_chunk_entries(const uint8_t *c) {
+	return c[2] | c[3] << 8;
+}
+
+/* Entry k of a list of chunks, width u64s each */
+static const uint64_t *flog_at(const uint8_t **chunks, size_t k, int width) {
+	size_t per = FLOG_CHUNK / width;
+
+	return (const uint64_t *)(chunks[k / per] + 8) + k % per * width;
+}
+
+static size_t flog_count(const uint8_t **chunks, int n, int width) {
+	if(n == 0)
+		return 0;
+
+	return (n - 1) * (size_t)(FLOG_CHUNK / width) +
+		flog_chunk_entries(chunks[n - 1]) / width;
+}
+
+static int flog_add_chunk(const uint8_t ***chunks, int *n, const uint8_t *c) {
+	const uint8_t **p;
+
+	if((*n & (*n - 1)) == 0) {
+		if((p = realloc(*chunks, (*n? *n * 2: 1) * sizeof(*p))) == NULL)
+			return -1;
+		*chunks = p;
+	}
+
+	(*chunks)[(*n)++] = c;
+	return 0;
+}
+
+/**
+ * Find the chunks in the index, returns 0 if it's complete, 1 if it has
+ * to be rebuilt and -1 on errors.
+ */
+static int flog_load_index(struct flog_reader *rd) {
+	const uint8_t *p = rd->idx + 8, *end = rd->idx + rd->idxlen;
+	const uint64_t *e;
+	size_t size;
+	int n;
+
+	if(rd->idxlen < 8 || memcmp(rd->idx, FLOG_IDX_MAGIC, 8))
+		return 1;
+
+	for(; end - p >= 8; p += size) {
+		n = flog_chunk_entries(p);
+		size = 8 + n * 8;
+		if(size > end - p || n == 0)
+			return 1;
+
+		switch(p[0]) {
+		case FLOG_TIME:
+			if(flog_add_chunk(&rd->time, &rd->ntime, p) < 0)
+				return -1;
+			break;
+		case FLOG_CMD:
+			if(flog_add_chunk(&rd->cmd[p[1]], &rd->ncmd[p[1]], p) < 0)
+				return -1;
+			break;
+		case FLOG_END:
+			e = (const uint64_t *)(p + 8);
+			if(p + size != end || e[0] > rd->seglen)
+				return 1;
+			rd->end = e[0];
+			return 0;
+		default:
+			return 1;
+		}
+	}
+
+	return 1;
+}
+
+/* Index a segment from scratch, up to its last complete frame */
+static int flog_reindex(const char *idxpath, const uint8_t *seg, size_t len) {
+	const uint8_t *p = seg + FLOG_HDRSZ;
+	uint64_t ts;
+	struct flog *fl;
+	int ret;
+
+	if((fl = calloc(1, sizeof(*fl))) == NULL)
+		return -1;
+	if(flog_create(idxpath, &fl->idx, FLOG_IDX_MAGIC, 8) < 0) {
+		free(fl);
+		return -1;
+	}
+
+	fl->size = FLOG_HDRSZ;
+	while(seg + len - p >= FLOG_FRAME_HDRSZ + 8 &&
+		seg + len - p >= FLOG_FRAME_HDRSZ + p[FLOG_FRAME_HDRSZ + 2] &&
+		p[FLOG_FRAME_HDRSZ + 2] >= 8) {
+		memcpy(&ts, p, 8);
+		flog_index(fl, fl->size, ts, p[FLOG_FRAME_HDRSZ + 6]);
+		fl->size += FLOG_FRAME_HDRSZ + p[FLOG_FRAME_HDRSZ + 2];
+		p = seg + fl->size;
+	}
+
+	ret = flog_finish(fl);
+	close(fl->idx);
+	free(fl);
+	return ret;
+}
+
+static void flog_unload_index(struct flog_reader *rd) {
+	int i;
+
+	if(rd->idx)
+		munmap((void *)rd->idx, rd->idxlen);
+	rd->idx = NULL;
+	free(rd->time);
+	rd->time = NULL;
+	rd->ntime = 0;
+	for(i = 0; i < 256; i++) {
+		free(rd->cmd[i]);
+		rd->cmd[i] = NULL;
+		rd->ncmd[i] = 0;
+	}
+}
+
+static void flog_reader_close(struct flog_reader *rd) {
+	flog_unload_index(rd);
+	if(rd->seg)
+		munmap((void *)rd->seg, rd->seglen);
+	rd->seg = NULL;
+}
+
+static int flog_reader_open(struct flog_reader *rd, const char *path) {
+	char idxpath[PATH_MAX];
+	int ret, tries;
+
+	memset(rd, 0, sizeof(*rd));
+	if((rd->seg = flog_map(path, &rd->seglen)) == NULL ||
+		rd->seglen < FLOG_HDRSZ || memcmp(rd->seg, FLOG_MAGIC, 8)) {
+		fprintf(stderr, "ERROR: %s is not a frame log\n", path);
+		flog_reader_close(rd);
+		return -1;
+	}
+
+	memcpy(&rd->wall0, rd->seg + 8, 8);
+	memcpy(&rd->mono0, rd->seg + 16, 8);
+	snprintf(idxpath, sizeof(idxpath), "%s.idx", path);
+	for(tries = 0; ; tries++) {
+		if((rd->idx = flog_map(idxpath, &rd->idxlen)) != NULL &&
+			(ret = flog_load_index(rd)) <= 0)
+			return ret;
+
+		flog_unload_index(rd);
+		if(tries > 0)
+			break;
+
+		fprintf(stderr, "* Frame log: Rebuilding the index of %s\n", path);
+		if(flog_reindex(idxpath, rd->seg, rd->seglen) < 0)
+			break;
+	}
+
+	fprintf(stderr, "ERROR: Failed to index %s\n", path);
+	flog_reader_close(rd);
+	return -1;
+}
+
+/* Whether a frame that went in direction dir passes the filter, time aside */
+static int filter_match(const struct frame_filter *f, const struct pkt *pkt,
+		int dir) {
+	/* Without a payload data[0] is the checksum */
+	int err = pkt->len > 8 && (pkt->data[0] & 0xe0) == 0xe0?
+		pkt->data[0]: -1;
+
+	return (f->dir < 0 || dir == f->dir) &&
+		(f->port < 0 || pkt->port == f->port) &&
+		(f->cmd < 0 || pkt->cmd == f->cmd) &&
+		(f->seq < 0 || pkt->seq == f->seq) &&
+		(f->err < 0 || (f->err == FILTER_ERR_ANY? err >= 0: err == f->err));
+}
+
+/* Decode the frame at off if it passes the filter */
+static int flog_visit(const struct flog_reader *rd, uint64_t off,
+		const struct frame_filter *f, uint64_t from, uint64_t to) {
+	const uint8_t *p = rd->seg + off;
+	struct pkt pkt;
+	uint64_t ts;
+
+	if(off < FLOG_HDRSZ || off + FLOG_FRAME_HDRSZ + 8 > rd->end ||
+		p[FLOG_FRAME_HDRSZ + 2] < 8 ||
+		off + FLOG_FRAME_HDRSZ + p[FLOG_FRAME_HDRSZ + 2] > rd->end)
+		return -1;
+
+	memcpy(&ts, p, 8);
+	pkt_view(&pkt, p + FLOG_FRAME_HDRSZ);
+	if(ts < from || ts > to || !filter_match(f, &pkt, p[8]))
+		return 0;
+
+	pkt.ts = ts - rd->mono0 + rd->wall0;
+	out_session = p[9];
+	filter_packet(&pkt);
+	decode_packet(&pkt);
+	return 1;
+}
+
+/* Decode the frames of a log that pass the filter */
+static int flog_read(const char *path, const struct frame_filter *f,
+		int stats) {
+	struct flog_reader rd;
+	unsigned long visited = 0, matched = 0;
+	uint64_t from, to, lo, hi, off;
+	size_t n, k, a, b;
+	int ret;
+
+	if(flog_reader_open(&rd, path) < 0)
+		return -1;
+
+	/* To monotonic time, as in the log */
+	from = f->from > rd.wall0? f->from - rd.wall0 + rd.mono0: 0;
+	to = f->to == UINT64_MAX? UINT64_MAX:
+		f->to > rd.wall0? f->to - rd.wall0 + rd.mono0: 0;
+
+	/* From the last sample before from to the first one after to */
+	lo = FLOG_HDRSZ;
+	hi = rd.end;
+	n = flog_count(rd.time, rd.ntime, 2);
+	for(a = 0, b = n; a < b; ) {
+		k = (a + b) / 2;
+		if(flog_at(rd.time, k, 2)[0] < from) a = k + 1; else b = k;
+	}
+	if(a > 0)
+		lo = flog_at(rd.time, a - 1, 2)[1];
+	for(b = n; a < b; ) {
+		k = (a + b) / 2;
+		if(flog_at(rd.time, k, 2)[0] <= to) a = k + 1; else b = k;
+	}
+	if(a < n)
+		hi = flog_at(rd.time, a, 2)[1];
+
+	if(f->cmd >= 0) {
+		n = flog_count(rd.cmd[f->cmd], rd.ncmd[f->cmd], 1);
+		for(a = 0, b = n; a < b; ) {
+			k = (a + b) / 2;
+			if(*flog_at(rd.cmd[f->cmd], k, 1) < lo) a = k + 1; else b = k;
+		}
+
+		for(k = a; k < n && (off = *flog_at(rd.cmd[f->cmd], k, 1)) < hi;
+			k++) {
+			visited++;
+			if((ret = flog_visit(&rd, off, f, from, to)) < 0)
+				break;
+			matched += ret;
+		}
+	}
+	else {
+		for(off = lo; off < hi; off += FLOG_FRAME_HDRSZ +
+			rd.seg[off + FLOG_FRAME_HDRSZ + 2]) {
+			visited++;
+			if((ret = flog_visit(&rd, off, f, from, to)) < 0)
+				break;
+			matched += ret;
+		}
+	}
+
+	if(stats)
+		fprintf(stderr, "* Frame log: %lu frames matched, %lu read\n",
+			matched, visited);
+	flog_reader_close(&rd);
+	return 0;
+}
+
+/* A filter value, all of it a number that isn't negative, or -1 */
+static int filter_number(const char *val, int base) {
+	char *end;
+	long v;
+
+	errno = 0;
+	v = strtol(val, &end, base);
+	if(end == val || *end || errno || v < 0 || v > INT_MAX)
+		return -1;
+
+	return v;
+}
+
+/* Parse a filter such as port=4a,cmd=81,seq=120,dir=rx,err=e5 */
+static int filter_parse(struct frame_filter *f, const char *spec) {
+	char key[16], val[16];
+	const char *p = spec;
+	int n, v;
+
+	while(*p) {
+		if(sscanf(p, "%15[^=,]=%15[^,]%n", key, val, &n) != 2)
+			goto invalid;
+		p += n;
+		if(*p == ',')
+			p++;
+
+		v = 0;
+		if(!strcmp(key, "port"))
+			v = f->port = filter_number(val, 16);
+		else if(!strcmp(key, "cmd"))
+			v = f->cmd = filter_number(val, 16);
+		else if(!strcmp(key, "seq"))
+			v = f->seq = filter_number(val, 10);
+		else if(!strcmp(key, "dir") && !strcmp(val, "tx"))
+			f->dir = FLOG_TX;
+		else if(!strcmp(key, "dir") && !strcmp(val, "rx"))
+			f->dir = FLOG_RX;
+		else if(!strcmp(key, "err") && !strcmp(val, "any"))
+			f->err = FILTER_ERR_ANY;
+		else if(!strcmp(key, "err"))
+			v = f->err = filter_number(val, 16);
+		else
+			goto invalid;
+
+		if(v < 0) {
+			fprintf(stderr, "ERROR: Invalid %s '%s' in filter '%s'\n",
+				key, val, spec);
+			return -1;
+		}
+	}
+
+	if(f->port > 0xff || f->cmd > 0xff || f->seq > 0xffff ||
+		(f->err >= 0 && f->err != FILTER_ERR_ANY &&
+		(f->err < 0xe0 || f->err > 0xff)))
+		goto invalid;
+	return 0;
+
+invalid:
+	fprintf(stderr, "ERROR: Invalid filter '%s'\n", spec);
+	return -1;
+}
+
+/**
+ * Latency histogram
+ *
+ * Log-linear buckets in the style of HdrHistogram: values below 16 get
+ * a bucket each and every power of two above that is split into 16
+ * buckets, so any value is within 1/16 (6.25%) of its bucket's lower
+ * bound.  Values are in microseconds and fit in 32 bits.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count, sum;
+	uint32_t min, max;
+	uint32_t bucket[HIST_BUCKETS];
+};
+
+static int hist_index(uint32_t v) {
+	int e;
+
+	if(v < HIST_SUB)
+		return v;
+
+	e = 31 - __builtin_clz(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+		(v >> (e - HIST_SUB_BITS) & (HIST_SUB - 1));
+}
+
+/* Lowest value that goes into bucket i */
+static uint32_t hist_value(int i) {
+	int e;
+
+	if(i < HIST_SUB)
+		return i;
+
+	e = i / HIST_SUB + HIST_SUB_BITS - 1;
+	return (uint32_t)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+static void hist_add(struct hist *h, uint32_t v) {
+	if(h->count == 0 || v < h->min) h->min = v;
+	if(v > h->max) h->max = v;
+	h->count++;
+	h->sum += v;
+	h->bucket[hist_index(v)]++;
+}
+
+/* Value at or below which pct percent of the samples are */
+static uint32_t hist_percentile(const struct hist *h, double pct) {
+	uint64_t n = 0, want;
+	int i;
+
+	want = h->count * pct / 100.0 + 0.5;
+	if(want == 0) want = 1;
+	for(i = 0; i < HIST_BUCKETS; i++) {
+		n += h->bucket[i];
+		if(n >= want)
+			break;
+	}
+
+	/* Report the bucket's upper end, capped by what was seen */
+	if(i + 1 < HIST_BUCKETS && hist_value(i + 1) - 1 < h->max)
+		return hist_value(i + 1) - 1;
+	return h->max;
+}
+
+/**
+ * Request tracking
+ *
+ * Replies carry the sequence number of the request, on the request's
+ * port with bit 0x40 set.  Requests made with link_request() are kept in
+ * flight until a reply with the same port and sequence number arrives,
+ * which lets several commands be outstanding at a time.  Up to window
+ * requests may be in flight per port, more are queued.  Requests that
+ * aren't answered within the timeout are sent again, with a new
+ * sequence number, up to a number of retries.
+ *
+ * Round-trip times from the last (re)transmission to the reply are
+ * recorded per command.
+ */
+#define REQ_MAX_INFLIGHT 64
+#define REQ_MAX_QUEUE 64
+#define REQ_MAX_WINDOW 16
+#define REQ_WINDOW 4
+#define REQ_TIMEOUT_MS 500
+#define REQ_RETRIES 2
+/* How often timeouts are checked for */
+#define REQ_TICK_MS 10
+
+struct request {
+	uint8_t port, cmd, size, tries;
+	uint16_t seq;
+	/* When it was last sent and when it's due, monotonic ns */
+	uint64_t sent, deadline;
+	uint8_t data[255 - 8];
+};
+
+struct req_stats {
+	unsigned long sent, replies, retries, timeouts, errors;
+	/* Allocated on first reply */
+	struct hist *rtt;
+};
+
+struct reqs {
+	int window, retries;
+	uint64_t timeout;
+	struct request inflight[REQ_MAX_INFLIGHT];
+	int ninflight;
+	uint8_t port_inflight[64];
+	/* Waiting for room in the window of their port */
+	struct request queue[REQ_MAX_QUEUE];
+	int qhead, qlen;
+	struct req_stats cmd[256];
+	/* Requests in flight or queued per command */
+	uint16_t pending[256];
+	/* Replies that matched no request, i.e pushed by the aircraft */
+	unsigned long unsolicited, dropped;
+};
+
+/**
+ * Telemetry polling
+ *
+ * Each polled command has its own rate, i.e -p 49=20,53=1,52=5 polls
+ * 0x49 at 20 Hz, 0x53 at 1 Hz and 0x52 at 5 Hz on port 0x0a (another
+ * port is given as in 08:41=0.2).  Polls are scheduled on a fixed grid
+ * of absolute deadlines so they don't drift, and how late each one
+ * went out is recorded.  Slots that have passed entirely are skipped
+ * rather than sent in a burst.
+ *
+ * If the previous poll of a command hasn't been answered when the next
+ * one is due the link is lagging and the period is doubled, up to
+ * POLL_MAX_BACKOFF times the nominal one.  Each poll that goes out with
+ * nothing outstanding halves it again.
+ *
+ * Polls that fall due together are written to the socket at once.
+ */
+#define POLL_MAX 16
+#define POLL_MAX_BACKOFF 8
+#ifndef POLL_MAX_HZ
+#define POLL_MAX_HZ 1000
+#endif
+
+struct poller {
+	uint8_t port, cmd;
+	/* Nominal period, multiplied by backoff */
+	uint64_t period;
+	int backoff;
+	/* Next deadline, monotonic ns */
+	uint64_t due;
+	unsigned long sent, skipped, backoffs;
+	/* How late polls went out, in microseconds */
+	struct hist late;
+};
+
+struct polls {
+	struct poller p[POLL_MAX];
+	int n;
+};
+
+/* Waypoints to upload and which of them the aircraft has acknowledged */
+#define MISSION_MAX_WAYPOINTS 16
+
+struct mission {
+	struct record wp[MISSION_MAX_WAYPOINTS];
+	int n, nacked;
+	uint32_t acked;
+	/* Ground station sequence number of wp[0] in the latest upload */
+	uint16_t gs_seq;
+	/* When the upload started, monotonic ns */
+	uint64_t started;
+};
+
+/* A connection to ser2net */
+struct link {
+	int fd;
+	/* Sequence number of the next packet we send */
+	uint16_t seq;
+	struct framer rx;
+	struct reqs req;
+	struct polls polls;
+	struct mission mission;
+	/**
+	 * Frames not yet written, held back while corked (see link_cork())
+	 * or queued until the socket has room, the fd is non-blocking
+	 */
+	int corked;
+	size_t txlen;
+	uint8_t tx[16384];
+	/* Called as frames start and stop waiting for room, or NULL */
+	void (*wait_out)(struct link *ln, int wait);
+	void *arg;
+	int waiting;
+};
+
+/**
+ * Hold back frames from send_packet() until link_uncork() so that they
+ * go out in a single write.
+ */
+static void link_cork(struct link *ln) {
+	ln->corked = 1;
+}
+
+/* Write what the socket takes without blocking, keep the rest queued */
+static int link_flush(struct link *ln) {
+	size_t off = 0;
+	ssize_t n;
+
+	while(off < ln->txlen) {
+		if((n = send(ln->fd, ln->tx + off, ln->txlen - off,
+			MSG_NOSIGNAL)) < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			ln->txlen = 0;
+			return -1;
+		}
+
+		off += n;
+	}
+
+	memmove(ln->tx, ln->tx + off, ln->txlen - off);
+	ln->txlen -= off;
+	if(ln->wait_out && ln->waiting != (ln->txlen > 0)) {
+		ln->waiting = ln->txlen > 0;
+		ln->wait_out(ln, ln->waiting);
+	}
+
+	return 0;
+}
+
+static int link_uncork(struct link *ln) {
+	ln->corked = 0;
+	return link_flush(ln);
+}
+
+/* Build a frame in buf, which needs room for size + 8 bytes */
+static int frame_build(uint8_t *buf, uint8_t port, uint16_t seq, uint8_t cmd,
+		const uint8_t *data, uint8_t size) {
+	int len = 0;
+
+	buf[len++] = DJI_PHANTOM_MAGIC & 0xff;
+	buf[len++] = DJI_PHANTOM_MAGIC >> 8;
+	/* The whole frame: magic, length, port, seq, cmd, data, checksum */
+	buf[len++] = 2 + 1 + 1 + 2 + 1 + size + 1;
+	buf[len++] = port;
+	buf[len++] = seq & 0xff;
+	buf[len++] = seq >> 8;
+	buf[len++] = cmd;
+	if(size > 0) {
+		memcpy(buf + len, data, size);
+		len += size;
+	}
+
+	buf[len] = cksum_xor(buf, len);
+	return len + 1;
+}
+
+/**
+ * Queue a frame and write it unless corked.  Never blocks, fails with
+ * ENOBUFS if the aircraft stopped reading long enough for the queue to
+ * fill up.
+ */
+static int send_packet(struct link *ln, uint8_t port, uint8_t cmd, const uint8_t *data, uint8_t size) {
+	uint8_t buf[255], len;
+	struct pkt pkt;
+
+	len = frame_build(buf, port & 0x3f, ln->seq, cmd, data, size);
+	pkt_view(&pkt, buf);
+	pkt.ts = time_now_ns();
+	if(sizeof(ln->tx) - ln->txlen < len && (link_flush(ln) < 0 ||
+		sizeof(ln->tx) - ln->txlen < len)) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	memcpy(ln->tx + ln->txlen, buf, len);
+	ln->txlen += len;
+	if(!ln->corked && link_flush(ln) < 0)
+		return -1;
+
+	ln->seq++;
+	flog_frame(&pkt, FLOG_TX);
+
+	return filter_packet(&pkt);
+}
+
+static void req_init(struct reqs *rq) {
+	memset(rq, 0, sizeof(*rq));
+	rq->window = REQ_WINDOW;
+	rq->retries = REQ_RETRIES;
+	rq->timeout = REQ_TIMEOUT_MS * 1000000ull;
+}
+
+static void req_free(struct reqs *rq) {
+	int i;
+
+	for(i = 0; i < 256; i++)
+		free(rq->cmd[i].rtt);
+	memset(rq->cmd, 0, sizeof(rq->cmd));
+}
+
+/* Forget what's in flight or queued, i.e on reconnects, keep the stats */
+static void req_reset(struct reqs *rq) {
+	rq->ninflight = 0;
+	rq->qhead = rq->qlen = 0;
+	memset(rq->port_inflight, 0, sizeof(rq->port_inflight));
+	memset(rq->pending, 0, sizeof(rq->pending));
+}
+
+/* (Re)transmit a request with the next sequence number */
+static int req_transmit(struct link *ln, struct request *r) {
+	r->seq = ln->seq;
+	r->sent = time_mono_ns();
+	r->deadline = r->sent + ln->req.timeout;
+	r->tries++;
+	return send_packet(ln, r->port, r->cmd, r->data, r->size);
+}
+
+static int req_start(struct link *ln, const struct request *q) {
+	struct reqs *rq = &ln->req;
+	struct request *r;
+
+	r = &rq->inflight[rq->ninflight++];
+	*r = *q;
+	r->tries = 0;
+	rq->port_inflight[r->port]++;
+	rq->cmd[r->cmd].sent++;
+	return req_transmit(ln, r);
+}
+
+/* Start queued requests for port now that there's room */
+static int req_dequeue(struct link *ln, int port) {
+	struct reqs *rq = &ln->req;
+	struct request r;
+	int i, j, k;
+
+	for(i = 0; i < rq->qlen && rq->port_inflight[port] < rq->window &&
+		rq->ninflight < REQ_MAX_INFLIGHT; ) {
+		j = (rq->qhead + i) % REQ_MAX_QUEUE;
+		if(rq->queue[j].port != port) {
+			i++;
+			continue;
+		}
+
+		/* Close the gap, keeping the order of the rest */
+		r = rq->queue[j];
+		for(k = i; k + 1 < rq->qlen; k++)
+			rq->queue[(rq->qhead + k) % REQ_MAX_QUEUE] =
+				rq->queue[(rq->qhead + k + 1) % REQ_MAX_QUEUE];
+		rq->qlen--;
+		if(req_start(ln, &r) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void req_retire(struct link *ln, struct request *r) {
+	struct reqs *rq = &ln->req;
+	int port = r->port;
+
+	rq->port_inflight[port]--;
+	rq->pending[r->cmd]--;
+	*r = rq->inflight[--rq->ninflight];
+}
+
+/**
+ * Send a tracked request, or queue it if the window for the port is
+ * full.  Should the queue be full too the request is dropped and
+ * counted, that's not an error: only failing to send is, and that
+ * returns -1.
+ */
+static int link_request(struct link *ln, uint8_t port, uint8_t cmd,
+		const uint8_t *data, uint8_t size) {
+	struct reqs *rq = &ln->req;
+	struct request r;
+
+	port &= 0x3f;
+	if(size > sizeof(r.data))
+		return -1;
+
+	r.port = port;
+	r.cmd = cmd;
+	r.size = size;
+	memcpy(r.data, data, size);
+	if(rq->port_inflight[port] < rq->window &&
+		rq->ninflight < REQ_MAX_INFLIGHT) {
+		rq->pending[cmd]++;
+		return req_start(ln, &r);
+	}
+
+	if(rq->qlen == REQ_MAX_QUEUE) {
+		rq->dropped++;
+		fprintf(stderr, "link_request(): Queue full, dropping cmd 0x%02x"
+			" to port 0x%02x\n", cmd, port);
+		return 0;
+	}
+
+	rq->queue[(rq->qhead + rq->qlen++) % REQ_MAX_QUEUE] = r;
+	rq->pending[cmd]++;
+	return 0;
+}
+
+/* Match a received packet against the requests in flight */
+static int req_reply(struct link *ln, const struct pkt *pkt) {
+	struct reqs *rq = &ln->req;
+	struct req_stats *st;
+	struct request *r;
+	uint64_t rtt;
+	int i, port;
+
+	if(!(pkt->port & 0x40))
+		return 0;
+
+	port = pkt->port & 0x3f;
+	for(i = 0, r = NULL; i < rq->ninflight; i++)
+		if(rq->inflight[i].port == port && rq->inflight[i].seq == pkt->seq) {
+			r = &rq->inflight[i];
+			break;
+		}
+
+	if(r == NULL) {
+		rq->unsolicited++;
+		return 0;
+	}
+
+	st = &rq->cmd[r->cmd];
+	st->replies++;
+	/**
+	 * Errors come back with a different command, i.e 0xe5 or 0xff,
+	 * except for ground station data which is answered with feedback
+	 */
+	if(pkt->cmd != r->cmd && !(r->cmd == 0x80 && pkt->cmd == 0x81))
+		st->errors++;
+
+	rtt = (time_mono_ns() - r->sent) / 1000;
+	if(st->rtt == NULL && (st->rtt = calloc(1, sizeof(*st->rtt))) == NULL)
+		return -1;
+	hist_add(st->rtt, rtt > UINT32_MAX? UINT32_MAX: rtt);
+
+	req_retire(ln, r);
+	return req_dequeue(ln, port);
+}
+
+/* Retransmit or give up on requests that are past due */
+static int req_expire(struct link *ln, uint64_t now) {
+	struct reqs *rq = &ln->req;
+	struct request *r;
+	int i, port;
+
+	for(i = 0; i < rq->ninflight; i++) {
+		r = &rq->inflight[i];
+		if(now < r->deadline)
+			continue;
+
+		if(r->tries <= rq->retries) {
+			rq->cmd[r->cmd].retries++;
+			if(req_transmit(ln, r) < 0)
+				return -1;
+			continue;
+		}
+
+		fprintf(stderr, "req_expire(): cmd 0x%02x to port 0x%02x (seq %u)"
+			" timed out after %d tries\n", r->cmd, r->port, r->seq,
+			r->tries);
+		rq->cmd[r->cmd].timeouts++;
+		port = r->port;
+		req_retire(ln, r);
+		if(req_dequeue(ln, port) < 0)
+			return -1;
+		/* Another request was moved into slot i */
+		i--;
+	}
+
+	return 0;
+}
+
+/* Per-command request counts and round-trip times */
+static void req_stats(const struct reqs *rq, FILE *fp) {
+	const struct req_stats *st;
+	const struct hist *h;
+	int cmd;
+
+	fprintf(fp, "* Request statistics (round-trip times in ms)\n");
+	for(cmd = 0; cmd < 256; cmd++) {
+		st = &rq->cmd[cmd];
+		if(st->sent == 0)
+			continue;
+
+		fprintf(fp, "  [0x%02x] %6lu sent %6lu replies %5lu retries"
+			" %5lu timeouts %5lu errors", cmd, st->sent, st->replies,
+			st->retries, st->timeouts, st->errors);
+		if((h = st->rtt) != NULL)
+			fprintf(fp, ", min %.1f p50 %.1f p90 %.1f p99 %.1f"
+				" max %.1f avg %.1f", h->min / 1000.0,
+				hist_percentile(h, 50) / 1000.0,
+				hist_percentile(h, 90) / 1000.0,
+				hist_percentile(h, 99) / 1000.0,
+				h->max / 1000.0, h->sum / 1000.0 / h->count);
+		fprintf(fp, "\n");
+	}
+
+	fprintf(fp, "  %d in flight, %d queued, %lu dropped,"
+		" %lu unsolicited replies\n", rq->ninflight, rq->qlen,
+		rq->dropped, rq->unsolicited);
+}
+
+/* Parse a list of [port:]cmd=hz, with port and command in hex */
+static int poll_parse(struct polls *ps, const char *spec) {
+	struct poller *p;
+	unsigned long port, cmd;
+	const char *s = spec;
+	char *end;
+	double hz;
+
+	while(*s) {
+		port = 0x0a;
+		cmd = strtoul(s, &end, 16);
+		if(*end == ':') {
+			port = cmd;
+			cmd = strtoul(end + 1, &end, 16);
+		}
+
+		if(*end != '=' || port > 0x3f || cmd > 0xff)
+			goto invalid;
+		hz = strtod(end + 1, &end);
+		if(!(hz > 0 && hz <= POLL_MAX_HZ) || (*end && *end != ','))
+			goto invalid;
+		if(ps->n == POLL_MAX) {
+			fprintf(stderr, "ERROR: At most %d commands can be polled\n",
+				POLL_MAX);
+			return -1;
+		}
+
+		p = &ps->p[ps->n++];
+		memset(p, 0, sizeof(*p));
+		p->port = port;
+		p->cmd = cmd;
+		p->period = 1e9 / hz;
+		p->backoff = 1;
+		s = *end? end + 1: end;
+	}
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "ERROR: Invalid poll schedule '%s', expected"
+		" [port:]cmd=hz,...\n", spec);
+	return -1;
+}
+
+/* Start every poller now, in phase with each other */
+static void poll_start(struct polls *ps, uint64_t now) {
+	int i;
+
+	for(i = 0; i < ps->n; i++) {
+		ps->p[i].due = now;
+		ps->p[i].backoff = 1;
+	}
+}
+
+/**
+ * Send the polls that are due and return when the next one is.  Returns
+ * zero if there's nothing to poll and UINT64_MAX if sending failed.
+ */
+static uint64_t poll_run(struct link *ln, uint64_t now) {
+	struct polls *ps = &ln->polls;
+	struct poller *p;
+	uint64_t next = 0, late, missed;
+	int i, ret = 0;
+
+	link_cork(ln);
+	for(i = 0; i < ps->n; i++) {
+		p = &ps->p[i];
+		if(now >= p->due) {
+			late = (now - p->due) / 1000;
+			hist_add(&p->late, late > UINT32_MAX? UINT32_MAX: late);
+			if(ln->req.pending[p->cmd] > 0) {
+				if(p->backoff < POLL_MAX_BACKOFF) {
+					p->backoff = MIN(p->backoff * 2,
+						POLL_MAX_BACKOFF);
+					p->backoffs++;
+				}
+				p->skipped++;
+			}
+			else {
+				if(p->backoff > 1)
+					p->backoff /= 2;
+				if(link_request(ln, p->port, p->cmd, (uint8_t *)"", 1) < 0)
+					ret = -1;
+				p->sent++;
+			}
+
+			p->due += p->period * p->backoff;
+			if(p->due <= now) {
+				/* Keep the phase but don't make up for lost slots */
+				missed = (now - p->due) / p->period + 1;
+				p->due += missed * p->period;
+				p->skipped += missed;
+			}
+		}
+
+		if(next == 0 || p->due < next)
+			next = p->due;
+	}
+
+	if(link_uncork(ln) < 0 || ret < 0)
+		return UINT64_MAX;
+
+	return next;
+}
+
+static void poll_stats(const struct polls *ps, FILE *fp) {
+	const struct poller *p;
+	int i;
+
+	if(ps->n == 0)
+		return;
+
+	fprintf(fp, "* Polling statistics (lateness in ms)\n");
+	for(i = 0; i < ps->n; i++) {
+		p = &ps->p[i];
+		fprintf(fp, "  [0x%02x] port 0x%02x at %7.2f Hz %8lu sent %6lu skipped"
+			" %5lu backoffs, now %dx", p->cmd, p->port,
+			1e9 / p->period, p->sent, p->skipped, p->backoffs,
+			p->backoff);
+		if(p->late.count > 0)
+			fprintf(fp, ", late p50 %.3f p99 %.3f max %.3f",
+				hist_percentile(&p->late, 50) / 1000.0,
+				hist_percentile(&p->late, 99) / 1000.0,
+				p->late.max / 1000.0);
+		fprintf(fp, "\n");
+	}
+}
+
+/**
+ * Missions
+ *
+ * A mission is a route of up to MISSION_MAX_WAYPOINTS waypoints (-m),
+ * uploaded as encrypted 0x301 commands in 0x80 frames when the link
+ * comes up and on M at the console.  Waypoints are requests like any
+ * other, so they are pipelined up to the window (-W) and retried when
+ * their replies time out; with -W 16 a full route goes out in a single
+ * round trip.  A waypoint counts as acknowledged when 0x81 feedback
+ * carries the ground station sequence number and command of its 0x301.
+ *
+ * Mission files are CSV or JSON, which includes what -o csv and -o json
+ * print so that a route captured in ground station mode can be flown
+ * again.  CSV columns are named by a header line:
+ *
+ * #lat,lon,alt,vel,heading
+ * 59.3293,18.0686,30,5,90
+ *
+ * or are turn_mode,lat,lon,alt,vel,timelimit,heading without one.  Rows
+ * of other record types are skipped.  JSON is objects, one per line or
+ * in an array, with fields named as in gs_waypoint records.  Latitude
+ * and longitude are in degrees and ids follow file order unless given.
+ */
+#define MISSION_MAX_COLUMNS 32
+
+static const char *mission_columns[] = {
+	"turn_mode", "lat", "lon", "alt", "vel", "timelimit", "heading", NULL
+};
+
+/* As printed by -o csv without -c */
+static const char *mission_record_columns[] = {
+	"ts", "type", "port", "seq", "cmd", "id", "turn_mode", "lat", "lon",
+	"alt", "vel", "timelimit", "heading", NULL
+};
+
+static const struct rec_field *mission_field(const char *name) {
+	const struct rec_field *f;
+
+	for(f = waypoint_fields; f->name != NULL; f++)
+		if(!strcmp(f->name, name))
+			return f;
+
+	return NULL;
+}
+
+/**
+ * Parse a number into a record field, the inverse of fmt_value().
+ * Returns -1 unless there's a number in range at s.
+ */
+static int field_store(struct record *r, const struct rec_field *f,
+		const char *s, char **end) {
+	uint8_t *p = (uint8_t *)r + f->off;
+	long long v;
+	uint16_t u16;
+	uint32_t u32;
+	float f32;
+	double f64;
+
+	errno = 0;
+	switch(f->kind) {
+	case F_F32:
+		f32 = strtod(s, end);
+		memcpy(p, &f32, 4);
+		break;
+	case F_F64:
+		f64 = strtod(s, end);
+		memcpy(p, &f64, 8);
+		break;
+	case F_STR:
+		return -1;
+	default:
+		v = strtoll(s, end, 10);
+		if(f->kind == F_I16? v < -32768 || v > 32767:
+			v < 0 || v >> (f->size * 8))
+			return -1;
+		if(f->size == 1)
+			p[0] = v;
+		else if(f->size == 2) {
+			u16 = v;
+			memcpy(p, &u16, 2);
+		}
+		else {
+			u32 = v;
+			memcpy(p, &u32, 4);
+		}
+		break;
+	}
+
+	return *end == s || errno? -1: 0;
+}
+
+static int mission_add(struct mission *m, const struct record *r,
+		const char *path, int lineno) {
+	if(m->n == MISSION_MAX_WAYPOINTS) {
+		fprintf(stderr, "ERROR: %s:%d: More than %d waypoints\n", path,
+			lineno, MISSION_MAX_WAYPOINTS);
+		return -1;
+	}
+
+	if(!(r->u.waypoint.lat >= -90 && r->u.waypoint.lat <= 90 &&
+		r->u.waypoint.lon >= -180 && r->u.waypoint.lon <= 180)) {
+		fprintf(stderr, "ERROR: %s:%d: Waypoint needs a latitude and"
+			" longitude in degrees\n", path, lineno);
+		return -1;
+	}
+
+	m->wp[m->n++] = *r;
+	return 0;
+}
+
+/* Split a CSV line in place, returns the number of columns */
+static int mission_split(char *s, char **cols) {
+	int n = 0;
+
+	s[strcspn(s, "\r\n")] = 0;
+	cols[n++] = s;
+	while(n < MISSION_MAX_COLUMNS && (s = strchr(s, ',')) != NULL) {
+		*s++ = 0;
+		cols[n++] = s;
+	}
+
+	return n;
+}
+
+static int mission_load_csv(char *text, struct mission *m, const char *path) {
+	char *line, *next, *cols[MISSION_MAX_COLUMNS];
+	const char *names[MISSION_MAX_COLUMNS + 1];
+	const char *typed[MISSION_MAX_COLUMNS + 1];
+	const struct rec_field *f;
+	const char **use, *type;
+	struct record r;
+	char *end;
+	int i, n, t, lineno = 0;
+
+	memcpy(names, mission_columns, sizeof(mission_columns));
+	memcpy(typed, mission_record_columns, sizeof(mission_record_columns));
+	for(line = text; line != NULL && *line; line = next) {
+		lineno++;
+		if((next = strchr(line, '\n')) != NULL)
+			*next++ = 0;
+		if(line[strspn(line, " \t\r")] == 0)
+			continue;
+
+		/* Rows from -o csv have their type in column 1 */
+		n = mission_split(line, cols);
+		type = line[0] == '#'? cols[0] + 1: n > 1? cols[1]: "";
+		for(t = 0; t < REC_TYPES; t++)
+			if(!strcmp(type, rec_descs[t].name))
+				break;
+
+		/* A header for plain rows or, as -o csv prints, for a type */
+		if(line[0] == '#') {
+			if(t == REC_GS_WAYPOINT) {
+				typed[0] = "ts";
+				typed[1] = "type";
+				use = typed;
+				i = 2;
+			}
+			else if(t == REC_TYPES) {
+				cols[0]++;
+				use = names;
+				i = 0;
+			}
+			else
+				continue;
+
+			for(; i < n; i++)
+				use[i] = cols[i];
+			use[i] = NULL;
+			continue;
+		}
+
+		if(t != REC_TYPES && t != REC_GS_WAYPOINT)
+			continue;
+
+		memset(&r, 0, sizeof(r));
+		r.type = REC_GS_WAYPOINT;
+		r.u.waypoint.id = m->n;
+		r.u.waypoint.lat = r.u.waypoint.lon = NAN;
+		use = t == REC_GS_WAYPOINT? typed: names;
+		for(i = 0; i < n && use[i] != NULL; i++) {
+			/* Only what was sent to the aircraft, not feedback */
+			if(!strcmp(use[i], "cmd") && strtol(cols[i], NULL, 0) != 0x80)
+				break;
+			if((f = mission_field(use[i])) == NULL)
+				continue;
+			if(field_store(&r, f, cols[i], &end) < 0 ||
+				end[strspn(end, " \t")]) {
+				fprintf(stderr, "ERROR: %s:%d: Invalid %s\n",
+					path, lineno, f->name);
+				return -1;
+			}
+		}
+
+		if(i < n && use[i] != NULL)
+			continue;
+		if(mission_add(m, &r, path, lineno) < 0)
+			return -1;
+	}
+
+	return m->n;
+}
+
+/* Where the value of key is in a JSON object, or NULL */
+static char *json_find(char *obj, const char *key) {
+	size_t n = strlen(key);
+	char *p = obj;
+
+	while((p = strchr(p, '"')) != NULL) {
+		p++;
+		if(!strncmp(p, key, n) && p[n] == '"') {
+			p += n + 1;
+			p += strspn(p, " \t\r\n");
+			if(*p == ':')
+				return p + 1 + strspn(p + 1, " \t\r\n");
+		}
+		/* Skip the rest of the string, fmt_value() escapes quotes */
+		if((p = strchr(p, '"')) == NULL)
+			break;
+		p++;
+	}
+
+	return NULL;
+}
+
+static int mission_load_json(char *text, struct mission *m, const char *path) {
+	const struct rec_field *f;
+	char *obj, *end, *v;
+	struct record r;
+	int lineno = 1;
+
+	for(obj = text; (obj = strchr(obj, '{')) != NULL; obj = end + 1) {
+		for(v = text; v < obj; v++)
+			lineno += *v == '\n';
+		text = obj;
+		if((end = strchr(obj, '}')) == NULL) {
+			fprintf(stderr, "ERROR: %s:%d: Unterminated object\n",
+				path, lineno);
+			return -1;
+		}
+		*end = 0;
+
+		v = json_find(obj, "type");
+		if(v != NULL && strncmp(v, "\"gs_waypoint\"", 13))
+			continue;
+		v = json_find(obj, "cmd");
+		if(v != NULL && strtol(v, NULL, 0) != 0x80)
+			continue;
+
+		memset(&r, 0, sizeof(r));
+		r.type = REC_GS_WAYPOINT;
+		r.u.waypoint.id = m->n;
+		r.u.waypoint.lat = r.u.waypoint.lon = NAN;
+		for(f = waypoint_fields; f->name != NULL; f++) {
+			if((v = json_find(obj, f->name)) == NULL ||
+				!strncmp(v, "null", 4))
+				continue;
+			if(field_store(&r, f, v, &v) < 0 ||
+				!strchr(",} \t\r\n", *v)) {
+				fprintf(stderr, "ERROR: %s:%d: Invalid %s\n",
+					path, lineno, f->name);
+				return -1;
+			}
+		}
+
+		if(mission_add(m, &r, path, lineno) < 0)
+			return -1;
+	}
+
+	return m->n;
+}
+
+/* Load a mission file, returns the number of waypoints or -1 */
+static int mission_load(const char *path, struct mission *m) {
+	char *text = NULL, *p;
+	size_t size = 0;
+	FILE *fp;
+	int ret;
+
+	if((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "ERROR: Failed to open %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	memset(m, 0, sizeof(*m));
+	if(getdelim(&text, &size, 0, fp) < 0) {
+		fprintf(stderr, "ERROR: Failed to read %s\n", path);
+		ret = -1;
+	}
+	else {
+		p = text + strspn(text, " \t\r\n");
+		if(*p == '{' || *p == '[')
+			ret = mission_load_json(text, m, path);
+		else
+			ret = mission_load_csv(text, m, path);
+	}
+
+	free(text);
+	fclose(fp);
+	return ret;
+}
+
+/* Mission progress goes to stderr, like other news about a session */
+static void mission_tag(void) {
+	if(session_names[out_session])
+		fprintf(stderr, "%s: ", session_names[out_session]);
+}
+
+/* Send the waypoints that haven't been acknowledged */
+static int mission_upload(struct link *ln) {
+	struct mission *m = &ln->mission;
+	uint8_t data[GS_WAYPOINT_SIZE];
+	int i;
+
+	/* Fresh sequence numbers, feedback to an earlier upload is stale */
+	m->gs_seq += MISSION_MAX_WAYPOINTS;
+	if(m->started == 0)
+		m->started = time_mono_ns();
+
+	mission_tag();
+	fprintf(stderr, "* Mission: Uploading %d of %d waypoints\n",
+		m->n - m->nacked, m->n);
+	for(i = 0; i < m->n; i++) {
+		if(m->acked & 1u << i)
+			continue;
+
+		gs_encode_waypoint(data, m->gs_seq + i, &m->wp[i]);
+		if(link_request(ln, 0x0a, 0x80, data, sizeof(data)) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Look for acknowledgements in ground station feedback (0x81) */
+static void mission_feedback(struct link *ln, const struct pkt *pkt) {
+	struct mission *m = &ln->mission;
+	uint32_t buf[64];
+	uint16_t seq, cmd, i;
+
+	if(m->nacked == m->n || gs_open(pkt, buf, &seq, &cmd) < 0 ||
+		cmd != 0x301)
+		return;
+
+	i = seq - m->gs_seq;
+	if(i >= m->n || m->acked & 1u << i)
+		return;
+
+	m->acked |= 1u << i;
+	if(++m->nacked < m->n)
+		return;
+
+	mission_tag();
+	fprintf(stderr, "* Mission: %d waypoints acknowledged in %.1f ms\n",
+		m->n, (time_mono_ns() - m->started) / 1e6);
+}
+
+static void mission_stats(const struct mission *m, FILE *fp) {
+	if(m->n > 0)
+		fprintf(fp, "* Mission: %d of %d waypoints acknowledged\n",
+			m->nacked, m->n);
+}
+
+/* Print the 0x80 frames of a mission as hex, as read by -f */
+static void mission_print(const struct mission *m, FILE *fp) {
+	uint8_t data[GS_WAYPOINT_SIZE], frame[GS_WAYPOINT_SIZE + 8];
+	int i, j, len;
+
+	for(i = 0; i < m->n; i++) {
+		gs_encode_waypoint(data, i, &m->wp[i]);
+		len = frame_build(frame, 0x0a, i, 0x80, data, sizeof(data));
+		for(j = 0; j < len; j++)
+			fprintf(fp, "%02x", frame[j]);
+		fprintf(fp, "\n");
+	}
+}
+
+static int connect_to_ser2net(const char *host, const char *port) {
+	int ret, s;
+	struct addrinfo hints, *ai, *ai0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if((ret = getaddrinfo(host, port, &hints, &ai0)) != 0) {
+		fprintf(stderr, "getaddrinfo(%s:%s): %s\n", host, port,
+			gai_strerror(ret));
+		return -1;
+	}
+
+	for(s = -1, ai = ai0; ai; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
 		if(s < 0) continue;
 		if(connect(s, ai->ai_addr, ai->ai_addrlen) != -1)
 			break;
 
-		close(s);
-		s = -1;
+		close(s);
+		s = -1;
+	}
+
+	freeaddrinfo(ai0);
+	return s;
+}
+
+/**
+ * Addresses of a peer, looked up once when a session or relay is set up
+ * since getaddrinfo() blocks.  Connecting goes through them in turn, one
+ * address per attempt.
+ */
+#define PEER_MAX_ADDRS 4
+
+struct peer {
+	struct sockaddr_storage addr[PEER_MAX_ADDRS];
+	socklen_t len[PEER_MAX_ADDRS];
+	int n, cur;
+};
+
+static int peer_resolve(struct peer *p, const char *host, const char *port) {
+	struct addrinfo hints, *ai, *ai0;
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if((ret = getaddrinfo(host, port, &hints, &ai0)) != 0) {
+		fprintf(stderr, "getaddrinfo(%s:%s): %s\n", host, port,
+			gai_strerror(ret));
+		return -1;
+	}
+
+	for(p->n = p->cur = 0, ai = ai0; ai && p->n < PEER_MAX_ADDRS;
+		ai = ai->ai_next) {
+		memcpy(&p->addr[p->n], ai->ai_addr, ai->ai_addrlen);
+		p->len[p->n++] = ai->ai_addrlen;
+	}
+
+	freeaddrinfo(ai0);
+	return p->n > 0? 0: -1;
+}
+
+/**
+ * Start connecting to the next address of a peer.  Returns a non-blocking
+ * socket, which is writable once connected or failed: check SO_ERROR with
+ * peer_connected().  Returns -1 with errno set on errors.
+ */
+static int peer_connect(struct peer *p) {
+	int s, i = p->cur++ % p->n;
+
+	s = socket(p->addr[i].ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,
+		0);
+	if(s < 0)
+		return -1;
+	if(connect(s, (struct sockaddr *)&p->addr[i], p->len[i]) < 0 &&
+		errno != EINPROGRESS) {
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+/* Whether a socket from peer_connect() connected, errno is set if not */
+static int peer_connected(int s) {
+	socklen_t len;
+	int err;
+
+	len = sizeof(err);
+	if(getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		return 0;
+	errno = err;
+	return err == 0;
+}
+
+/* Listen on [host:]port, all addresses without a host */
+static int listen_on(const char *addr) {
+	struct addrinfo hints, *ai, *ai0;
+	char host[128], *port;
+	int ret, s = -1, one = 1;
+
+	/* [host:]port */
+	snprintf(host, sizeof(host), "%s", addr);
+	if((port = strrchr(host, ':')) != NULL)
+		*port++ = 0;
+	else
+		port = host;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if((ret = getaddrinfo(port == host? NULL: host, port, &hints, &ai0)) != 0) {
+		fprintf(stderr, "getaddrinfo(%s): %s\n", addr, gai_strerror(ret));
+		return -1;
+	}
+
+	for(ai = ai0; ai; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			ai->ai_protocol);
+		if(s < 0) continue;
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if(bind(s, ai->ai_addr, ai->ai_addrlen) == 0 && listen(s, 64) == 0)
+			break;
+
+		close(s);
+		s = -1;
+	}
+
+	freeaddrinfo(ai0);
+	return s;
+}
+
+/* Send current time (cmd 0x20) to camera module at port 0x08 */
+static int init_camera_time_bcd(struct link *ln) {
+        uint8_t buf[15], i;
+        time_t t;
+        struct tm *tm;
+
+        time(&t);
+        tm = localtime(&t);
+        strftime((char *)buf, sizeof(buf), "%y20%m%d%H%M%S", tm);
+        for(i = 0; i < 7; i++) buf[i] = buf[2*i] << 4 | (buf[2*i+1] & 0x0f);
+
+        return link_request(ln, 0x08, 0x20, buf, 7);
+}
+
+/**
+ * Offline capture reader
+ *
+ * Reads libpcap (.pcap) and pcapng files directly, without depending on
+ * libpcap, reassembles both directions of the TCP streams to and from
+ * the ser2net port and feeds them through the framer into the decoders.
+ * The file is processed in a single streaming pass through a large read
+ * buffer so captures of any size can be handled (use "-" for stdin).
+ */
+#define CAP_BUFSZ (4 << 20)
+#define CAP_MAX_IFS 16
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_SPB 0x00000003
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BOM 0x1a2b3c4d
+
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_LINUX_SLL2 276
+
+struct capfile {
+	int fd;
+	uint8_t *buf;
+	size_t size, head, tail;
+	int eof;
+	/* Set for pcapng files */
+	int ng;
+	/* Set if the file's byte order differs from ours */
+	int swap;
+	/* Per interface link type and timestamp resolution */
+	struct {
+		uint16_t linktype;
+		uint32_t snaplen;
+		/* pcapng if_tsresol, i.e 6 for microseconds */
+		uint8_t tsresol;
+	} ifs[CAP_MAX_IFS];
+	int nifs;
+};
+
+/* A captured link layer packet */
+struct cappkt {
+	/* Nanoseconds since the epoch */
+	uint64_t ts;
+	uint16_t linktype;
+	const uint8_t *data;
+	uint32_t len;
+};
+
+/* A TCP segment found in a captured packet */
+struct tcpseg {
+	uint8_t saddr[16], daddr[16];
+	int alen;
+	uint16_t sport, dport;
+	uint32_t seq;
+	uint8_t flags;
+	const uint8_t *data;
+	uint32_t len;
+};
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+
+static uint16_t cap_u16(const struct capfile *cf, const uint8_t *p) {
+	return cf->swap? p[0] << 8 | p[1]: p[0] | p[1] << 8;
+}
+
+static uint32_t cap_u32(const struct capfile *cf, const uint8_t *p) {
+	if(cf->swap)
+		return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t load_be16(const uint8_t *p) {
+	return p[0] << 8 | p[1];
+}
+
+static uint32_t load_be32(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Make sure at least n bytes are buffered, returns -1 on short read */
+static int cap_need(struct capfile *cf, size_t n) {
+	ssize_t ret;
+
+	if(cf->tail - cf->head >= n)
+		return 0;
+
+	if(cf->head > 0) {
+		memmove(cf->buf, cf->buf + cf->head, cf->tail - cf->head);
+		cf->tail -= cf->head;
+		cf->head = 0;
+	}
+
+	if(n > cf->size) {
+		uint8_t *p;
+
+		if((p = realloc(cf->buf, n)) == NULL)
+			return -1;
+		cf->buf = p;
+		cf->size = n;
+	}
+
+	while(cf->tail < n && !cf->eof) {
+		ret = read(cf->fd, cf->buf + cf->tail, cf->size - cf->tail);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0) {
+			if(ret < 0)
+				fprintf(stderr, "cap: read() failed: %s\n",
+					strerror(errno));
+			cf->eof = 1;
+			break;
+		}
+
+		cf->tail += ret;
+	}
+
+	return cf->tail >= n? 0: -1;
+}
+
+static void cap_close(struct capfile *cf) {
+	if(cf->fd > 0) close(cf->fd);
+	free(cf->buf);
+	cf->buf = NULL;
+}
+
+static int cap_open(struct capfile *cf, const char *path) {
+	uint32_t magic;
+
+	memset(cf, 0, sizeof(*cf));
+	if(!strcmp(path, "-"))
+		cf->fd = fileno(stdin);
+	else if((cf->fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "cap: Failed to open %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(cf->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	cf->size = CAP_BUFSZ;
+	if((cf->buf = malloc(cf->size)) == NULL || cap_need(cf, 24) < 0) {
+		fprintf(stderr, "cap: %s: Short file\n", path);
+		cap_close(cf);
+		return -1;
+	}
+
+	magic = cap_u32(cf, cf->buf);
+	if(magic == PCAPNG_SHB) {
+		/* Byte order is determined when parsing the section header */
+		cf->ng = 1;
+		return 0;
+	}
+
+	if(magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS) {
+		cf->swap = 0;
+	}
+	else {
+		cf->swap = 1;
+		magic = cap_u32(cf, cf->buf);
+		if(magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+			fprintf(stderr, "cap: %s: Not a pcap or pcapng file\n",
+				path);
+			cap_close(cf);
+			return -1;
+		}
+	}
+
+	cf->nifs = 1;
+	cf->ifs[0].snaplen = cap_u32(cf, cf->buf + 16);
+	cf->ifs[0].linktype = cap_u32(cf, cf->buf + 20) & 0xffff;
+	cf->ifs[0].tsresol = magic == PCAP_MAGIC_NS? 9: 6;
+	cf->head += 24;
+
+	return 0;
+}
+
+/* Convert a timestamp in units of if_tsresol to nanoseconds */
+static uint64_t cap_ts_to_ns(uint64_t ts, uint8_t tsresol) {
+	uint64_t scale = 1;
+	unsigned i, v = tsresol & 0x7f;
+
+	if(tsresol & 0x80)
+		return (ts >> v) * 1000000000ULL +
+			(((ts & ((1ULL << v) - 1)) * 1000000000ULL) >> v);
+
+	if(v <= 9) {
+		for(i = v; i < 9; i++) scale *= 10;
+		return ts * scale;
+	}
+
+	for(i = 9; i < v; i++) scale *= 10;
+	return ts / scale;
+}
+
+/* Parse a pcapng interface description block */
+static void cap_ng_idb(struct capfile *cf, const uint8_t *p, uint32_t len) {
+	const uint8_t *opt, *end = p + len - 4;
+	uint16_t code, olen;
+	int i;
+
+	if(cf->nifs == CAP_MAX_IFS) {
+		fprintf(stderr, "cap: Too many interfaces\n");
+		return;
+	}
+
+	i = cf->nifs++;
+	cf->ifs[i].linktype = cap_u16(cf, p + 8);
+	cf->ifs[i].snaplen = cap_u32(cf, p + 12);
+	cf->ifs[i].tsresol = 6;
+	for(opt = p + 16; opt + 4 <= end; opt += 4 + ((olen + 3) & ~3)) {
+		code = cap_u16(cf, opt);
+		olen = cap_u16(cf, opt + 2);
+		if(code == 0)
+			break;
+		if(code == 9 && olen == 1)
+			cf->ifs[i].tsresol = opt[4];
+	}
+}
+
+/**
+ * Return the next captured packet, 0 on success and -1 at end of file.
+ * The packet data is only valid until the next call.
+ */
+static int cap_next(struct capfile *cf, struct cappkt *cp) {
+	const uint8_t *p;
+	uint32_t type, len, ifc, caplen;
+
+	while(!cf->ng) {
+		if(cap_need(cf, 16) < 0)
+			return -1;
+
+		p = cf->buf + cf->head;
+		caplen = cap_u32(cf, p + 8);
+		if(caplen > (1 << 26)) {
+			fprintf(stderr, "cap: Corrupt record length %u\n", caplen);
+			return -1;
+		}
+
+		if(cap_need(cf, 16 + caplen) < 0)
+			return -1;
+
+		p = cf->buf + cf->head;
+		cp->ts = cap_ts_to_ns((uint64_t)cap_u32(cf, p) *
+			(cf->ifs[0].tsresol == 9? 1000000000ULL: 1000000ULL) +
+			cap_u32(cf, p + 4), cf->ifs[0].tsresol);
+		cp->linktype = cf->ifs[0].linktype;
+		cp->data = p + 16;
+		cp->len = caplen;
+		cf->head += 16 + caplen;
+		return 0;
+	}
+
+	for(;;) {
+		if(cap_need(cf, 12) < 0)
+			return -1;
+
+		p = cf->buf + cf->head;
+		type = cap_u32(cf, p);
+		if(type == PCAPNG_SHB) {
+			/* New section, possibly with a different byte order */
+			cf->swap = 0;
+			if(cap_u32(cf, p + 8) != PCAPNG_BOM) cf->swap = 1;
+			if(cap_u32(cf, p + 8) != PCAPNG_BOM) {
+				fprintf(stderr, "cap: Invalid pcapng byte order magic\n");
+				return -1;
+			}
+			cf->nifs = 0;
+		}
+
+		len = cap_u32(cf, p + 4);
+		if(len < 12 || (len & 3) || len > (1 << 26)) {
+			fprintf(stderr, "cap: Corrupt pcapng block length %u\n", len);
+			return -1;
+		}
+
+		if(cap_need(cf, len) < 0)
+			return -1;
+
+		p = cf->buf + cf->head;
+		cf->head += len;
+		switch(type) {
+		case PCAPNG_IDB:
+			if(len >= 20) cap_ng_idb(cf, p, len);
+			break;
+		case PCAPNG_EPB:
+			if(len < 32) break;
+			ifc = cap_u32(cf, p + 8);
+			caplen = cap_u32(cf, p + 20);
+			if(ifc >= cf->nifs || caplen > len - 32) break;
+			cp->ts = cap_ts_to_ns((uint64_t)cap_u32(cf, p + 12) << 32 |
+				cap_u32(cf, p + 16), cf->ifs[ifc].tsresol);
+			cp->linktype = cf->ifs[ifc].linktype;
+			cp->data = p + 28;
+			cp->len = caplen;
+			return 0;
+		case PCAPNG_SPB:
+			if(len < 16 || cf->nifs == 0) break;
+			caplen = cap_u32(cf, p + 8);
+			if(cf->ifs[0].snaplen && caplen > cf->ifs[0].snaplen)
+				caplen = cf->ifs[0].snaplen;
+			if(caplen > len - 16) caplen = len - 16;
+			/* No timestamps in simple packet blocks */
+			cp->ts = 0;
+			cp->linktype = cf->ifs[0].linktype;
+			cp->data = p + 12;
+			cp->len = caplen;
+			return 0;
+		default:
+			break;
+		}
+	}
+}
+
+/* Dig out the TCP segment from a captured packet, if any */
+static int cap_tcp_segment(const struct cappkt *cp, struct tcpseg *seg) {
+	const uint8_t *p = cp->data, *end = cp->data + cp->len;
+	uint16_t proto;
+	unsigned hlen, tlen;
+
+	switch(cp->linktype) {
+	case LINKTYPE_ETHERNET:
+		if(end - p < 14) return -1;
+		proto = load_be16(p + 12);
+		p += 14;
+		while((proto == 0x8100 || proto == 0x88a8) && end - p >= 4) {
+			proto = load_be16(p + 2);
+			p += 4;
+		}
+		break;
+	case LINKTYPE_LINUX_SLL:
+		if(end - p < 16) return -1;
+		proto = load_be16(p + 14);
+		p += 16;
+		break;
+	case LINKTYPE_LINUX_SLL2:
+		if(end - p < 20) return -1;
+		proto = load_be16(p);
+		p += 20;
+		break;
+	case LINKTYPE_NULL:
+		if(end - p < 4) return -1;
+		/* Address family in host byte order of the capturing machine */
+		proto = (p[0] == 2 || p[3] == 2)? 0x0800: 0x86dd;
+		p += 4;
+		break;
+	case LINKTYPE_RAW:
+	case 12: /* LINKTYPE_RAW on OpenBSD */
+	case 14:
+		if(end - p < 1) return -1;
+		proto = (p[0] >> 4) == 4? 0x0800: 0x86dd;
+		break;
+	default:
+		return -1;
+	}
+
+	if(proto == 0x0800) {
+		if(end - p < 20 || (p[0] >> 4) != 4) return -1;
+		hlen = (p[0] & 0x0f) * 4;
+		tlen = load_be16(p + 2);
+		/* Skip non-TCP and non-first fragments */
+		if(p[9] != 6 || (load_be16(p + 6) & 0x1fff)) return -1;
+		if(hlen < 20 || tlen < hlen || end - p < hlen) return -1;
+		if(end - p > tlen) end = p + tlen;
+		seg->alen = 4;
+		memcpy(seg->saddr, p + 12, 4);
+		memcpy(seg->daddr, p + 16, 4);
+		p += hlen;
+	}
+	else if(proto == 0x86dd) {
+		if(end - p < 40 || (p[0] >> 4) != 6 || p[6] != 6) return -1;
+		tlen = load_be16(p + 4);
+		seg->alen = 16;
+		memcpy(seg->saddr, p + 8, 16);
+		memcpy(seg->daddr, p + 24, 16);
+		p += 40;
+		if(end - p > tlen) end = p + tlen;
+	}
+	else {
+		return -1;
+	}
+
+	if(end - p < 20) return -1;
+	hlen = (p[12] >> 4) * 4;
+	if(hlen < 20 || end - p < hlen) return -1;
+	seg->sport = load_be16(p);
+	seg->dport = load_be16(p + 2);
+	seg->seq = load_be32(p + 4);
+	seg->flags = p[13];
+	seg->data = p + hlen;
+	seg->len = end - seg->data;
+
+	return 0;
+}
+
+/**
+ * TCP reassembly
+ *
+ * Each direction of a connection is reassembled into its own framer.
+ * A limited number of out of order segments are held back until the
+ * gap is filled, if it never is (lost in capture) we skip ahead and
+ * let the framer resync.  Connections are forgotten once both sides
+ * sent FIN or either sent RST, and with TCP_MAX_FLOWS open at once the
+ * one that went quiet the longest ago makes room for a new one.
+ */
+#define TCP_OOO_MAX 32
+#define TCP_MAX_FLOWS 64
+
+/* Flow directions */
+#define DIR_TO_SERVER 0
+#define DIR_FROM_SERVER 1
+
+struct tcp_half {
+	int synced;
+	uint32_t next;
+	struct {
+		uint32_t seq, len;
+		uint8_t *data;
+	} ooo[TCP_OOO_MAX];
+	int nooo;
+	unsigned long lost;
+	/* Sent FIN */
+	int fin;
+	struct framer fr;
+};
+
+struct tcp_flow {
+	uint8_t caddr[16], saddr[16];
+	int alen;
+	uint16_t cport;
+	/* ra->clock when last seen, for recycling */
+	uint64_t used;
+	struct tcp_half half[2];
+};
+
+typedef int (*frame_cb)(void *arg, struct tcp_flow *flow, int dir,
+	uint64_t ts, struct pkt *pkt);
+
+struct tcp_reasm {
+	uint16_t server_port;
+	struct tcp_flow *flows[TCP_MAX_FLOWS];
+	int nflows;
+	/* Segments seen, and whether running out of flows was reported */
+	uint64_t clock;
+	int recycling;
+	frame_cb cb;
+	void *arg;
+	/* Frames reach cb without going through filter_packet() */
+	int deferred;
+};
+
+static void tcp_half_reset(struct tcp_half *h) {
+	int i;
+
+	for(i = 0; i < h->nooo; i++) free(h->ooo[i].data);
+	h->nooo = 0;
+	h->synced = h->fin = 0;
+	framer_init(&h->fr);
+}
+
+static struct tcp_flow *tcp_flow_lookup(struct tcp_reasm *ra,
+		const struct tcpseg *seg, int dir) {
+	const uint8_t *caddr, *saddr;
+	uint16_t cport;
+	struct tcp_flow *flow;
+	int i;
+
+	caddr = dir == DIR_TO_SERVER? seg->saddr: seg->daddr;
+	saddr = dir == DIR_TO_SERVER? seg->daddr: seg->saddr;
+	cport = dir == DIR_TO_SERVER? seg->sport: seg->dport;
+	ra->clock++;
+	for(i = 0; i < ra->nflows; i++) {
+		flow = ra->flows[i];
+		if(flow->cport == cport && flow->alen == seg->alen &&
+			!memcmp(flow->caddr, caddr, seg->alen) &&
+			!memcmp(flow->saddr, saddr, seg->alen)) {
+			flow->used = ra->clock;
+			return flow;
+		}
+	}
+
+	/* Nothing to reassemble, i.e the ACK after the FINs */
+	if(seg->len == 0 && !(seg->flags & TCP_SYN))
+		return NULL;
+
+	if(ra->nflows == TCP_MAX_FLOWS) {
+		if(!ra->recycling)
+			fprintf(stderr, "tcp: More than %d connections at a"
+				" time, forgetting the least recently used\n",
+				TCP_MAX_FLOWS);
+		ra->recycling = 1;
+		for(i = 1, flow = ra->flows[0]; i < ra->nflows; i++)
+			if(ra->flows[i]->used < flow->used)
+				flow = ra->flows[i];
+		tcp_half_reset(&flow->half[0]);
+		tcp_half_reset(&flow->half[1]);
+	}
+	else if((flow = calloc(1, sizeof(*flow))) == NULL)
+		return NULL;
+	else {
+		tcp_half_reset(&flow->half[0]);
+		tcp_half_reset(&flow->half[1]);
+		ra->flows[ra->nflows++] = flow;
+	}
+
+	memcpy(flow->caddr, caddr, seg->alen);
+	memcpy(flow->saddr, saddr, seg->alen);
+	flow->alen = seg->alen;
+	flow->cport = cport;
+	flow->used = ra->clock;
+
+	return flow;
+}
+
+/* Push in-order stream data through the framer */
+static int tcp_deliver(struct tcp_reasm *ra, struct tcp_flow *flow, int dir,
+		uint64_t ts, const uint8_t *data, size_t len) {
+	struct tcp_half *h = &flow->half[dir];
+	struct pkt pkt;
+	size_t n;
+
+	h->next += len;
+	h->fr.ts = ts;
+	h->fr.deferred = ra->deferred;
+	while(len > 0) {
+		n = framer_feed(&h->fr, data, len);
+		data += n;
+		len -= n;
+		while(framer_next(&h->fr, &pkt) != NULL)
+			if(ra->cb(ra->arg, flow, dir, ts, &pkt))
+				return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Deliver held back segments that now fit.  With skip set the gap before
+ * the lowest one is given up on to make room, but only that gap.
+ */
+static int tcp_drain(struct tcp_reasm *ra, struct tcp_flow *flow, int dir,
+		uint64_t ts, int skip) {
+	struct tcp_half *h = &flow->half[dir];
+	int32_t d;
+	int i, lo;
+
+	while(h->nooo > 0) {
+		for(i = lo = 0; i < h->nooo; i++)
+			if((int32_t)(h->ooo[i].seq - h->ooo[lo].seq) < 0)
+				lo = i;
+
+		d = (int32_t)(h->ooo[lo].seq - h->next);
+		if(d > 0 && !skip)
+			break;
+		if(d > 0) {
+			h->lost += d;
+			fprintf(stderr, "tcp: Lost %d bytes of stream data\n", d);
+			framer_drop(&h->fr);
+			h->next = h->ooo[lo].seq;
+			d = 0;
+		}
+
+		skip = 0;
+
+		if((uint32_t)-d < h->ooo[lo].len &&
+			tcp_deliver(ra, flow, dir, ts, h->ooo[lo].data - d,
+				h->ooo[lo].len + d) < 0)
+			return -1;
+
+		free(h->ooo[lo].data);
+		h->ooo[lo] = h->ooo[--h->nooo];
+	}
+
+	return 0;
+}
+
+/* Reassemble the len bytes at seq that went in direction dir */
+static int tcp_data(struct tcp_reasm *ra, struct tcp_flow *flow, int dir,
+		uint32_t seq, const uint8_t *data, uint32_t len, uint64_t ts) {
+	struct tcp_half *h = &flow->half[dir];
+	uint8_t *copy;
+	int32_t d;
+	int i, lo;
+
+	if(!h->synced) {
+		/* Capture started mid-stream, the framer will resync */
+		h->synced = 1;
+		h->next = seq;
+	}
+
+	d = (int32_t)(seq - h->next);
+	if(d > 0) {
+		/* Retransmitted while held back, keep the longer copy */
+		for(i = 0; i < h->nooo && h->ooo[i].seq != seq; i++)
+			;
+		if(i < h->nooo && h->ooo[i].len >= len)
+			return 0;
+
+		/* Full, make room unless this one would be delivered first */
+		for(lo = 0; i == h->nooo && h->nooo == TCP_OOO_MAX &&
+			lo < h->nooo; lo++)
+			if((int32_t)(h->ooo[lo].seq - seq) < 0) {
+				if(tcp_drain(ra, flow, dir, ts, 1) < 0)
+					return -1;
+				d = (int32_t)(seq - h->next);
+				i = h->nooo;
+				break;
+			}
+	}
+
+	if(d > 0) {
+		/* Hold on to segments arriving ahead of a gap */
+		if(i < TCP_OOO_MAX) {
+			if((copy = malloc(len)) == NULL)
+				return -1;
+			memcpy(copy, data, len);
+			if(i < h->nooo)
+				free(h->ooo[i].data);
+			else
+				h->nooo++;
+			h->ooo[i].data = copy;
+			h->ooo[i].seq = seq;
+			h->ooo[i].len = len;
+			return 0;
+		}
+
+		/* Give up on the missing data and move past the gap */
+		h->lost += d;
+		fprintf(stderr, "tcp: Lost %d bytes of stream data\n", d);
+		framer_drop(&h->fr);
+		h->next = seq;
+		d = 0;
+	}
+
+	if(d < 0) {
+		/* Retransmission, possibly overlapping new data */
+		if((uint32_t)-d >= len)
+			return 0;
+		data -= d;
+		len += d;
+	}
+
+	if(tcp_deliver(ra, flow, dir, ts, data, len) < 0)
+		return -1;
+
+	return tcp_drain(ra, flow, dir, ts, 0);
+}
+
+/* Deliver what's held back and forget a connection that has ended */
+static int tcp_flow_close(struct tcp_reasm *ra, struct tcp_flow *flow,
+		uint64_t ts) {
+	int dir, i, ret = 0;
+
+	for(dir = 0; dir < 2; dir++)
+		while(ret == 0 && flow->half[dir].nooo > 0)
+			ret = tcp_drain(ra, flow, dir, ts, 1);
+
+	for(i = 0; i < ra->nflows && ra->flows[i] != flow; i++)
+		;
+	ra->flows[i] = ra->flows[--ra->nflows];
+	tcp_half_reset(&flow->half[0]);
+	tcp_half_reset(&flow->half[1]);
+	free(flow);
+	return ret;
+}
+
+static int tcp_segment(struct tcp_reasm *ra, const struct tcpseg *seg,
+		uint64_t ts) {
+	struct tcp_flow *flow;
+	struct tcp_half *h;
+	uint32_t seq = seg->seq;
+	int dir;
+
+	if(seg->dport == ra->server_port)
+		dir = DIR_TO_SERVER;
+	else if(seg->sport == ra->server_port)
+		dir = DIR_FROM_SERVER;
+	else
+		return 0;
+
+	if((flow = tcp_flow_lookup(ra, seg, dir)) == NULL)
+		return 0;
+
+	h = &flow->half[dir];
+	if(seg->flags & TCP_SYN) {
+		/* New connection, possibly reusing the same port */
+		tcp_half_reset(h);
+		h->synced = 1;
+		h->next = seq + 1;
+		seq++;
+	}
+
+	if(seg->len > 0 &&
+		tcp_data(ra, flow, dir, seq, seg->data, seg->len, ts) < 0)
+		return -1;
+
+	if(seg->flags & TCP_FIN)
+		h->fin = 1;
+	if(seg->flags & TCP_RST || (flow->half[0].fin && flow->half[1].fin))
+		return tcp_flow_close(ra, flow, ts);
+
+	return 0;
+}
+
+static void tcp_reasm_init(struct tcp_reasm *ra, uint16_t server_port,
+		frame_cb cb, void *arg) {
+	memset(ra, 0, sizeof(*ra));
+	ra->server_port = server_port;
+	ra->cb = cb;
+	ra->arg = arg;
+}
+
+static void tcp_reasm_free(struct tcp_reasm *ra) {
+	int i;
+
+	for(i = 0; i < ra->nflows; i++) {
+		tcp_half_reset(&ra->flows[i]->half[0]);
+		tcp_half_reset(&ra->flows[i]->half[1]);
+		free(ra->flows[i]);
+	}
+
+	ra->nflows = 0;
+}
+
+/* Run every packet in a capture file through the reassembler */
+static int cap_read_file(const char *path, struct tcp_reasm *ra) {
+	struct capfile cf;
+	struct cappkt cp;
+	struct tcpseg seg;
+	int ret = 0;
+
+	if(cap_open(&cf, path) < 0)
+		return -1;
+
+	while(cap_next(&cf, &cp) == 0) {
+		if(cap_tcp_segment(&cp, &seg) < 0)
+			continue;
+		if((ret = tcp_segment(ra, &seg, cp.ts)) < 0)
+			break;
+	}
+
+	cap_close(&cf);
+	return ret;
+}
+
+/* Whether fp is a pcap or pcapng file rather than hex frames, rewinds it */
+static int cap_sniff(FILE *fp) {
+	uint8_t b[4] = { 0 };
+	uint32_t magic;
+
+	/* Either byte order, the pcapng magic reads the same */
+	magic = fread(b, 1, 4, fp) == 4?
+		(uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3]: 0;
+	rewind(fp);
+	return magic == PCAPNG_SHB || magic == PCAP_MAGIC_US ||
+		magic == PCAP_MAGIC_NS ||
+		__builtin_bswap32(magic) == PCAP_MAGIC_US ||
+		__builtin_bswap32(magic) == PCAP_MAGIC_NS;
+}
+
+/**
+ * Decode frames from an offline capture, frames that fail to decode are
+ * counted (-s) rather than ending the capture
+ */
+static int cap_decode_frame(void *arg, struct tcp_flow *flow, int dir,
+		uint64_t ts, struct pkt *pkt) {
+	decode_packet(pkt);
+	return 0;
+}
+
+/**
+ * Ground station checksum search
+ *
+ * The checksum of the encrypted 0x80/0x81 frames is still unknown and
+ * believed to be some CRC-16 variant.  Given a corpus of captured frames
+ * (one 55bb... hex frame per line) this sweeps every 16-bit polynomial,
+ * and a list of well known 32-bit ones truncated to 16 bits, with and
+ * without input and output reflection, over a range of candidate start
+ * offsets, both over the ciphertext and the decrypted plaintext.
+ *
+ * Rather than trying every init and xorout value one by one we make use
+ * of CRCs being affine: crc(init, msg) = crc(0, msg) ^ Z(len) * init,
+ * where Z(len) is the effect of the init register after len bytes.  For
+ * each frame k that gives d_k = cksum_k ^ crc(0, msg_k) = Z(len_k) * init
+ * ^ xorout, and subtracting the first frame leaves a linear system in
+ * init over GF(2) which is solved with Gaussian elimination.  With three
+ * or more frames a wrong candidate is all but guaranteed to turn up an
+ * inconsistency, so the whole init and xorout space is covered for the
+ * cost of a few table-driven CRC computations per candidate.
+ *
+ * The work is spread across threads and stops as soon as a candidate
+ * matching every frame is found.
+ *
+ * Where the checksum lives is a guess:
+ * 0x81: the two bytes before the footer, as printed by gs_decrypt_packet()
+ * 0x80: the last two bytes of ground station data (not encrypted)
+ */
+#define CRC_MAX_FRAMES 256
+#define CRC_MAX_STARTS 24
+#define CRC_CHUNK 64
+
+/* End of the checksummed range: at the checksum or after the last block */
+#define CRC_END_FIELD 0
+#define CRC_END_BLOCKS 1
+
+struct crc_frame {
+	uint8_t raw[256], plain[256];
+	/* Frame length, offset of encrypted data and checksum field */
+	uint8_t len, enc, field;
+	/* Range end offsets, see CRC_END_* */
+	uint8_t end[2];
+};
+
+struct crc_corpus {
+	uint8_t cmd;
+	struct crc_frame f[CRC_MAX_FRAMES];
+	int n;
+	uint8_t starts[CRC_MAX_STARTS];
+	int nstarts, nends;
+	/* Index of the first frame with the same range length, per end */
+	int same[2][CRC_MAX_FRAMES];
+	int maxlen;
+};
+
+struct crc_model {
+	int width;
+	uint32_t poly, init, xorout;
+	int refin, refout;
+	/* Plaintext or ciphertext, range, checksum byte order */
+	int plain, start, end, bigendian;
+	/* For 32-bit CRCs, which half is used as checksum */
+	int high;
+	/* Number of init bits left undetermined by the corpus */
+	int freebits;
+};
+
+static const uint32_t crc32_polys[] = {
+	0x04c11db7, 0x1edc6f41, 0x741b8cd7, 0x814141ab,
+	0xa833982b, 0x32583499, 0x000000af, 0xf4acfb13,
+};
+
+#define CRC_NPOLYS (65536 + sizeof(crc32_polys) / sizeof(crc32_polys[0]))
+
+struct crc_search {
+	const struct crc_corpus *corpus;
+	uint32_t next;
+	int found;
+	pthread_mutex_t lock;
+	struct crc_model result;
+};
+
+static uint8_t crc_rev8[256];
+
+static uint32_t crc_reflect(uint32_t v, int width) {
+	v = (uint32_t)crc_rev8[v & 0xff] << 24 | crc_rev8[v >> 8 & 0xff] << 16 |
+		crc_rev8[v >> 16 & 0xff] << 8 | crc_rev8[v >> 24];
+	return v >> (32 - width);
+}
+
+static void crc_make_table(uint32_t *tab, int width, uint32_t poly, int refin) {
+	uint32_t c, top = 1U << (width - 1);
+	uint32_t mask = width == 32? 0xffffffff: (1U << width) - 1;
+	int i, j;
+
+	if(refin) poly = crc_reflect(poly, width);
+	for(i = 0; i < 256; i++) {
+		if(refin) {
+			for(c = i, j = 0; j < 8; j++)
+				c = c & 1? c >> 1 ^ poly: c >> 1;
+		}
+		else {
+			for(c = i << (width - 8), j = 0; j < 8; j++)
+				c = c & top? c << 1 ^ poly: c << 1;
+		}
+
+		tab[i] = c & mask;
+	}
+}
+
+/* Table-driven CRC register update, no init/xorout/refout processing */
+static uint32_t crc_update(const uint32_t *tab, int width, int refin,
+		uint32_t reg, const uint8_t *p, size_t n) {
+	uint32_t mask = width == 32? 0xffffffff: (1U << width) - 1;
+
+	if(refin) {
+		while(n--) reg = tab[(reg ^ *p++) & 0xff] ^ reg >> 8;
+		return reg;
+	}
+
+	while(n--) reg = (tab[(reg >> (width - 8) ^ *p++) & 0xff] ^ reg << 8) & mask;
+	return reg;
+}
+
+/* Turn a CRC register into the 16-bit value compared with the checksum */
+static uint16_t crc_output(const struct crc_model *m, uint32_t reg) {
+	if(m->refin != m->refout) reg = crc_reflect(reg, m->width);
+	if(m->width == 32 && m->high) reg >>= 16;
+	return reg & 0xffff;
+}
+
+static uint16_t crc_field(const struct crc_model *m, const struct crc_frame *f) {
+	const uint8_t *p = (m->plain? f->plain: f->raw) + f->field;
+
+	return m->bigendian? p[0] << 8 | p[1]: p[0] | p[1] << 8;
+}
+
+/* Compute the checksum of a frame with a complete model */
+static uint16_t crc_compute(const struct crc_model *m, const struct crc_frame *f) {
+	uint32_t tab[256], reg;
+	const uint8_t *p = (m->plain? f->plain: f->raw) + m->start;
+
+	crc_make_table(tab, m->width, m->poly, m->refin);
+	reg = m->refin? crc_reflect(m->init, m->width): m->init;
+	reg = crc_update(tab, m->width, m->refin, reg, p, f->end[m->end] - m->start);
+	return crc_output(m, reg) ^ m->xorout;
+}
+
+/**
+ * Add an equation to a GF(2) system kept in reduced row echelon form.
+ * Coefficients are in the low 32 bits, the right hand side in bit 32.
+ * Returns -1 if the system became inconsistent.
+ */
+static int gf2_add(uint64_t *rows, int *pivots, int *n, uint64_t row) {
+	int i, pivot;
+
+	for(i = 0; i < *n; i++)
+		if(row >> pivots[i] & 1) row ^= rows[i];
+
+	if((row & 0xffffffff) == 0)
+		return row? -1: 0;
+
+	pivot = __builtin_ctzll(row);
+	for(i = 0; i < *n; i++)
+		if(rows[i] >> pivot & 1) rows[i] ^= row;
+
+	rows[*n] = row;
+	pivots[(*n)++] = pivot;
+	return 0;
+}
+
+/**
+ * Try to solve for init and xorout given the init-less CRC registers
+ * of every frame.  Fills in the model and returns 0 on success.
+ */
+static int crc_solve(const struct crc_corpus *c, struct crc_model *m,
+		const uint32_t *zreg, const uint32_t *reg) {
+	uint64_t rows[32];
+	uint32_t z0[32], x;
+	uint16_t d[CRC_MAX_FRAMES], col;
+	int pivots[32], n = 0, i, j, k, l0, lk;
+
+	for(k = 0; k < c->n; k++) {
+		d[k] = crc_field(m, &c->f[k]) ^ crc_output(m, reg[k]);
+		/* Frames with ranges of the same length must agree right away */
+		if(c->same[m->end][k] != k && d[k] != d[c->same[m->end][k]])
+			return -1;
+	}
+
+	l0 = c->f[0].end[m->end] - m->start;
+	for(j = 0; j < m->width; j++)
+		z0[j] = crc_output(m, zreg[l0 * 32 + j]);
+
+	for(k = 1; k < c->n; k++) {
+		uint64_t eq[16] = { 0 };
+
+		if(c->same[m->end][k] != k)
+			continue;
+
+		lk = c->f[k].end[m->end] - m->start;
+		for(j = 0; j < m->width; j++) {
+			col = crc_output(m, zreg[lk * 32 + j]) ^ z0[j];
+			for(i = 0; i < 16; i++)
+				eq[i] |= (uint64_t)(col >> i & 1) << j;
+		}
+
+		for(i = 0; i < 16; i++) {
+			eq[i] |= (uint64_t)((d[k] ^ d[0]) >> i & 1) << 32;
+			if(gf2_add(rows, pivots, &n, eq[i]) < 0)
+				return -1;
+		}
+	}
+
+	/* Undetermined bits are left as zero */
+	for(m->init = i = 0; i < n; i++)
+		if(rows[i] >> 32 & 1) m->init |= 1U << pivots[i];
+
+	for(x = j = 0; j < m->width; j++)
+		if(m->init >> j & 1) x ^= z0[j];
+	m->xorout = d[0] ^ x;
+	m->freebits = m->width - n;
+
+	/* Double check with the complete model */
+	for(k = 0; k < c->n; k++)
+		if(crc_compute(m, &c->f[k]) != crc_field(m, &c->f[k]))
+			return -1;
+
+	return 0;
+}
+
+static int crc_try_poly(struct crc_search *cs, int width, uint32_t poly,
+		uint32_t *zreg) {
+	const struct crc_corpus *c = cs->corpus;
+	const struct crc_frame *f;
+	struct crc_model m;
+	uint32_t tab[256], reg[CRC_MAX_FRAMES], r, mask;
+	int s, k, j, l, v;
+
+	mask = width == 32? 0xffffffff: (1U << width) - 1;
+	memset(&m, 0, sizeof(m));
+	m.width = width;
+	m.poly = poly;
+	for(m.refin = 0; m.refin < 2; m.refin++) {
+		crc_make_table(tab, width, poly, m.refin);
+
+		/* Effect of each init bit after 0..maxlen bytes */
+		for(j = 0; j < width; j++) {
+			r = m.refin? 1U << (width - 1 - j): 1U << j;
+			for(l = 0; l <= c->maxlen; l++) {
+				zreg[l * 32 + j] = r;
+				if(m.refin) r = tab[r & 0xff] ^ r >> 8;
+				else r = (tab[r >> (width - 8) & 0xff] ^ r << 8) & mask;
+			}
+		}
+
+		for(m.plain = 0; m.plain < 2; m.plain++)
+		for(s = 0; s < c->nstarts; s++)
+		for(m.end = 0; m.end < c->nends; m.end++) {
+			m.start = c->starts[s];
+			for(k = 0; k < c->n; k++) {
+				f = &c->f[k];
+				reg[k] = crc_update(tab, width, m.refin, 0,
+					(m.plain? f->plain: f->raw) + m.start,
+					f->end[m.end] - m.start);
+			}
+
+			for(m.refout = 0; m.refout < 2; m.refout++)
+			for(v = 0; v < (width == 32? 4: 2); v++) {
+				m.bigendian = v & 1;
+				m.high = v >> 1;
+				if(crc_solve(c, &m, zreg, reg) < 0)
+					continue;
+
+				pthread_mutex_lock(&cs->lock);
+				if(!cs->found) cs->result = m;
+				cs->found = 1;
+				pthread_mutex_unlock(&cs->lock);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void *crc_search_worker(void *arg) {
+	struct crc_search *cs = arg;
+	uint32_t i, idx, *zreg;
+
+	if((zreg = malloc(256 * 32 * sizeof(*zreg))) == NULL)
+		return NULL;
+
+	while(!__atomic_load_n(&cs->found, __ATOMIC_RELAXED)) {
+		idx = __atomic_fetch_add(&cs->next, CRC_CHUNK, __ATOMIC_RELAXED);
+		if(idx >= CRC_NPOLYS)
+			break;
+
+		if(idx % 4096 == 0)
+			fprintf(stderr, "\rcrc: %3u%% searched", idx * 100 / (uint32_t)CRC_NPOLYS);
+
+		for(i = idx; i < idx + CRC_CHUNK && i < CRC_NPOLYS; i++) {
+			if(i < 65536 && crc_try_poly(cs, 16, i, zreg))
+				break;
+			if(i >= 65536 && crc_try_poly(cs, 32, crc32_polys[i - 65536], zreg))
+				break;
+			if(__atomic_load_n(&cs->found, __ATOMIC_RELAXED))
+				break;
+		}
+	}
+
+	free(zreg);
+	return NULL;
+}
+
+/* Set up checksum field and candidate ranges for a ground station frame */
+static int crc_add_frame(struct crc_corpus *c, const uint8_t *raw, int len) {
+	struct crc_frame *f = &c->f[c->n];
+	int gslen, enclen, i;
+
+	if(len < 9 || raw[2] != len || (raw[6] != 0x80 && raw[6] != 0x81))
+		return -1;
+
+	memcpy(f->raw, raw, len);
+	f->len = len;
+	if(raw[6] == 0x81) {
+		/* 0x81 00 LL LL <data> <cksum> <footer> */
+		f->enc = 10;
+		gslen = (raw[8] | raw[9] << 8) - 2;
+		enclen = gslen - 4;
+	}
+	else {
+		/* 0x80 LL LL <data> <cksum> */
+		f->enc = 9;
+		gslen = (raw[7] | raw[8] << 8) - 2;
+		enclen = gslen - 2;
+	}
+
+	if(enclen < 8 || f->enc + gslen != len - 1)
+		return -1;
+
+	f->field = f->enc + enclen;
+	f->end[CRC_END_FIELD] = f->field;
+	f->end[CRC_END_BLOCKS] = f->enc + enclen / 4 * 4;
+
+	/* Decrypted later on, see crc_decrypt_corpus() */
+	memcpy(f->plain, raw, len);
+	for(i = 0; i < 2; i++)
+		if(f->end[i] > c->maxlen) c->maxlen = f->end[i];
+
+	c->n++;
+	return 0;
+}
+
+/* Decrypt the corpus in batches of frames with the same number of blocks */
+static int crc_decrypt_corpus(struct crc_corpus *c) {
+	struct crc_frame *f;
+	uint32_t *blocks;
+	int words, k, cnt;
+
+	if((blocks = malloc(CRC_MAX_FRAMES * BTEA_MAX_WORDS * 4)) == NULL)
+		return -1;
+
+	for(words = 2; words <= BTEA_MAX_WORDS; words++) {
+		for(cnt = k = 0; k < c->n; k++) {
+			f = &c->f[k];
+			if((f->field - f->enc) / 4 == words)
+				memcpy(blocks + cnt++ * words, f->raw + f->enc, words * 4);
+		}
+
+		if(cnt == 0)
+			continue;
+
+		btea_multi(blocks, -words, cnt, gs_key);
+		for(cnt = k = 0; k < c->n; k++) {
+			f = &c->f[k];
+			if((f->field - f->enc) / 4 == words)
+				memcpy(f->plain + f->enc, blocks + cnt++ * words, words * 4);
+		}
+	}
+
+	free(blocks);
+	return 0;
+}
+
+/* Search for the ground station checksum using frames from a hex file */
+static int crc_search(const char *path, int nthreads) {
+	static struct crc_corpus corpus[2];
+	struct crc_corpus *c;
+	struct crc_search cs;
+	struct crc_model *m = &cs.result;
+	pthread_t tid[64];
+	uint8_t raw[256];
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t n;
+	FILE *fp;
+	int i, k, j, ret = -1;
+
+	if((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "crc: Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	for(i = 0; i < 256; i++)
+		for(crc_rev8[i] = j = 0; j < 8; j++)
+			crc_rev8[i] |= (i >> j & 1) << (7 - j);
+
+	corpus[0].cmd = 0x80;
+	corpus[1].cmd = 0x81;
+	while((n = getline(&line, &size, fp)) > 0) {
+		while(n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) n--;
+		if(n < 18 || n > 2 * 255 || strncmp(line, "55bb", 4) ||
+			hex_decode(raw, line, n / 2) < 0)
+			continue;
+
+		c = &corpus[raw[6] & 1];
+		if(c->n == CRC_MAX_FRAMES) continue;
+		if(crc_add_frame(c, raw, n / 2) < 0)
+			fprintf(stderr, "crc: Skipping bad frame %.*s\n", (int)n, line);
+	}
+
+	free(line);
+	fclose(fp);
+
+	if(nthreads < 1) nthreads = 1;
+	if(nthreads > 64) nthreads = 64;
+	for(i = 0; i < 2; i++) {
+		c = &corpus[i];
+		if(c->n == 0)
+			continue;
+		if(c->n < 3) {
+			fprintf(stderr, "crc: Need at least 3 frames with cmd 0x%02x,"
+				" got %d\n", c->cmd, c->n);
+			continue;
+		}
+
+		if(crc_decrypt_corpus(c) < 0)
+			return -1;
+
+		/* Start anywhere from the magic to just past the GS command */
+		for(c->nstarts = 0; c->nstarts < CRC_MAX_STARTS &&
+			c->nstarts <= c->f[0].enc + 5; c->nstarts++)
+			c->starts[c->nstarts] = c->nstarts;
+
+		c->nends = 2;
+		for(j = 0; j < c->nends; j++)
+			for(k = 0; k < c->n; k++) {
+				int l;
+
+				for(l = 0; l < k && c->f[l].end[j] != c->f[k].end[j]; l++);
+				c->same[j][k] = l;
+			}
+
+		fprintf(stderr, "crc: Searching %d frames with cmd 0x%02x using"
+			" %d threads\n", c->n, c->cmd, nthreads);
+
+		memset(&cs, 0, sizeof(cs));
+		cs.corpus = c;
+		pthread_mutex_init(&cs.lock, NULL);
+		for(k = 0; k < nthreads; k++)
+			if(pthread_create(&tid[k], NULL, crc_search_worker, &cs))
+				break;
+		for(j = 0; j < k; j++)
+			pthread_join(tid[j], NULL);
+		pthread_mutex_destroy(&cs.lock);
+		fprintf(stderr, "\n");
+
+		if(!cs.found) {
+			printf("[0x%02x] CRC: No matching checksum found\n", c->cmd);
+			continue;
+		}
+
+		printf("[0x%02x] CRC: Match width %d%s poly 0x%0*x init 0x%0*x"
+			" refin %d refout %d xorout 0x%04x over %s bytes %d..%s,"
+			" %s endian checksum\n", c->cmd, m->width,
+			m->width == 32? (m->high? " (high half)": " (low half)"): "",
+			m->width / 4, m->poly, m->width / 4, m->init, m->refin,
+			m->refout, m->xorout, m->plain? "plaintext": "ciphertext",
+			m->start, m->end == CRC_END_FIELD? "checksum": "last block",
+			m->bigendian? "big": "little");
+		if(m->freebits)
+			printf("[0x%02x] CRC: %d init bits are not determined by the"
+				" corpus, add frames of other lengths\n", c->cmd,
+				m->freebits);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/* For debugging purposes */
+static int read_console(FILE *source, struct link *ln) {
+	char buf[256];
+	static uint8_t data, rec = 0;
+	static int cmd = 0x0100;
+	static int port = 0x08;
+
+	if(fgets(buf, sizeof(buf), source) == NULL)
+		return 0;
+
+	switch(buf[0]) {
+	/* Port and command debugging */
+	case '\n':
+		printf("** Requesting 0x%02x00 at port 0x%02x\n", cmd, port);
+		data = 0;
+		if(link_request(ln, port, cmd, &data, 1) < 0) return -1;
+		cmd++;
+		break;
+	case '8': port = 0x08; cmd = 0x01; break;
+	case 'A': port = 0x0a; cmd = 0x01; break;
+	case 'B': port = 0x0b; cmd = 0x01; break;
+
+	/* Shortcuts */
+	case 'C':
+		printf("** Calibrating compass (0x9001)\n");
+		data = 0x01;
+		if(link_request(ln, 0x0a, 0x90, &data, 1) < 0) return -1;
+		break;
+	case 'c':
+		printf("** Taking picture\n");
+		data = 0x01;
+		if(link_request(ln, 0x08, 0x01, &data, 1) < 0) return -1;
+		break;
+	case 'b':
+		printf("** Sending command 0x1b00\n");
+		data = 0x00;
+		if(link_request(ln, 0x0a, 0x1b, &data, 1) < 0) return -1;
+		break;
+	case 'd':
+		printf("** Sending command 0x2d00\n");
+		data = 0x00;
+		if(link_request(ln, 0x0a, 0x2d, &data, 1) < 0) return -1;
+		break;
+	case 'r':
+		rec ^= 1;
+		printf("** %s recording\n",
+			rec? "Starting": "Stopping");
+		if(link_request(ln, 0x08, 0x02, &rec, 1) < 0)
+			return -1;
+		break;
+	case '5':
+		printf("** Sending command 0x2500\n");
+		data = 0x00;
+		if(link_request(ln, 0x0b, 0x25, &data, 1) < 0) return -1;
+		break;
+	case '0':
+		printf("*** Sending command 0x4000\n");
+		data = 0x00;
+		if(link_request(ln, 0x08, 0x40, &data, 1) < 0) return -1;
+		break;
+	case '4':
+		printf("*** Sending command 0x4400\n");
+		data = 0x00;
+		if(link_request(ln, 0x08, 0x44, &data, 1) < 0) return -1;
+		break;
+	case 'p':
+		printf("*** Sending command 0x32 (current position)\n");
+		data = 0x00;
+		if(link_request(ln, 0x08, 0x32, &data, 1) < 0) return -1;
+		break;
+	case 'g':
+		printf("*** Sending command 0x4900 (GPS telemetry)\n");
+		data = 0x00;
+		if(link_request(ln, 0x0a, 0x49, &data, 1) < 0) return -1;
+		break;
+	case 'f':
+		printf("*** Sending command 0x5200 (flight mode)\n");
+		data = 0x00;
+		if(link_request(ln, 0x0a, 0x52, &data, 1) < 0) return -1;
+		break;
+	case '3':
+		printf("*** Sending command 0x5300\n");
+		data = 0x00;
+		if(link_request(ln, 0x0a, 0x53, &data, 1) < 0) return -1;
+		break;
+	case 'M':
+		if(ln->mission.n == 0) {
+			printf("** No mission to upload, see -m\n");
+			break;
+		}
+		printf("** Uploading mission (%d waypoints)\n", ln->mission.n);
+		ln->mission.acked = ln->mission.nacked = 0;
+		ln->mission.started = 0;
+		if(mission_upload(ln) < 0) return -1;
+		break;
+	case 'S':
+		decoder_stats(stdout);
+		req_stats(&ln->req, stdout);
+		poll_stats(&ln->polls, stdout);
+		mission_stats(&ln->mission, stdout);
+		state_print(out_session, stdout);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * Event loop
+ *
+ * Sockets, the console and timers are separate event sources watched
+ * with epoll.  Timers are timerfds armed with a fixed period on the
+ * monotonic clock, so their schedule doesn't depend on how busy any
+ * other source is and doesn't drift; a timer that couldn't be serviced
+ * in time is called once with the number of missed periods recorded.
+ *
+ * Output is flushed between batches of events, see sink_tick().
+ */
+#define EVLOOP_MAX_EVENTS 32
+
+struct evsrc {
+	struct evloop *loop;
+	int fd, timer;
+	/* Timer period in nanoseconds, zero for one-shot timers */
+	uint64_t interval;
+	/* Timer periods that passed without a callback */
+	uint64_t missed;
+	/* Returning non-zero stops the loop */
+	int (*cb)(struct evsrc *src, uint32_t events);
+	void *arg;
+};
+
+struct evloop {
+	int epfd;
+	/* Events being dispatched by evloop_run(), see evloop_del() */
+	struct epoll_event *ev;
+	int cur, n;
+};
+
+/* These return -1 with errno set on failure */
+static int evloop_init(struct evloop *loop) {
+	loop->ev = NULL;
+	loop->cur = loop->n = 0;
+	return (loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0? -1: 0;
+}
+
+static void evloop_free(struct evloop *loop) {
+	close(loop->epfd);
+}
+
+static int evloop_add(struct evloop *loop, struct evsrc *src, int fd,
+		uint32_t events, int (*cb)(struct evsrc *, uint32_t), void *arg) {
+	struct epoll_event ev;
+
+	src->loop = loop;
+	src->fd = fd;
+	src->timer = 0;
+	src->interval = src->missed = 0;
+	src->cb = cb;
+	src->arg = arg;
+	ev.events = events;
+	ev.data.ptr = src;
+	return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int evloop_mod(struct evsrc *src, uint32_t events) {
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = src;
+	return epoll_ctl(src->loop->epfd, EPOLL_CTL_MOD, src->fd, &ev);
+}
+
+/**
+ * Events of src still waiting in the batch being dispatched are dropped,
+ * so a callback may delete, and free, any source, its own or another.
+ */
+static void evloop_del(struct evsrc *src) {
+	struct evloop *loop = src->loop;
+	int i;
+
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+	if(src->timer)
+		close(src->fd);
+	src->fd = -1;
+	for(i = loop->cur + 1; i < loop->n; i++)
+		if(loop->ev[i].data.ptr == src)
+			loop->ev[i].data.ptr = NULL;
+}
+
+/* Call cb every interval nanoseconds, starting one interval from now */
+static int evloop_timer(struct evloop *loop, struct evsrc *src,
+		uint64_t interval, int (*cb)(struct evsrc *, uint32_t), void *arg) {
+	struct itimerspec its;
+	int fd;
+
+	if((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0)
+		return -1;
+
+	its.it_interval.tv_sec = interval / 1000000000;
+	its.it_interval.tv_nsec = interval % 1000000000;
+	its.it_value = its.it_interval;
+	if(timerfd_settime(fd, 0, &its, NULL) < 0 ||
+		evloop_add(loop, src, fd, EPOLLIN, cb, arg) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	src->timer = 1;
+	src->interval = interval;
+	return 0;
+}
+
+/* Set up a timer that does nothing until armed with evloop_arm() */
+static int evloop_oneshot(struct evloop *loop, struct evsrc *src,
+		int (*cb)(struct evsrc *, uint32_t), void *arg) {
+	int fd;
+
+	if((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0)
+		return -1;
+
+	if(evloop_add(loop, src, fd, EPOLLIN, cb, arg) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	src->timer = 1;
+	return 0;
+}
+
+/* Fire a one-shot timer at an absolute time on the monotonic clock */
+static int evloop_arm(struct evsrc *src, uint64_t when) {
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = when / 1000000000;
+	its.it_value.tv_nsec = when % 1000000000;
+	/* Zero would disarm it */
+	if(when == 0)
+		its.it_value.tv_nsec = 1;
+	return timerfd_settime(src->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Milliseconds until buffered output is due, -1 if there's none */
+static int sink_timeout(const struct sink *s, uint64_t now) {
+	if(s->len == 0)
+		return -1;
+	if(now - s->last >= s->interval)
+		return 0;
+
+	return (s->interval - (now - s->last) + 999999) / 1000000;
+}
+
+/* Dispatch events until a callback returns non-zero, which is returned */
+static int evloop_run(struct evloop *loop) {
+	struct epoll_event ev[EVLOOP_MAX_EVENTS];
+	struct evsrc *src;
+	uint64_t expired;
+	int i, n, ret;
+
+	for(;;) {
+		sink_tick(out, time_now_ns());
+		n = epoll_wait(loop->epfd, ev, EVLOOP_MAX_EVENTS,
+			sink_timeout(out, time_now_ns()));
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "ERROR: epoll_wait() failed: %s\n",
+				strerror(errno));
+			return -1;
+		}
+
+		loop->ev = ev;
+		loop->n = n;
+		for(i = 0; i < n; i++) {
+			loop->cur = i;
+			if((src = ev[i].data.ptr) == NULL)
+				continue;
+			if(src->timer) {
+				if(read(src->fd, &expired, sizeof(expired)) != sizeof(expired))
+					continue;
+				src->missed += expired - 1;
+			}
+
+			if((ret = src->cb(src, ev[i].events)) != 0)
+				break;
+		}
+
+		loop->n = 0;
+		if(i < n)
+			return ret;
+	}
+}
+
+/**
+ * Sessions
+ *
+ * A session is one aircraft: a ser2net endpoint and the link to it with
+ * its own framer, sequence numbers, requests and poll schedule.  Sessions
+ * are listed in a config file (-c), one per line:
+ *
+ * # name  address[:port]  [polls, as for -p]
+ * alpha   192.168.1.1     49=20,53=1,52=5
+ * bravo   10.0.1.1:2001   49=5
+ *
+ * and are spread across worker threads (-j), each running an event loop
+ * of its own, so sessions never share anything but the output.  Records
+ * are tagged with the name of their session.  A session that loses its
+ * connection, or can't connect in the first place, is retried every few
+ * seconds.  Nothing a session does blocks its thread: addresses are
+ * looked up when sessions are set up, connects finish in the event loop
+ * and frames that don't fit in the socket wait in the link.  Without a
+ * config file there's a single untagged session to 192.168.1.1:2001 in
+ * the main thread, together with the console.
+ */
+#define MAX_SESSIONS 255
+/* How often the link is polled to keep the aircraft from returning home */
+#define KEEPALIVE_INTERVAL_MS 1500
+#define RECONNECT_INTERVAL_MS 5000
+
+struct session {
+	/* Numbered from 1 in config file order, 0 when there's just one */
+	int id;
+	char name[32], host[64], port[8];
+	struct peer peer;
+	struct link *ln;
+	/* Uploaded on every connect until acknowledged, or NULL */
+	const struct mission *mission;
+	struct evsrc link_src, keepalive_src, timeout_src, poll_src;
+	struct evsrc reconnect_src;
+	/* link_src is waiting for a connect to finish */
+	int connecting;
+	unsigned long connects;
+};
+
+struct worker {
+	pthread_t thread;
+	struct evloop loop;
+	/* Written to when it's time to stop */
+	int stopfd;
+	struct evsrc stop_src;
+	struct session **sess;
+	int nsess;
+	/* Each worker buffers its own output */
+	struct sink *sink;
+};
+
+static void session_down(struct session *s) {
+	struct link *ln = s->ln;
+
+	if(ln->fd < 0)
+		return;
+
+	fprintf(stderr, "session %s: Lost connection to %s:%s\n", s->name,
+		s->host, s->port);
+	evloop_del(&s->link_src);
+	close(ln->fd);
+	ln->fd = -1;
+	ln->txlen = ln->waiting = 0;
+	evloop_arm(&s->reconnect_src,
+		time_mono_ns() + RECONNECT_INTERVAL_MS * 1000000ull);
+}
+
+/* Event source callbacks for a session, these never stop the loop */
+static int session_readable(struct evsrc *src, uint32_t events) {
+	struct session *s = src->arg;
+	struct link *ln = s->ln;
+	struct pkt pkt;
+
+	out_session = s->id;
+	if(events & EPOLLOUT && link_flush(ln) < 0) {
+		session_down(s);
+		return 0;
+	}
+	if(!(events & (EPOLLIN|EPOLLHUP|EPOLLERR)))
+		return 0;
+
+	if(framer_fill(&ln->rx, ln->fd) <= 0) {
+		session_down(s);
+		return 0;
+	}
+
+	while(framer_next(&ln->rx, &pkt) != NULL) {
+		flog_frame(&pkt, FLOG_RX);
+		if(pkt.cmd == 0x81)
+			mission_feedback(ln, &pkt);
+		if(req_reply(ln, &pkt) == 0)
+			decode_packet(&pkt);
+	}
+
+	return 0;
+}
+
+/* Wait for room in the socket while the link has frames queued */
+static void session_wait_out(struct link *ln, int wait) {
+	struct session *s = ln->arg;
+
+	evloop_mod(&s->link_src, EPOLLIN | (wait? EPOLLOUT: 0));
+}
+
+static int session_keepalive(struct evsrc *src, uint32_t events) {
+	struct session *s = src->arg;
+
+	if(src->missed) {
+		fprintf(stderr, "session %s: Keepalive %llu polls late\n",
+			s->name, (unsigned long long)src->missed);
+		src->missed = 0;
+	}
+
+	if(s->ln->fd < 0)
+		return 0;
+
+	/**
+	 * Send something to prevent link from being closed, unless it's
+	 * already on its way: piling up duplicates behind a slow aircraft
+	 * would only fill the queue
+	 */
+	out_session = s->id;
+	if((s->ln->req.pending[0x49] == 0 &&
+		link_request(s->ln, 0x0a, 0x49, (uint8_t *)"", 1) < 0) ||
+		(s->ln->req.pending[0x53] == 0 &&
+		link_request(s->ln, 0x0a, 0x53, (uint8_t *)"", 1) < 0))
+		session_down(s);
+
+	return 0;
+}
+
+static int session_timeouts(struct evsrc *src, uint32_t events) {
+	struct session *s = src->arg;
+
+	out_session = s->id;
+	if(s->ln->fd >= 0 && req_expire(s->ln, time_mono_ns()) < 0)
+		session_down(s);
+
+	return 0;
+}
+
+static int session_poll(struct evsrc *src, uint32_t events) {
+	struct session *s = src->arg;
+	uint64_t next;
+
+	if(s->ln->fd < 0)
+		return 0;
+
+	out_session = s->id;
+	if((next = poll_run(s->ln, time_mono_ns())) == UINT64_MAX)
+		session_down(s);
+	else if(next)
+		evloop_arm(src, next);
+
+	return 0;
+}
+
+/* Say hello once connected */
+static int session_start(struct session *s) {
+	struct link *ln = s->ln;
+
+	out_session = s->id;
+	if(s->id)
+		text_printf("%s: ", s->name);
+	text_printf("* Connected\n");
+	s->connects++;
+	framer_init(&ln->rx);
+	req_reset(&ln->req);
+	ln->corked = ln->txlen = ln->waiting = 0;
+
+	/**
+	 * Not really sure what this does but the DJI Vision app sends
+	 * it on startup and I'm guessing it's either a "ping" or some
+	 * kind of synchronization message.
+	 */
+	if(link_request(ln, 0x08, 0x04, (uint8_t *)"\x01", 1) < 0)
+		goto fail;
+
+ 	/**
+	 * The camera needs to be initialized with the current time before
+	 * a bunch of other commands start to work:
+	 * - 0x0101 (port 0x08) - take picture
+	 * - 0x2001 (port 0x08) - start recording
+	 * - 0x0200 (port 0x08) - stop recording
+	 *
+	 * If this command is not sent, a response with the following bytes
+	 * will be returned: 55 bb 09 48 03 00 e5 ff 48
+	 */
+	if(init_camera_time_bcd(ln) < 0)
+		goto fail;
+
+	if(ln->mission.nacked < ln->mission.n && mission_upload(ln) < 0)
+		goto fail;
+
+	if(ln->polls.n > 0) {
+		poll_start(&ln->polls, time_mono_ns());
+		evloop_arm(&s->poll_src, ln->polls.p[0].due);
+	}
+
+	return 0;
+
+fail:
+	session_down(s);
+	return -1;
+}
+
+static int session_connected(struct evsrc *src, uint32_t events) {
+	struct session *s = src->arg;
+	int fd = src->fd;
+
+	s->connecting = 0;
+	if(!peer_connected(fd)) {
+		fprintf(stderr, "session %s: Failed to connect to %s:%s: %s\n",
+			s->name, s->host, s->port, strerror(errno));
+		evloop_del(src);
+		close(fd);
+		return 0;
+	}
+
+	s->ln->fd = fd;
+	src->cb = session_readable;
+	if(evloop_mod(src, EPOLLIN) < 0) {
+		session_down(s);
+		return 0;
+	}
+
+	session_start(s);
+	return 0;
+}
+
+/**
+ * Start connecting, session_connected() takes it from there.  The retry
+ * timer doubles as the connect timeout.
+ */
+static int session_up(struct session *s) {
+	int fd;
+
+	if(s->connecting) {
+		fprintf(stderr, "session %s: Timed out connecting to %s:%s\n",
+			s->name, s->host, s->port);
+		fd = s->link_src.fd;
+		evloop_del(&s->link_src);
+		close(fd);
+		s->connecting = 0;
+	}
+
+	evloop_arm(&s->reconnect_src,
+		time_mono_ns() + RECONNECT_INTERVAL_MS * 1000000ull);
+	if((fd = peer_connect(&s->peer)) < 0)
+		return -1;
+	if(evloop_add(s->reconnect_src.loop, &s->link_src, fd, EPOLLOUT,
+		session_connected, s) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	s->connecting = 1;
+	return 0;
+}
+
+static int session_reconnect(struct evsrc *src, uint32_t events) {
+	struct session *s = src->arg;
+
+	if(s->ln->fd < 0)
+		session_up(s);
+	return 0;
+}
+
+/**
+ * Set up a session's link and timers in a loop, polling per schedule
+ * and with window requests in flight per port.  Call session_up() to
+ * connect, or arm reconnect_src.
+ */
+static int session_attach(struct session *s, struct evloop *loop,
+		const struct polls *schedule, int window) {
+	if(peer_resolve(&s->peer, s->host, s->port) < 0 ||
+		(s->ln = calloc(1, sizeof(*s->ln))) == NULL)
+		return -1;
+
+	s->ln->fd = -1;
+	s->ln->wait_out = session_wait_out;
+	s->ln->arg = s;
+	req_init(&s->ln->req);
+	if(window > 0)
+		s->ln->req.window = window < REQ_MAX_WINDOW? window: REQ_MAX_WINDOW;
+	s->ln->polls = *schedule;
+	if(s->mission)
+		s->ln->mission = *s->mission;
+
+	if(evloop_timer(loop, &s->keepalive_src,
+		KEEPALIVE_INTERVAL_MS * 1000000ull, session_keepalive, s) < 0 ||
+		evloop_timer(loop, &s->timeout_src, REQ_TICK_MS * 1000000ull,
+			session_timeouts, s) < 0 ||
+		evloop_oneshot(loop, &s->poll_src, session_poll, s) < 0 ||
+		evloop_oneshot(loop, &s->reconnect_src, session_reconnect, s) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void session_detach(struct session *s) {
+	int fd;
+
+	if(s->ln == NULL)
+		return;
+
+	if(s->ln->fd >= 0 || s->connecting) {
+		fd = s->link_src.fd;
+		evloop_del(&s->link_src);
+		close(fd);
+	}
+
+	evloop_del(&s->keepalive_src);
+	evloop_del(&s->timeout_src);
+	evloop_del(&s->poll_src);
+	evloop_del(&s->reconnect_src);
+	req_free(&s->ln->req);
+	free(s->ln);
+	s->ln = NULL;
+}
+
+static void session_stats(struct session *s, FILE *fp) {
+	if(s->id)
+		fprintf(fp, "* Session %s (%s:%s), %lu connects\n", s->name,
+			s->host, s->port, s->connects);
+	req_stats(&s->ln->req, fp);
+	poll_stats(&s->ln->polls, fp);
+	mission_stats(&s->ln->mission, fp);
+	state_print(s->id, fp);
+}
+
+/**
+ * Read up to max sessions from a config file along with their poll
+ * schedules.  Returns the number of sessions or -1 on errors.
+ */
+static int sessions_load(const char *path, struct session *sess,
+		struct polls *schedules, int max) {
+	char *line = NULL, name[32], addr[128], polls[256], *colon;
+	size_t size = 0;
+	int n = 0, lineno = 0, fields, ret = -1;
+	FILE *fp;
+
+	if((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "ERROR: Failed to open %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	while(getline(&line, &size, fp) > 0) {
+		lineno++;
+		fields = sscanf(line, " %31s %127s %255s", name, addr, polls);
+		if(fields <= 0 || name[0] == '#')
+			continue;
+		if(fields < 2) {
+			fprintf(stderr, "ERROR: %s:%d: Expected a name and an"
+				" address\n", path, lineno);
+			goto out;
+		}
+		if(n == max) {
+			fprintf(stderr, "ERROR: %s:%d: More than %d sessions\n",
+				path, lineno, max);
+			goto out;
+		}
+
+		memset(&sess[n], 0, sizeof(sess[n]));
+		memset(&schedules[n], 0, sizeof(schedules[n]));
+		sess[n].id = n + 1;
+		strcpy(sess[n].name, name);
+		snprintf(sess[n].port, sizeof(sess[n].port), "%d", SER2NET_PORT);
+
+		/* Address, host:port or [v6 address]:port */
+		colon = strrchr(addr, ':');
+		if(colon && (addr[0] != '[' || colon[-1] == ']')) {
+			*colon = 0;
+			snprintf(sess[n].port, sizeof(sess[n].port), "%s", colon + 1);
+		}
+		if(addr[0] == '[' && addr[strlen(addr) - 1] == ']') {
+			addr[strlen(addr) - 1] = 0;
+			memmove(addr, addr + 1, strlen(addr));
+		}
+		snprintf(sess[n].host, sizeof(sess[n].host), "%s", addr);
+
+		if(fields == 3 && poll_parse(&schedules[n], polls) < 0) {
+			fprintf(stderr, "ERROR: %s:%d: Invalid polls\n", path,
+				lineno);
+			goto out;
+		}
+
+		session_names[sess[n].id] = sess[n].name;
+		n++;
+	}
+
+	ret = n;
+out:
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+static int worker_stop(struct evsrc *src, uint32_t events) {
+	return 1;
+}
+
+/* Thread that runs the sessions of a worker until told to stop */
+static void *worker_run(void *arg) {
+	struct worker *w = arg;
+	int i;
+
+	out = w->sink;
+	for(i = 0; i < w->nsess; i++)
+		evloop_arm(&w->sess[i]->reconnect_src, 0);
+
+	evloop_run(&w->loop);
+	sink_flush(w->sink);
+	return NULL;
+}
+
+/**
+ * Run sessions on up to nthreads worker threads until SIGINT or SIGTERM.
+ * Sessions are dealt out round-robin.  Returns -1 if it couldn't start.
+ */
+static int sessions_run(struct session *sess, const struct polls *schedules,
+		int nsess, int nthreads, int window, int stats) {
+	struct worker *w, *wk;
+	sigset_t set;
+	int i, sig, nw;
+
+	nw = nthreads < 1? 1: nthreads > nsess? nsess: nthreads;
+	if((w = calloc(nw, sizeof(*w))) == NULL)
+		return -1;
+
+	for(i = 0; i < nw; i++) {
+		if(evloop_init(&w[i].loop) < 0 ||
+			(w[i].stopfd = eventfd(0, EFD_CLOEXEC)) < 0 ||
+			evloop_add(&w[i].loop, &w[i].stop_src, w[i].stopfd,
+				EPOLLIN, worker_stop, &w[i]) < 0 ||
+			(w[i].sess = calloc(nsess / nw + 1, sizeof(*w[i].sess))) == NULL ||
+			(w[i].sink = malloc(sizeof(*w[i].sink))) == NULL) {
+			fprintf(stderr, "ERROR: Failed to set up worker: %s\n",
+				strerror(errno));
+			return -1;
+		}
+
+		sink_share(w[i].sink, out);
+	}
+
+	for(i = 0; i < nsess; i++) {
+		wk = &w[i % nw];
+		wk->sess[wk->nsess++] = &sess[i];
+		if(session_attach(&sess[i], &wk->loop, &schedules[i], window) < 0) {
+			fprintf(stderr, "ERROR: Failed to set up session %s: %s\n",
+				sess[i].name, strerror(errno));
+			return -1;
+		}
+	}
+
+	/* Blocked in all threads, only this one waits for them */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	fprintf(stderr, "* Running %d sessions on %d threads\n", nsess, nw);
+	/* Workers take over, i.e with what's left of a CSV header */
+	sink_flush(out);
+	for(i = 0; i < nw; i++)
+		pthread_create(&w[i].thread, NULL, worker_run, &w[i]);
+
+	sigwait(&set, &sig);
+	for(i = 0; i < nw; i++)
+		eventfd_write(w[i].stopfd, 1);
+	for(i = 0; i < nw; i++)
+		pthread_join(w[i].thread, NULL);
+
+	for(i = 0; i < nsess; i++) {
+		if(stats)
+			session_stats(&sess[i], stderr);
+		session_detach(&sess[i]);
+	}
+
+	for(i = 0; i < nw; i++) {
+		close(w[i].stopfd);
+		evloop_free(&w[i].loop);
+		free(w[i].sess);
+		free(w[i].sink);
+	}
+
+	free(w);
+	return 0;
+}
+
+static int console_readable(struct evsrc *src, uint32_t events) {
+	struct session *s = src->arg;
+	char buf[256];
+
+	sink_flush(out);
+	if(s->ln->fd >= 0) {
+		if(read_console(stdin, s->ln) < 0)
+			session_down(s);
+	}
+	else if(fgets(buf, sizeof(buf), stdin) != NULL)
+		text_printf("* Not connected\n");
+
+	if(feof(stdin))
+		evloop_del(src);
+
+	return 0;
+}
+
+/* SIGINT or SIGTERM, leave the loop so that the session is wound down */
+static int console_signal(struct evsrc *src, uint32_t events) {
+	return 1;
+}
+
+/**
+ * Relay
+ *
+ * With -R [host:]port dji-phantom listens for the Vision app and sits
+ * between it and ser2net (-U, the aircraft by default), decoding what
+ * goes by.  Both directions are forwarded with splice() through a pipe,
+ * so the bytes never reach user space and nothing but the kernel stands
+ * between the app and the aircraft.  Before the pipe is drained into
+ * the other socket tee() copies its pages into a tap pipe, which another
+ * thread frames and decodes as usual.  The tap never holds forwarding
+ * up: should the decoder fall so far behind that its pipe fills, the
+ * bytes are dropped from the tap, counted, and the framer resyncs.
+ *
+ * One app connection is relayed at a time, upstream is connected when
+ * the app connects and closed with it.  The connect doesn't block the
+ * relay: the app isn't read from until it's done, and it's given up on
+ * after RELAY_CONNECT_MS.
+ */
+#define RELAY_CHUNK (64 << 10)
+#define RELAY_CONNECT_MS 5000
+/* Slack for the decoder, if the kernel allows */
+#define RELAY_TAP_SIZE (1 << 20)
+
+struct relay_dir {
+	const char *name;
+	int from, to;
+	int pipe[2];
+	/* Write end of the tap */
+	int tap;
+	/* Bytes in the pipe that the other end couldn't take yet */
+	size_t pending;
+	unsigned long long bytes, dropped;
+};
+
+struct relay {
+	struct evloop loop;
+	struct evsrc listen_src, app_src, up_src, signal_src, timeout_src;
+	const char *host, *port;
+	struct peer peer;
+	int app, up;
+	/* up_src is waiting for the connect to finish, app_src is unused */
+	int connecting;
+	/* App to aircraft and back */
+	struct relay_dir dir[2];
+	unsigned long connects;
+};
+
+/* The decoding end of the taps, in a thread of its own */
+struct relay_tap {
+	pthread_t thread;
+	struct evloop loop;
+	struct evsrc src[2];
+	struct framer rx[2];
+	int open;
+	struct sink *sink;
+};
+
+/* Move what's in the pipe to the other end, as much as it takes */
+static int relay_drain(struct relay_dir *d) {
+	ssize_t n;
+
+	while(d->pending > 0) {
+		n = splice(d->pipe[0], NULL, d->to, NULL, d->pending,
+			SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if(n < 0)
+			return errno == EAGAIN || errno == EINTR? 0: -1;
+		d->pending -= n;
+	}
+
+	return 0;
+}
+
+static int relay_pump(struct relay_dir *d) {
+	ssize_t n, t;
+
+	n = splice(d->from, NULL, d->pipe[1], NULL, RELAY_CHUNK,
+		SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if(n <= 0)
+		return n < 0 && (errno == EAGAIN || errno == EINTR)? 0: -1;
+
+	d->bytes += n;
+	/* The pipe was empty, so this copies what just came in */
+	t = tee(d->pipe[0], d->tap, n, SPLICE_F_NONBLOCK);
+	if(t < n)
+		d->dropped += n - (t < 0? 0: t);
+	d->pending = n;
+	return relay_drain(d);
+}
+
+/* Read whatever isn't stuck behind a full socket */
+static void relay_watch(struct relay *r) {
+	evloop_mod(&r->app_src, (r->dir[0].pending? 0: EPOLLIN) |
+		(r->dir[1].pending? EPOLLOUT: 0));
+	evloop_mod(&r->up_src, (r->dir[1].pending? 0: EPOLLIN) |
+		(r->dir[0].pending? EPOLLOUT: 0));
+}
+
+/* Close the app and upstream, if open */
+static void relay_close(struct relay *r) {
+	uint8_t buf[4096];
+	ssize_t n;
+	int i;
+
+	if(r->app < 0)
+		return;
+
+	if(!r->connecting)
+		evloop_del(&r->app_src);
+	evloop_del(&r->up_src);
+	close(r->app);
+	close(r->up);
+	r->app = r->up = -1;
+	for(i = 0; i < 2; i++) {
+		r->dir[i].from = r->dir[i].to = -1;
+		if(!r->connecting)
+			fprintf(stderr, "* Relay: %s %llu bytes, %llu not"
+				" decoded\n", r->dir[i].name, r->dir[i].bytes,
+				r->dir[i].dropped);
+		/* Anything left in the pipe belongs to the old connection */
+		while(r->dir[i].pending > 0 && (n = read(r->dir[i].pipe[0], buf,
+			r->dir[i].pending < sizeof(buf)? r->dir[i].pending:
+				sizeof(buf))) > 0)
+			r->dir[i].pending -= n;
+		r->dir[i].pending = 0;
+	}
+
+	r->connecting = 0;
+}
+
+static int relay_event(struct evsrc *src, uint32_t events) {
+	struct relay *r = src->arg;
+	struct relay_dir *in, *out;
+
+	in = &r->dir[src == &r->up_src];
+	out = &r->dir[src != &r->up_src];
+	errno = 0;
+	if((events & EPOLLOUT) && relay_drain(out) < 0)
+		goto fail;
+	/* Hung up while we were waiting to forward what it sent */
+	if((events & (EPOLLHUP|EPOLLERR)) && in->pending)
+		goto fail;
+	if((events & (EPOLLIN|EPOLLHUP|EPOLLERR)) && in->pending == 0 &&
+		relay_pump(in) < 0)
+		goto fail;
+
+	relay_watch(r);
+	return 0;
+
+fail:
+	fprintf(stderr, "* Relay: Connection closed (%s)\n",
+		errno? strerror(errno): "end of stream");
+	relay_close(r);
+	return 0;
+}
+
+/* Upstream connected, or failed to */
+static int relay_connected(struct evsrc *src, uint32_t events) {
+	struct relay *r = src->arg;
+	int one = 1, i;
+
+	if(!peer_connected(r->up)) {
+		fprintf(stderr, "* Relay: Failed to connect to %s:%s: %s\n",
+			r->host, r->port, strerror(errno));
+		relay_close(r);
+		return 0;
+	}
+
+	r->connecting = 0;
+	r->connects++;
+	setsockopt(r->app, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(r->up, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(r->app, F_SETFL, O_NONBLOCK);
+	r->dir[0].from = r->dir[1].to = r->app;
+	r->dir[0].to = r->dir[1].from = r->up;
+	for(i = 0; i < 2; i++)
+		r->dir[i].bytes = r->dir[i].dropped = 0;
+
+	fprintf(stderr, "* Relay: App connected, relaying to %s:%s\n",
+		r->host, r->port);
+	src->cb = relay_event;
+	if(evloop_mod(src, EPOLLIN) < 0 || evloop_add(&r->loop, &r->app_src,
+		r->app, EPOLLIN, relay_event, r) < 0) {
+		fprintf(stderr, "ERROR: Failed to watch relay: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int relay_timeout(struct evsrc *src, uint32_t events) {
+	struct relay *r = src->arg;
+
+	if(r->connecting) {
+		fprintf(stderr, "* Relay: Timed out connecting to %s:%s\n",
+			r->host, r->port);
+		relay_close(r);
+	}
+
+	return 0;
+}
+
+/* Take an app connection and start connecting upstream */
+static int relay_accept(struct evsrc *src, uint32_t events) {
+	struct relay *r = src->arg;
+	int fd;
+
+	if((fd = accept4(src->fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+		return 0;
+
+	if(r->app >= 0) {
+		fprintf(stderr, "* Relay: Already relaying, turning a"
+			" connection away\n");
+		close(fd);
+		return 0;
+	}
+
+	if((r->up = peer_connect(&r->peer)) < 0) {
+		fprintf(stderr, "* Relay: Failed to connect to %s:%s: %s\n",
+			r->host, r->port, strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	if(evloop_add(&r->loop, &r->up_src, r->up, EPOLLOUT, relay_connected,
+		r) < 0) {
+		fprintf(stderr, "ERROR: Failed to watch relay: %s\n",
+			strerror(errno));
+		close(r->up);
+		close(fd);
+		r->up = -1;
+		return -1;
+	}
+
+	r->app = fd;
+	r->connecting = 1;
+	evloop_arm(&r->timeout_src,
+		time_mono_ns() + RELAY_CONNECT_MS * 1000000ull);
+	return 0;
+}
+
+static int relay_signal(struct evsrc *src, uint32_t events) {
+	return 1;
+}
+
+static int relay_tap_readable(struct evsrc *src, uint32_t events) {
+	struct relay_tap *tap = src->arg;
+	struct framer *fr = &tap->rx[src == &tap->src[1]];
+	struct pkt pkt;
+
+	if(framer_fill(fr, src->fd) <= 0) {
+		evloop_del(src);
+		close(src->fd);
+		return --tap->open == 0;
+	}
+
+	while(framer_next(fr, &pkt) != NULL) {
+		flog_frame(&pkt, fr == &tap->rx[1]? FLOG_RX: FLOG_TX);
+		decode_packet(&pkt);
+	}
+
+	return 0;
+}
+
+static void *relay_tap_run(void *arg) {
+	struct relay_tap *tap = arg;
+
+	out = tap->sink;
+	evloop_run(&tap->loop);
+	sink_flush(tap->sink);
+	return NULL;
+}
+
+/* Relay between the app on listen and host:port until SIGINT or SIGTERM */
+static int relay_run(const char *listen, const char *host, const char *port) {
+	static struct relay r;
+	static struct relay_tap tap;
+	int i, fd, sfd, tp[2];
+	sigset_t set;
+
+	r.host = host;
+	r.port = port;
+	r.app = r.up = -1;
+	r.dir[0].name = "app to aircraft";
+	r.dir[1].name = "aircraft to app";
+	for(i = 0; i < 2; i++)
+		r.dir[i].from = r.dir[i].to = -1;
+	if(peer_resolve(&r.peer, host, port) < 0) {
+		fprintf(stderr, "ERROR: Failed to look up %s:%s\n", host, port);
+		return -1;
+	}
+
+	if((fd = listen_on(listen)) < 0) {
+		fprintf(stderr, "ERROR: Failed to listen on %s\n", listen);
+		return -1;
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	if((sfd = signalfd(-1, &set, SFD_CLOEXEC)) < 0 ||
+		evloop_init(&r.loop) < 0 || evloop_init(&tap.loop) < 0 ||
+		(tap.sink = malloc(sizeof(*tap.sink))) == NULL)
+		goto fail;
+
+	for(i = 0; i < 2; i++) {
+		if(pipe2(r.dir[i].pipe, O_CLOEXEC) < 0 ||
+			pipe2(tp, O_CLOEXEC|O_NONBLOCK) < 0)
+			goto fail;
+
+		fcntl(tp[1], F_SETPIPE_SZ, RELAY_TAP_SIZE);
+		r.dir[i].tap = tp[1];
+		framer_init(&tap.rx[i]);
+		if(evloop_add(&tap.loop, &tap.src[i], tp[0], EPOLLIN,
+			relay_tap_readable, &tap) < 0)
+			goto fail;
+	}
+
+	tap.open = 2;
+	if(evloop_add(&r.loop, &r.listen_src, fd, EPOLLIN, relay_accept,
+		&r) < 0 || evloop_add(&r.loop, &r.signal_src, sfd, EPOLLIN,
+			relay_signal, &r) < 0 ||
+		evloop_oneshot(&r.loop, &r.timeout_src, relay_timeout, &r) < 0)
+		goto fail;
+
+	/* The tap takes over the output */
+	sink_share(tap.sink, out);
+	sink_flush(out);
+	pthread_create(&tap.thread, NULL, relay_tap_run, &tap);
+	fprintf(stderr, "* Relay: Listening on %s\n", listen);
+	evloop_run(&r.loop);
+
+	relay_close(&r);
+	evloop_del(&r.timeout_src);
+	fprintf(stderr, "* Relay: %lu connections relayed\n", r.connects);
+	for(i = 0; i < 2; i++) {
+		close(r.dir[i].tap);
+		close(r.dir[i].pipe[0]);
+		close(r.dir[i].pipe[1]);
+	}
+	pthread_join(tap.thread, NULL);
+	free(tap.sink);
+	evloop_free(&tap.loop);
+	evloop_free(&r.loop);
+	close(sfd);
+	close(fd);
+	return 0;
+
+fail:
+	fprintf(stderr, "ERROR: Failed to set up relay: %s\n", strerror(errno));
+	return -1;
+}
+
+/**
+ * Replay
+ *
+ * With -T <capture> the aircraft's side of a recorded session is played
+ * back over a local TCP connection to a session of our own, which reads
+ * and decodes it as it would the aircraft: the same event loop, framer,
+ * request matching, decoders and output.  Frames go out when they were
+ * captured, -t times as fast, or with -t 0 as fast as the session takes
+ * them.  Captures are pcap or pcapng files, of which everything ser2net
+ * sent is replayed, or hex frames one per line as for -f, which have no
+ * timing and always go out flat out.
+ *
+ * The sending end is a thread of its own that writes whatever is due in
+ * one go, as ser2net would, and notes when each frame was written.  The
+ * time from then until the session has decoded the read that brought
+ * the frame's last byte in is its decode lag.  Also reported are how far
+ * behind schedule frames were written, the bytes queued in the kernel
+ * on either end, and frames that were sent but never decoded.  Nothing
+ * answers the session, so it doesn't say hello, poll or keep alive.
+ */
+#define REPLAY_CHUNK (16 << 10)
+
+struct replay_frame {
+	/* Offset just past the frame in the replayed stream */
+	size_t end;
+	/* Capture time and when it was written (monotonic), ns */
+	uint64_t ts, sent;
+};
+
+struct replay {
+	struct replay_frame *f;
+	int n, max;
+	/* Frames back to back */
+	uint8_t *data;
+	size_t size, alloc;
+	/* 1 for original timing, 0 for as fast as possible */
+	double speed;
+	int listen;
+	pthread_t thread;
+	/* Frames handed to the socket so far */
+	int nsent;
+	/* When the first frame was written and the last one read */
+	uint64_t start, stop;
+	/* Microseconds behind schedule, bytes not yet acknowledged */
+	struct hist late, outq;
+	/* The receiving end: frames accounted for and their lag */
+	int next;
+	struct hist lag, inq;
+	struct session s;
+};
+
+static int replay_add(void *arg, struct pkt *pkt) {
+	struct replay *rp = arg;
+	void *p;
+
+	if(rp->n == rp->max) {
+		rp->max = rp->max? rp->max * 2: 4096;
+		if((p = realloc(rp->f, rp->max * sizeof(*rp->f))) == NULL)
+			return -1;
+		rp->f = p;
+	}
+
+	if(rp->size + pkt->len > rp->alloc) {
+		rp->alloc = rp->alloc? rp->alloc * 2: 1 << 20;
+		if((p = realloc(rp->data, rp->alloc)) == NULL)
+			return -1;
+		rp->data = p;
+	}
+
+	memcpy(rp->data + rp->size, pkt->raw, pkt->len);
+	rp->size += pkt->len;
+	rp->f[rp->n].end = rp->size;
+	rp->f[rp->n].ts = pkt->ts;
+	rp->n++;
+	return 0;
+}
+
+/* Keep what the aircraft sent, with the time it was captured */
+static int replay_collect(void *arg, struct tcp_flow *flow, int dir,
+		uint64_t ts, struct pkt *pkt) {
+	if(dir != DIR_FROM_SERVER)
+		return 0;
+
+	pkt->ts = ts;
+	return replay_add(arg, pkt);
+}
+
+static int replay_load(struct replay *rp, const char *path) {
+	struct tcp_reasm ra;
+	FILE *fp;
+	int ret;
+
+	if(strcmp(path, "-")) {
+		if((fp = fopen(path, "r")) == NULL) {
+			fprintf(stderr, "ERROR: Failed to open %s: %s\n", path,
+				strerror(errno));
+			return -1;
+		}
+
+		if(!cap_sniff(fp)) {
+			ret = read_hex_stream(fp, replay_add, rp);
+			fclose(fp);
+			return ret;
+		}
+
+		fclose(fp);
+	}
+
+	tcp_reasm_init(&ra, SER2NET_PORT, replay_collect, rp);
+	ret = cap_read_file(path, &ra);
+	tcp_reasm_free(&ra);
+	return ret;
+}
+
+/* When frame i is due to be written */
+static uint64_t replay_due(const struct replay *rp, int i) {
+	if(rp->speed <= 0 || rp->f[i].ts <= rp->f[0].ts)
+		return rp->start;
+
+	return rp->start + (uint64_t)((rp->f[i].ts - rp->f[0].ts) / rp->speed);
+}
+
+/* The aircraft's end, in a thread of its own */
+static void *replay_send(void *arg) {
+	struct replay *rp = arg;
+	struct replay_frame *f = rp->f;
+	struct timespec t;
+	uint8_t scratch[4096];
+	uint64_t due, now, late;
+	size_t off = 0, len;
+	ssize_t ret;
+	int fd, i, j, one = 1, queued;
+
+	if((fd = accept4(rp->listen, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+		fprintf(stderr, "ERROR: accept() failed: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	rp->start = time_mono_ns();
+	for(i = 0; i < rp->n; i = j) {
+		if((due = replay_due(rp, i)) > time_mono_ns()) {
+			t.tv_sec = due / 1000000000;
+			t.tv_nsec = due % 1000000000;
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t,
+				NULL) == EINTR);
+		}
+
+		/* There's no one to answer whatever the session sends */
+		while(recv(fd, scratch, sizeof(scratch), MSG_DONTWAIT) > 0);
+
+		/* Everything that's due now goes out in one write */
+		now = time_mono_ns();
+		for(j = i; j < rp->n && f[j].end - off <= REPLAY_CHUNK &&
+			(due = replay_due(rp, j)) <= now; j++) {
+			f[j].sent = now;
+			late = (now - due) / 1000;
+			if(rp->speed > 0)
+				hist_add(&rp->late, late > UINT32_MAX? UINT32_MAX: late);
+		}
+
+		__atomic_store_n(&rp->nsent, j, __ATOMIC_RELEASE);
+		for(len = f[j - 1].end; off < len; off += ret) {
+			if((ret = write(fd, rp->data + off, len - off)) < 0) {
+				if(errno == EINTR) {
+					ret = 0;
+					continue;
+				}
+
+				fprintf(stderr, "ERROR: Replay: write() failed: %s\n",
+					strerror(errno));
+				goto out;
+			}
+		}
+
+		if(ioctl(fd, SIOCOUTQ, &queued) == 0)
+			hist_add(&rp->outq, queued);
+	}
+
+out:
+	/* Let the session read to the end and hang up */
+	shutdown(fd, SHUT_WR);
+	while(recv(fd, scratch, sizeof(scratch), 0) > 0);
+	close(fd);
+	return NULL;
+}
+
+/* The session's end, the live path and then the bookkeeping */
+static int replay_readable(struct evsrc *src, uint32_t events) {
+	struct session *s = src->arg;
+	struct replay *rp = (void *)((char *)s - offsetof(struct replay, s));
+	struct link *ln = s->ln;
+	uint64_t now, lag;
+	int n, queued;
+
+	session_readable(src, events);
+	if(ln->fd < 0)
+		return 1;
+
+	now = time_mono_ns();
+	n = __atomic_load_n(&rp->nsent, __ATOMIC_ACQUIRE);
+	while(rp->next < n && rp->f[rp->next].end <= ln->rx.bytes) {
+		lag = (now - rp->f[rp->next++].sent) / 1000;
+		hist_add(&rp->lag, lag > UINT32_MAX? UINT32_MAX: lag);
+	}
+
+	if(ioctl(ln->fd, FIONREAD, &queued) == 0)
+		hist_add(&rp->inq, queued);
+
+	rp->stop = now;
+	return 0;
+}
+
+static void replay_hist(FILE *fp, const char *what, const struct hist *h) {
+	if(h->count == 0)
+		return;
+
+	fprintf(fp, "  %-22s min %u p50 %u p90 %u p99 %u max %u avg %.0f\n",
+		what, h->min, hist_percentile(h, 50), hist_percentile(h, 90),
+		hist_percentile(h, 99), h->max, (double)h->sum / h->count);
+}
+
+static void replay_stats(const struct replay *rp, FILE *fp) {
+	const struct frame_stats *st = &rp->s.ln->rx.stats;
+	double took = (rp->stop - rp->start) / 1e9;
+
+	fprintf(fp, "* Replay: %d frames (%zu bytes) from %.2f s of capture"
+		" in %.2f s, %.0f frames/s\n", rp->n, rp->size,
+		(rp->f[rp->n - 1].ts - rp->f[0].ts) / 1e9, took,
+		took > 0? rp->n / took: 0);
+	fprintf(fp, "  %lu decoded, %ld dropped, %lu resyncs, %lu bad"
+		" checksums, %lu bytes skipped\n", st->frames,
+		(long)rp->n - (long)st->frames, st->resyncs, st->bad_cksum,
+		st->skipped);
+	replay_hist(fp, "Decode lag (us)", &rp->lag);
+	replay_hist(fp, "Behind schedule (us)", &rp->late);
+	replay_hist(fp, "Send queue (bytes)", &rp->outq);
+	replay_hist(fp, "Receive queue (bytes)", &rp->inq);
+}
+
+/* Replay a capture to a session at speed times the original pace */
+static int replay_run(const char *path, double speed, int stats) {
+	static struct replay rp;
+	static struct polls none;
+	struct session *s = &rp.s;
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+	struct evloop loop;
+	int ret;
+
+	if(replay_load(&rp, path) < 0)
+		return -1;
+	if(rp.n == 0) {
+		fprintf(stderr, "ERROR: No frames from the aircraft in %s\n", path);
+		return -1;
+	}
+
+	rp.speed = speed;
+	if((rp.listen = listen_on("127.0.0.1:0")) < 0 ||
+		getsockname(rp.listen, (struct sockaddr *)&ss, &sslen) < 0) {
+		fprintf(stderr, "ERROR: Failed to listen for the replay\n");
+		return -1;
+	}
+
+	strcpy(s->name, "replay");
+	strcpy(s->host, "127.0.0.1");
+	snprintf(s->port, sizeof(s->port), "%u",
+		ntohs(((struct sockaddr_in *)&ss)->sin_port));
+	if(evloop_init(&loop) < 0 || session_attach(s, &loop, &none, 0) < 0)
+		goto fail;
+
+	evloop_del(&s->keepalive_src);
+	pthread_create(&rp.thread, NULL, replay_send, &rp);
+	if((s->ln->fd = connect_to_ser2net(s->host, s->port)) < 0 ||
+		evloop_add(&loop, &s->link_src, s->ln->fd, EPOLLIN,
+			replay_readable, s) < 0)
+		goto fail;
+
+	framer_init(&s->ln->rx);
+	if(speed > 0)
+		fprintf(stderr, "* Replay: %d frames from %s at %gx\n", rp.n,
+			path, speed);
+	else
+		fprintf(stderr, "* Replay: %d frames from %s, flat out\n", rp.n,
+			path);
+
+	ret = evloop_run(&loop);
+	pthread_join(rp.thread, NULL);
+	sink_flush(out);
+	replay_stats(&rp, stderr);
+	if(stats)
+		session_stats(s, stderr);
+
+	session_detach(s);
+	evloop_free(&loop);
+	close(rp.listen);
+	free(rp.f);
+	free(rp.data);
+	return ret < 0? -1: 0;
+
+fail:
+	fprintf(stderr, "ERROR: Failed to set up replay: %s\n", strerror(errno));
+	return -1;
+}
+
+/**
+ * Protocol diff
+ *
+ * What dji-parse-wireshark-hexdump.php's update_packet_diff() does, for
+ * reverse engineering the commands nobody has decoded yet (0x03, 0x1b,
+ * 0x2d, 0x40, 0x44, 0x61, 0x70...), but for any number of frames.
+ * Frames are grouped by port, command and length, and for each payload
+ * byte of a group we keep the bits set in every frame (and) and in any
+ * frame (or), so the bits that changed are and ^ or, as well as the
+ * lowest and highest value and a histogram of values.  Bytes that never
+ * changed are printed as they are and the rest as .., like the PHP
+ * script did, followed by what each of the changing bytes was up to.
+ * The histogram of the first byte is the PHP script's subkey graph.
+ *
+ * The masks, minimums and maximums are updated 16 bytes at a time with
+ * the generic vector types, see btea_x4().  Memory doesn't grow with the
+ * number of frames: a group takes 1 KB per payload byte, for the
+ * histograms, and there are at most PDIFF_MAX_GROUPS of them, in all of
+ * the tables that share a budget (one per thread of a query, where a
+ * group started by two threads counts twice).  Merging moves groups
+ * rather than copying them.  Frames that don't fit in any group are
+ * counted and otherwise ignored.  Histogram counts stop at UINT32_MAX,
+ * which is flagged when printed.
+ */
+#define PDIFF_MAX_GROUPS 256
+#define PDIFF_SLOT_BITS 9
+#define PDIFF_SLOTS (1 << PDIFF_SLOT_BITS)
+#define PDIFF_VECS 16
+
+typedef uint8_t pdiff_v16 __attribute__((vector_size(16)));
+
+struct pdiff_group {
+	uint8_t port, cmd, len;
+	unsigned long frames;
+	/* Payload bits set in every frame and in any frame */
+	pdiff_v16 and[PDIFF_VECS], or[PDIFF_VECS];
+	pdiff_v16 min[PDIFF_VECS], max[PDIFF_VECS];
+	/* Value counts of each payload byte, len - 8 of them */
+	uint32_t hist[][256];
+};
+
+struct pdiff {
+	struct pdiff_group *groups[PDIFF_MAX_GROUPS];
+	int ngroups;
+	/* Groups left to start, shared with other tables, or NULL */
+	int *budget;
+	/* Index + 1 into groups by port, command and length */
+	uint16_t slot[PDIFF_SLOTS];
+	/* Frames that didn't fit in any group */
+	unsigned long dropped;
+};
+
+static pdiff_v16 pdiff_min(pdiff_v16 a, pdiff_v16 b) {
+	pdiff_v16 lt = (pdiff_v16)(a < b);
+
+	return (a & lt) | (b & ~lt);
+}
+
+static pdiff_v16 pdiff_max(pdiff_v16 a, pdiff_v16 b) {
+	pdiff_v16 gt = (pdiff_v16)(a > b);
+
+	return (a & gt) | (b & ~gt);
+}
+
+/* Slot of the group of frames of length len, or the empty one for it */
+static int pdiff_slot(const struct pdiff *pd, uint8_t port, uint8_t cmd,
+		uint8_t len) {
+	uint32_t key = port << 16 | cmd << 8 | len;
+	const struct pdiff_group *g;
+	int h;
+
+	for(h = key * 0x9e3779b1u >> (32 - PDIFF_SLOT_BITS); pd->slot[h];
+		h = (h + 1) % PDIFF_SLOTS) {
+		g = pd->groups[pd->slot[h] - 1];
+		if(g->port == port && g->cmd == cmd && g->len == len)
+			break;
+	}
+
+	return h;
+}
+
+/* Find the group of frames of length len, or start it */
+static struct pdiff_group *pdiff_group(struct pdiff *pd, uint8_t port,
+		uint8_t cmd, uint8_t len) {
+	struct pdiff_group *g;
+	size_t size;
+	int h;
+
+	h = pdiff_slot(pd, port, cmd, len);
+	if(pd->slot[h])
+		return pd->groups[pd->slot[h] - 1];
+
+	if(pd->ngroups == PDIFF_MAX_GROUPS || (pd->budget &&
+		(__atomic_load_n(pd->budget, __ATOMIC_RELAXED) <= 0 ||
+		__atomic_sub_fetch(pd->budget, 1, __ATOMIC_RELAXED) < 0)))
+		return NULL;
+
+	/* Rounded up to the alignment of the vectors */
+	size = (sizeof(*g) + (len - 8) * sizeof(g->hist[0]) + 15) & ~15ul;
+	if((g = aligned_alloc(16, size)) == NULL)
+		return NULL;
+
+	memset(g, 0, size);
+	g->port = port;
+	g->cmd = cmd;
+	g->len = len;
+	memset(g->and, 0xff, sizeof(g->and));
+	memset(g->min, 0xff, sizeof(g->min));
+
+	pd->groups[pd->ngroups++] = g;
+	pd->slot[h] = pd->ngroups;
+	return g;
+}
+
+static void pdiff_add(struct pdiff *pd, const struct pkt *pkt) {
+	struct pdiff_group *g;
+	pdiff_v16 v[PDIFF_VECS];
+	uint32_t *h;
+	int i, n = pkt->len - 8;
+
+	if(n < 0 || (g = pdiff_group(pd, pkt->port, pkt->cmd, pkt->len)) == NULL) {
+		pd->dropped++;
+		return;
+	}
+
+	/* Bytes past the payload are zero in every frame of the group */
+	if(n > 0) {
+		v[(n - 1) / 16] = (pdiff_v16){ 0 };
+		memcpy(v, pkt->data, n);
+	}
+
+	g->frames++;
+	for(i = 0; i < (n + 15) / 16; i++) {
+		g->and[i] &= v[i];
+		g->or[i] |= v[i];
+		g->min[i] = pdiff_min(g->min[i], v[i]);
+		g->max[i] = pdiff_max(g->max[i], v[i]);
+	}
+
+	/* Saturating */
+	for(i = 0; i < n; i++) {
+		h = &g->hist[i][pkt->data[i]];
+		*h += *h != UINT32_MAX;
+	}
+}
+
+/**
+ * Add what src has seen to dst and empty src.  Groups dst doesn't have
+ * yet are moved over, so merging allocates nothing.
+ */
+static void pdiff_merge(struct pdiff *dst, struct pdiff *src) {
+	struct pdiff_group *g, *s;
+	uint32_t sum;
+	int i, k, v, h;
+
+	dst->dropped += src->dropped;
+	for(k = 0; k < src->ngroups; k++) {
+		s = src->groups[k];
+		h = pdiff_slot(dst, s->port, s->cmd, s->len);
+		if(dst->slot[h] == 0 && dst->ngroups < PDIFF_MAX_GROUPS) {
+			dst->groups[dst->ngroups++] = s;
+			dst->slot[h] = dst->ngroups;
+			continue;
+		}
+
+		if(dst->slot[h] == 0) {
+			dst->dropped += s->frames;
+			free(s);
+			continue;
+		}
+
+		g = dst->groups[dst->slot[h] - 1];
+		g->frames += s->frames;
+		for(i = 0; i < PDIFF_VECS; i++) {
+			g->and[i] &= s->and[i];
+			g->or[i] |= s->or[i];
+			g->min[i] = pdiff_min(g->min[i], s->min[i]);
+			g->max[i] = pdiff_max(g->max[i], s->max[i]);
+		}
+
+		for(i = 0; i < s->len - 8; i++)
+			for(v = 0; v < 256; v++) {
+				sum = g->hist[i][v] + s->hist[i][v];
+				g->hist[i][v] = sum < s->hist[i][v]? UINT32_MAX:
+					sum;
+			}
+		free(s);
+	}
+
+	src->ngroups = 0;
+	memset(src->slot, 0, sizeof(src->slot));
+}
+
+static void pdiff_free(struct pdiff *pd) {
+	int i;
+
+	for(i = 0; i < pd->ngroups; i++)
+		free(pd->groups[i]);
+	pd->ngroups = 0;
+	memset(pd->slot, 0, sizeof(pd->slot));
+}
+
+/* By command, then port and length */
+static int pdiff_cmp(const void *a, const void *b) {
+	const struct pdiff_group *x = *(struct pdiff_group * const *)a;
+	const struct pdiff_group *y = *(struct pdiff_group * const *)b;
+
+	return (x->cmd << 16 | x->port << 8 | x->len) -
+		(y->cmd << 16 | y->port << 8 | y->len);
+}
+
+/* Byte i of a vector array */
+static uint8_t pdiff_byte(const pdiff_v16 *v, int i) {
+	return v[i / 16][i % 16];
+}
+
+static void pdiff_print(const struct pdiff *pd, FILE *fp) {
+	struct pdiff_group *sorted[PDIFF_MAX_GROUPS];
+	const struct pdiff_group *g;
+	const uint32_t *h;
+	uint8_t changed;
+	int i, k, v, n, values, top[3];
+
+	/* The groups themselves stay where the slots point */
+	memcpy(sorted, pd->groups, pd->ngroups * sizeof(*sorted));
+	qsort(sorted, pd->ngroups, sizeof(*sorted), pdiff_cmp);
+	for(k = 0; k < pd->ngroups; k++) {
+		g = sorted[k];
+		n = g->len - 8;
+		fprintf(fp, "[0x%02x] port 0x%02x %-7s len %3u, %lu frames\n",
+			g->cmd, g->port & 0x3f, g->port & 0x40? "reply": "request",
+			g->len, g->frames);
+
+		for(i = 0; i < n; i++) {
+			changed = pdiff_byte(g->and, i) ^ pdiff_byte(g->or, i);
+			if(i % 16 == 0)
+				fprintf(fp, "  %02x:", i);
+			if(changed)
+				fprintf(fp, " ..");
+			else
+				fprintf(fp, " %02x", pdiff_byte(g->and, i));
+			if(i % 16 == 15 || i == n - 1)
+				fprintf(fp, "\n");
+		}
+
+		for(i = 0; i < n; i++) {
+			changed = pdiff_byte(g->and, i) ^ pdiff_byte(g->or, i);
+			if(!changed)
+				continue;
+
+			h = g->hist[i];
+			top[0] = top[1] = top[2] = -1;
+			for(v = values = 0; v < 256; v++) {
+				if(h[v] == 0)
+					continue;
+
+				values++;
+				if(top[0] < 0 || h[v] > h[top[0]]) {
+					top[2] = top[1];
+					top[1] = top[0];
+					top[0] = v;
+				}
+				else if(top[1] < 0 || h[v] > h[top[1]]) {
+					top[2] = top[1];
+					top[1] = v;
+				}
+				else if(top[2] < 0 || h[v] > h[top[2]])
+					top[2] = v;
+			}
+
+			fprintf(fp, "  %02x: bits 0x%02x, %3d values 0x%02x..0x%02x,"
+				" most often", i, changed, values,
+				pdiff_byte(g->min, i), pdiff_byte(g->max, i));
+			for(v = 0; v < 3 && top[v] >= 0; v++)
+				fprintf(fp, " 0x%02x (%.1f%%)", top[v],
+					h[top[v]] * 100.0 / g->frames);
+			fprintf(fp, "%s\n", h[top[0]] == UINT32_MAX?
+				", counts saturated": "");
+		}
+	}
+
+	if(pd->dropped)
+		fprintf(fp, "%lu frames didn't fit in the %d groups and were"
+			" ignored\n", pd->dropped, PDIFF_MAX_GROUPS);
+}
+
+/**
+ * Capture queries
+ *
+ * -Q report scans the capture files given as arguments, pcap, pcapng,
+ * hex frames or frame logs (-L), on -j threads.  Files are handed out
+ * one at a time, the biggest first, so that a month of flights takes as
+ * long as the disks and cores allow rather than one file after the
+ * other and no thread is left with a long flight at the end.  Frames
+ * are picked with -q, which here also takes err=e5 (or err=any) for the
+ * 0xe_ statuses that filter_packet() reports, and -i, which hex frames
+ * pass as they carry no time, and go into one of these reports:
+ *
+ * records: the decoded records of the frames, as with -r, in any output
+ *          format.  Files are decoded at the same time, so records of
+ *          different files come out interleaved.
+ * counts:  frames, bytes and errors per port, direction and command and
+ *          how often each of the error statuses turned up
+ * battery: the lowest and highest voltage and charge 0x53 reported in
+ *          each file, one flight per file
+ * gs:      how often each ground station command was sent in 0x80/0x81
+ * diff:    which payload bytes and bits change, see struct pdiff
+ *
+ * Only records decodes frames, the other reports count the frames as
+ * they are, per thread, and add the counts up at the end.  Each thread
+ * decodes as a session of its own, numbered from 1, so the aircraft
+ * state of a session keeps a single writer.
+ */
+#define QUERY_MAX_THREADS 64
+
+enum query_report {
+	QUERY_RECORDS, QUERY_COUNTS, QUERY_BATTERY, QUERY_GS, QUERY_DIFF
+};
+
+static const char *query_reports[] = {
+	"records", "counts", "battery", "gs", "diff", NULL
+};
+
+struct query_count {
+	unsigned long frames, bytes, errors;
+};
+
+/* Kept by each thread, added up when they're done */
+struct query_totals {
+	unsigned long frames, matched;
+	/* By port, request or reply and command as in decoder_stats() */
+	struct query_count count[64][2][256];
+	/* Frames with status 0xe0 + i */
+	unsigned long status[32];
+	/* Ground station commands of 0x80 and 0x81 frames */
+	unsigned long gs[2][65536];
+};
+
+struct query_file {
+	const char *path;
+	off_t size;
+	int ret;
+	/* For -Q battery */
+	unsigned long power;
+	uint16_t mv_min, mv_max;
+	uint8_t charge_min, charge_max;
+};
+
+struct query {
+	int report;
+	const struct frame_filter *filter;
+	struct query_file *files;
+	/* Indexes into files, biggest first */
+	int *order;
+	int nfiles, next;
+	/* Diff groups the threads may still start between them */
+	int pdiff_budget;
+};
+
+struct query_thread {
+	struct query *q;
+	struct query_file *file;
+	struct query_totals *t;
+	struct pdiff *pd;
+	struct sink *sink;
+	pthread_t thread;
+	int id;
+};
+
+static int query_frame(struct query_thread *qt, const struct pkt *pkt,
+		int dir) {
+	const struct frame_filter *f = qt->q->filter;
+	struct query_totals *t = qt->t;
+	struct query_file *qf = qt->file;
+	struct query_count *c;
+	struct record r;
+	uint32_t buf[64];
+	uint16_t seq, cmd;
+
+	t->frames++;
+	/* Hex frames carry no time, -i doesn't apply to them */
+	if((pkt->ts && (pkt->ts < f->from || pkt->ts > f->to)) ||
+		!filter_match(f, pkt, dir))
+		return 0;
+
+	t->matched++;
+	switch(qt->q->report) {
+	case QUERY_RECORDS:
+		filter_packet(pkt);
+		decode_packet(pkt);
+		break;
+	case QUERY_COUNTS:
+		c = &t->count[pkt->port & 0x3f][pkt->port >> 6 & 1][pkt->cmd];
+		c->frames++;
+		c->bytes += pkt->len;
+		if(pkt->len > 8 && (pkt->data[0] & 0xe0) == 0xe0) {
+			c->errors++;
+			t->status[pkt->data[0] & 0x1f]++;
+		}
+		break;
+	case QUERY_BATTERY:
+		if(pkt->cmd != 0x53 || !(pkt->port & 0x40) || pkt->len != 8 + 16)
+			break;
+
+		power_record(pkt, &r);
+		if(qf->power++ == 0) {
+			qf->mv_min = qf->mv_max = r.u.power.millivolts;
+			qf->charge_min = qf->charge_max = r.u.power.charge;
+			break;
+		}
+
+		if(r.u.power.millivolts < qf->mv_min)
+			qf->mv_min = r.u.power.millivolts;
+		if(r.u.power.millivolts > qf->mv_max)
+			qf->mv_max = r.u.power.millivolts;
+		if(r.u.power.charge < qf->charge_min)
+			qf->charge_min = r.u.power.charge;
+		if(r.u.power.charge > qf->charge_max)
+			qf->charge_max = r.u.power.charge;
+		break;
+	case QUERY_GS:
+		if((pkt->cmd == 0x80 || pkt->cmd == 0x81) &&
+			gs_open(pkt, buf, &seq, &cmd) >= 0)
+			t->gs[pkt->cmd & 1][cmd]++;
+		break;
+	case QUERY_DIFF:
+		pdiff_add(qt->pd, pkt);
+		break;
 	}
 
-	freeaddrinfo(ai0);
-	return s;
+	return 0;
 }
 
-/* Send current time (cmd 0x20) to camera module at port 0x08 */
-static int init_camera_time_bcd(int fd) {
-        uint8_t buf[15], i;
-        time_t t;
-        struct tm *tm;
+static int query_capture_frame(void *arg, struct tcp_flow *flow, int dir,
+		uint64_t ts, struct pkt *pkt) {
+	return query_frame(arg, pkt, dir);
+}
 
-        time(&t);
-        tm = localtime(&t);
-        strftime((char *)buf, sizeof(buf), "%y20%m%d%H%M%S", tm);
-        for(i = 0; i < 7; i++) buf[i] = buf[2*i] << 4 | (buf[2*i+1] & 0x0f);
+/* Hex frames don't say which way they went, but replies come back */
+static int query_hex_frame(void *arg, struct pkt *pkt) {
+	return query_frame(arg, pkt, pkt->port & 0x40? DIR_FROM_SERVER:
+		DIR_TO_SERVER);
+}
+
+/* Frames of a frame log, straight from the segment */
+static int query_flog(struct query_thread *qt, const char *path) {
+	const uint8_t *seg, *p;
+	uint64_t wall0, mono0, ts, off;
+	struct pkt pkt;
+	size_t len;
+
+	if((seg = flog_map(path, &len)) == NULL || len < FLOG_HDRSZ) {
+		fprintf(stderr, "ERROR: Failed to read %s\n", path);
+		if(seg != NULL)
+			munmap((void *)seg, len);
+		return -1;
+	}
+
+	memcpy(&wall0, seg + 8, 8);
+	memcpy(&mono0, seg + 16, 8);
+	for(off = FLOG_HDRSZ; off + FLOG_FRAME_HDRSZ + 8 <= len;
+		off += FLOG_FRAME_HDRSZ + p[FLOG_FRAME_HDRSZ + 2]) {
+		p = seg + off;
+		/* Cut short by a crash */
+		if(p[FLOG_FRAME_HDRSZ + 2] < 8 ||
+			off + FLOG_FRAME_HDRSZ + p[FLOG_FRAME_HDRSZ + 2] > len)
+			break;
 
-        return send_packet(fd, 0x08, 0x20, buf, 7);
+		memcpy(&ts, p, 8);
+		pkt_view(&pkt, p + FLOG_FRAME_HDRSZ);
+		pkt.ts = ts - mono0 + wall0;
+		query_frame(qt, &pkt, p[8]);
+	}
+
+	munmap((void *)seg, len);
+	return 0;
 }
 
-/* For debugging purposes */
-static int read_console(FILE *source, int fd) {
-	char buf[256];
-	static uint8_t data, rec = 0;
-	static int cmd = 0x0100;
-	static int port = 0x08;
+static int query_file(struct query_thread *qt) {
+	const char *path = qt->file->path;
+	struct tcp_reasm ra;
+	char magic[8];
+	FILE *fp;
+	int ret;
 
-	fgets(buf, sizeof(buf), source);
-	switch(buf[0]) {
-	/* Port and command debugging */
-	case '\n':
-		printf("** Requesting 0x%02x00 at port 0x%02x\n", cmd, port);
-		data = 0;
-		if(send_packet(fd, port, cmd, &data, 1) < 0) return -1;
-		cmd++;
-		break;
-	case '8': port = 0x08; cmd = 0x01; break;
-	case 'A': port = 0x0a; cmd = 0x01; break;
-	case 'B': port = 0x0b; cmd = 0x01; break;
+	if((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "ERROR: Failed to open %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
 
-	/* Shortcuts */
-	case 'C':
-		printf("** Calibrating compass (0x9001)\n");
-		data = 0x01;
-		if(send_packet(fd, 0x0a, 0x90, &data, 1) < 0) return -1;
-		break;
-	case 'c':
-		printf("** Taking picture\n");
-		data = 0x01;
-		if(send_packet(fd, 0x08, 0x01, &data, 1) < 0) return -1;
-		break;
-	case 'b':
-		printf("** Sending command 0x1b00\n");
-		data = 0x00;
-		if(send_packet(fd, 0x0a, 0x1b, &data, 1) < 0) return -1;
-		break;
-	case 'd':
-		printf("** Sending command 0x2d00\n");
-		data = 0x00;
-		if(send_packet(fd, 0x0a, 0x2d, &data, 1) < 0) return -1;
-		break;
-	case 'r':
-		rec ^= 1;
-		printf("** %s recording\n",
-			rec? "Starting": "Stopping");
-		if(send_packet(fd, 0x08, 0x02, &rec, 1) < 0)
-			return -1;
-		break;
-	case '5':
-		printf("** Sending command 0x2500\n");
-		data = 0x00;
-		if(send_packet(fd, 0x0b, 0x25, &data, 1) < 0) return -1;
-		break;
-	case '0':
-		printf("*** Sending command 0x4000\n");
-		data = 0x00;
-		if(send_packet(fd, 0x08, 0x40, &data, 1) < 0) return -1;
-		break;
-	case '4':
-		printf("*** Sending command 0x4400\n");
-		data = 0x00;
-		if(send_packet(fd, 0x08, 0x44, &data, 1) < 0) return -1;
-		break;
-	case 'p':
-		printf("*** Sending command 0x32 (current position)\n");
-		data = 0x00;
-		if(send_packet(fd, 0x08, 0x32, &data, 1) < 0) return -1;
-		break;
-	case 'g':
-		printf("*** Sending command 0x4900 (GPS telemetry)\n");
-		data = 0x00;
-		if(send_packet(fd, 0x0a, 0x49, &data, 1) < 0) return -1;
-		break;
-	case 'f':
-		printf("*** Sending command 0x5200 (flight mode)\n");
-		data = 0x00;
-		if(send_packet(fd, 0x0a, 0x52, &data, 1) < 0) return -1;
+	if(fread(magic, 1, 8, fp) == 8 && !memcmp(magic, FLOG_MAGIC, 8)) {
+		fclose(fp);
+		return query_flog(qt, path);
+	}
+
+	rewind(fp);
+	if(!cap_sniff(fp)) {
+		ret = read_hex_stream(fp, query_hex_frame, qt);
+		fclose(fp);
+		return ret;
+	}
+
+	fclose(fp);
+	tcp_reasm_init(&ra, SER2NET_PORT, query_capture_frame, qt);
+	ra.deferred = 1;
+	ret = cap_read_file(path, &ra);
+	tcp_reasm_free(&ra);
+	return ret;
+}
+
+static void *query_thread_run(void *arg) {
+	struct query_thread *qt = arg;
+	struct query *q = qt->q;
+	int i;
+
+	out = qt->sink;
+	out_session = qt->id;
+	while((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) <
+		q->nfiles) {
+		qt->file = &q->files[q->order[i]];
+		qt->file->ret = query_file(qt);
+	}
+
+	sink_flush(out);
+	return NULL;
+}
+
+static struct query_file *query_sort_files;
+
+static int query_cmp_size(const void *a, const void *b) {
+	off_t x = query_sort_files[*(const int *)a].size;
+	off_t y = query_sort_files[*(const int *)b].size;
+
+	return x < y? 1: x > y? -1: 0;
+}
+
+static void query_report(const struct query *q, const struct query_totals *t,
+		FILE *fp) {
+	const struct query_file *qf;
+	const struct query_count *c;
+	int i, port, dir, cmd;
+
+	switch(q->report) {
+	case QUERY_COUNTS:
+		for(port = 0; port < 64; port++)
+		for(dir = 0; dir < 2; dir++)
+		for(cmd = 0; cmd < 256; cmd++) {
+			c = &t->count[port][dir][cmd];
+			if(c->frames == 0)
+				continue;
+
+			fprintf(fp, "[0x%02x] port 0x%02x %-7s %10lu frames %12lu"
+				" bytes %8lu errors (%.2f%%)\n", cmd, port,
+				dir == DIR_REQUEST? "request": "reply", c->frames,
+				c->bytes, c->errors, c->errors * 100.0 / c->frames);
+		}
+
+		for(i = 0; i < 32; i++)
+			if(t->status[i])
+				fprintf(fp, "status 0x%02x %10lu frames\n", 0xe0 + i,
+					t->status[i]);
 		break;
-	case '3':
-		printf("*** Sending command 0x5300\n");
-		data = 0x00;
-		if(send_packet(fd, 0x0a, 0x53, &data, 1) < 0) return -1;
+	case QUERY_BATTERY:
+		for(i = 0; i < q->nfiles; i++) {
+			qf = &q->files[i];
+			if(qf->ret < 0)
+				continue;
+			if(qf->power == 0) {
+				fprintf(fp, "%s: No battery status\n", qf->path);
+				continue;
+			}
+
+			fprintf(fp, "%s: %lu battery status, %u-%umV, charge"
+				" %u-%u%%\n", qf->path, qf->power, qf->mv_min,
+				qf->mv_max, qf->charge_min, qf->charge_max);
+		}
 		break;
-	default:
+	case QUERY_GS:
+		for(i = 0; i < 2; i++)
+			for(cmd = 0; cmd < 65536; cmd++)
+				if(t->gs[i][cmd])
+					fprintf(fp, "[0x%02x] GS command %-5u (0x%04x)"
+						" %10lu frames\n", 0x80 + i, cmd, cmd,
+						t->gs[i][cmd]);
 		break;
 	}
+}
 
-	return 0;
+/* Run the report over files on up to nthreads threads */
+static int query_run(const char *report, const struct frame_filter *filter,
+		char **paths, int npaths, int nthreads, int stats) {
+	struct query_thread qt[QUERY_MAX_THREADS];
+	struct query_totals *sum;
+	struct query q;
+	struct stat st;
+	uint64_t start;
+	unsigned long *a, *b;
+	size_t i, k;
+	int n, ret = 0;
+
+	memset(&q, 0, sizeof(q));
+	for(q.report = 0; query_reports[q.report] != NULL &&
+		strcmp(query_reports[q.report], report); q.report++);
+	if(query_reports[q.report] == NULL) {
+		fprintf(stderr, "ERROR: Unknown report '%s'\n", report);
+		return -1;
+	}
+
+	if(npaths == 0) {
+		fprintf(stderr, "ERROR: No capture files to query\n");
+		return -1;
+	}
+
+	q.filter = filter;
+	q.pdiff_budget = PDIFF_MAX_GROUPS;
+	q.files = calloc(npaths, sizeof(*q.files));
+	q.order = calloc(npaths, sizeof(*q.order));
+	if(q.files == NULL || q.order == NULL)
+		return -1;
+
+	for(i = 0; i < npaths; i++) {
+		if(stat(paths[i], &st) < 0) {
+			fprintf(stderr, "ERROR: Failed to open %s: %s\n", paths[i],
+				strerror(errno));
+			ret = -1;
+			continue;
+		}
+
+		q.files[q.nfiles].path = paths[i];
+		q.files[q.nfiles].size = st.st_size;
+		q.order[q.nfiles] = q.nfiles;
+		q.nfiles++;
+	}
+
+	query_sort_files = q.files;
+	qsort(q.order, q.nfiles, sizeof(*q.order), query_cmp_size);
+
+	if(nthreads > q.nfiles) nthreads = q.nfiles;
+	if(nthreads > QUERY_MAX_THREADS) nthreads = QUERY_MAX_THREADS;
+	if(nthreads < 1) nthreads = 1;
+
+	start = time_mono_ns();
+	/* Threads take over, i.e with what's left of a CSV header */
+	sink_flush(out);
+	for(n = 0; n < nthreads; n++) {
+		qt[n].q = &q;
+		qt[n].id = n + 1;
+		qt[n].t = calloc(1, sizeof(*qt[n].t));
+		qt[n].pd = calloc(1, sizeof(*qt[n].pd));
+		qt[n].sink = malloc(sizeof(*qt[n].sink));
+		if(qt[n].t == NULL || qt[n].pd == NULL || qt[n].sink == NULL) {
+			free(qt[n].t);
+			free(qt[n].pd);
+			free(qt[n].sink);
+			break;
+		}
+
+		qt[n].pd->budget = &q.pdiff_budget;
+		sink_share(qt[n].sink, out);
+		if(pthread_create(&qt[n].thread, NULL, query_thread_run, &qt[n])) {
+			free(qt[n].t);
+			free(qt[n].pd);
+			free(qt[n].sink);
+			break;
+		}
+	}
+
+	if(n == 0) {
+		fprintf(stderr, "ERROR: Failed to start query: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	for(k = 0; k < n; k++)
+		pthread_join(qt[k].thread, NULL);
+
+	sum = qt[0].t;
+	for(k = 1; k < n; k++) {
+		/* All counters, the structure is nothing but */
+		a = (unsigned long *)sum;
+		b = (unsigned long *)qt[k].t;
+		for(i = 0; i < sizeof(*sum) / sizeof(*a); i++)
+			a[i] += b[i];
+		pdiff_merge(qt[0].pd, qt[k].pd);
+	}
+
+	if(q.report == QUERY_DIFF)
+		pdiff_print(qt[0].pd, stdout);
+	else
+		query_report(&q, sum, stdout);
+	for(i = 0; i < q.nfiles; i++)
+		if(q.files[i].ret < 0)
+			ret = -1;
+
+	if(stats)
+		fprintf(stderr, "* Query: %d files, %lu frames read, %lu"
+			" matched, %d threads, %.3f s\n", q.nfiles, sum->frames,
+			sum->matched, n, (time_mono_ns() - start) / 1e9);
+
+	for(k = 0; k < n; k++) {
+		pdiff_free(qt[k].pd);
+		free(qt[k].t);
+		free(qt[k].pd);
+		free(qt[k].sink);
+	}
+
+	free(q.files);
+	free(q.order);
+	return ret;
+}
+
+#ifndef DJI_PHANTOM_NO_MAIN
+static void print_decoder_stats(void) {
+	decoder_stats(stderr);
+	arc_stats(stderr);
+}
+
+static void close_output(void) {
+	sink_close(out);
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "Usage: %s [-x <hex packet> ...] [-f <file>] [-r <capture file>]\n"
+		"       [-o <format>] [-w <output file>] [-F <ms>] [-W <n>]"
+		" [-p <schedule>]\n"
+		"       [-c <sessions file> [-j <threads>]] [-m <mission file> [-e]]\n"
+		"       [-P <shm name>] [-R [host:]port [-U host[:port]]]"
+		" [-T <capture> [-t <speed>]]\n"
+		"       [-A <archive>] [-a <archive> [-i <from>[,<to>]]]\n"
+		"       [-L <frame log>] [-l <frame log> [-q <filter>] [-i ...]]\n"
+		"       %s -Q <report> [-q <filter>] [-i ...] [-j <threads>]"
+		" <capture file> ...\n"
+		"       %s -K <hex frames> [-j <threads>]\n"
+		"  -x  Decode packets given as hex strings on the command line"
+		" (- for stdin)\n"
+		"  -f  Decode newline separated hex packets from a file\n"
+		"  -r  Decode the ser2net traffic in a pcap or pcapng file"
+		" (- for stdin)\n"
+		"  -K  Search for the checksum of 0x80/0x81 ground station frames\n"
+		"  -j  Number of threads to use (default: one per core)\n"
+		"  -o  Output format: text (default), json, csv or bin\n"
+		"  -w  Write output to a file instead of stdout\n"
+		"  -F  Flush output at most every <ms> milliseconds when live"
+		" (default: 0 for text, 1000 otherwise)\n"
+		"  -W  Requests in flight per port when live (default: %d)\n"
+		"  -p  Poll commands at given rates, i.e 49=20,53=1,52=5"
+		" ([port:]cmd=Hz, hex)\n"
+		"  -c  Connect to every aircraft listed in a file, one"
+		" \"name host[:port] [schedule]\"\n"
+		"      per line, tagging their output with the name\n"
+		"  -m  Upload the waypoints in a CSV or JSON file, as written"
+		" by -o csv/json\n"
+		"  -e  Print the mission's 0x80 frames as hex and exit\n"
+		"  -P  Publish telemetry to /dev/shm/<name>[.<session>] for"
+		" other processes,\n"
+		"      see dji-phantom-shm.h\n"
+		"  -R  Relay the Vision app connecting here to the aircraft,"
+		" decoding the traffic\n"
+		"  -U  Where to relay to (default: 192.168.1.1:%d)\n"
+		"  -T  Replay what the aircraft sent in a capture (or hex file)"
+		" to a live session\n"
+		"      over a local socket, reporting decode lag and drops\n"
+		"  -t  Replay speed, 1 for original timing (default), 10 for"
+		" ten times as fast,\n"
+		"      0 for as fast as it goes\n"
+		"  -A  Append telemetry and battery records to a compressed"
+		" archive\n"
+		"  -a  Read the records in an archive\n"
+		"  -i  Only records from <from> to <to>, in seconds since the"
+		" epoch\n"
+		"  -L  Log every frame sent and received to an indexed binary"
+		" file\n"
+		"  -l  Decode the frames in a frame log\n"
+		"  -q  Only frames matching port=,cmd= (hex), seq=, dir=tx|rx"
+		" and err=e0..ff|any,\n"
+		"      i.e cmd=81,dir=rx\n"
+		"  -Q  Query capture files or frame logs in parallel: records,"
+		" counts, battery,\n"
+		"      gs or diff (which payload bytes change)\n"
+		"  -s  Print decoder and request statistics on exit\n"
+		"  -v  Print unhandled packets\n",
+		argv0, argv0, argv0, REQ_WINDOW, SER2NET_PORT);
 }
 
 int main(int argc, char **argv) {
-	int fd, i, ret;
-	fd_set rfds;
-	struct timeval tv;
-	struct pkt *pkt;
-
-	for(i = 2; i < argc && !strcmp(argv[1], "-x"); i++) {
-		char *arg = argv[i];
-		/* Interpret args as entire packets in hex for debugging */
-		pkt = read_packet_from_hex_string(arg);
-		decode_packet(pkt);
-		if(i == argc - 1) return 0;
+	int c, i, ret, hex = 0;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *capture = NULL, *hexfile = NULL, *corpus = NULL;
+	const char *format = "text", *output = NULL, *config = NULL;
+	const char *mission_file = NULL, *publish = NULL, *relay = NULL;
+	const char *replay = NULL, *archive = NULL, *archive_in = NULL;
+	double speed = 1;
+	uint64_t from = 0, to = UINT64_MAX;
+	const char *frame_log = NULL, *frame_log_in = NULL, *report = NULL;
+	struct frame_filter filter = { -1, -1, -1, -1, -1, 0, UINT64_MAX };
+	char upstream[128] = "192.168.1.1", upstream_port[8], *colon;
+	int flush_ms = -1, window = 0, stats = 0, nsessions = 1, encode = 0;
+	FILE *fp;
+	struct evloop loop;
+	struct evsrc console_src, signal_src;
+	sigset_t set;
+	int sfd;
+	uint8_t frame[256];
+	struct pkt pkt;
+	struct session *s;
+	static struct session sessions[MAX_SESSIONS];
+	static struct polls schedules[MAX_SESSIONS], polls;
+	static struct mission mission;
+	static struct tcp_reasm ra;
+
+	register_builtin_decoders();
+	while((c = getopt(argc, argv, "xf:r:K:j:o:w:F:W:p:c:m:eP:R:U:T:t:A:a:i:L:l:q:Q:sv")) != -1) {
+		switch(c) {
+		case 'x':
+			hex = 1;
+			break;
+		case 'f':
+			hexfile = optarg;
+			break;
+		case 'r':
+			capture = optarg;
+			break;
+		case 'K':
+			corpus = optarg;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'o':
+			format = optarg;
+			break;
+		case 'w':
+			output = optarg;
+			break;
+		case 'F':
+			flush_ms = atoi(optarg);
+			break;
+		case 's':
+			atexit(print_decoder_stats);
+			stats = 1;
+			break;
+		case 'W':
+			window = atoi(optarg);
+			break;
+		case 'p':
+			if(poll_parse(&polls, optarg) < 0)
+				return -1;
+			break;
+		case 'c':
+			config = optarg;
+			break;
+		case 'm':
+			mission_file = optarg;
+			break;
+		case 'e':
+			encode = 1;
+			break;
+		case 'P':
+			publish = optarg;
+			break;
+		case 'R':
+			relay = optarg;
+			break;
+		case 'U':
+			snprintf(upstream, sizeof(upstream), "%s", optarg);
+			break;
+		case 'T':
+			replay = optarg;
+			break;
+		case 't':
+			if((speed = atof(optarg)) < 0) {
+				fprintf(stderr, "ERROR: Invalid replay speed %s\n",
+					optarg);
+				return -1;
+			}
+			break;
+		case 'A':
+			archive = optarg;
+			break;
+		case 'a':
+			archive_in = optarg;
+			break;
+		case 'i':
+			from = atof(optarg) * 1e9;
+			if((colon = strchr(optarg, ',')) != NULL)
+				to = atof(colon + 1) * 1e9;
+			break;
+		case 'L':
+			frame_log = optarg;
+			break;
+		case 'l':
+			frame_log_in = optarg;
+			break;
+		case 'q':
+			if(filter_parse(&filter, optarg) < 0)
+				return -1;
+			break;
+		case 'Q':
+			report = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
 	}
 
-	if((fd = connect_to_ser2net()) < 0) {
-		fprintf(stderr, "ERROR: Failed to connect to DJI Phantom\n");
+	if(corpus)
+		return crc_search(corpus, nthreads);
+
+	if(mission_file) {
+		if((ret = mission_load(mission_file, &mission)) <= 0) {
+			if(ret == 0)
+				fprintf(stderr, "ERROR: No waypoints in %s\n",
+					mission_file);
+			return -1;
+		}
+
+		if(encode) {
+			mission_print(&mission, stdout);
+			return 0;
+		}
+	}
+
+	schedules[0] = polls;
+	if(config) {
+		nsessions = sessions_load(config, sessions, schedules,
+			MAX_SESSIONS);
+		if(nsessions <= 0) {
+			if(nsessions == 0)
+				fprintf(stderr, "ERROR: No sessions in %s\n", config);
+			return -1;
+		}
+
+		/* -p applies to sessions without polls of their own */
+		for(i = 0; i < nsessions; i++)
+			if(schedules[i].n == 0)
+				schedules[i] = polls;
+		out->tagged = 1;
+	}
+
+	for(i = 0; i < nsessions; i++)
+		sessions[i].mission = mission_file? &mission: NULL;
+
+	if(publish) {
+		atexit(shm_unlink_all);
+		for(i = 0; i < nsessions; i++)
+			if(shm_ring_create(publish, sessions[i].id,
+				config? sessions[i].name: NULL) < 0)
+				return -1;
+	}
+
+	if(archive && report) {
+		fprintf(stderr, "ERROR: -A can't be used with -Q\n");
 		return -1;
 	}
 
-	printf("* Connected\n");
+	if(archive) {
+		if(arc_open(archive) < 0)
+			return -1;
+		atexit(arc_close);
+	}
 
-	/**
-	 * Not really sure what this does but the DJI Vision app sends
-	 * it on startup and I'm guessing it's either a "ping" or some
-	 * kind of synchronization message.
-	 */
-	if(send_packet(fd, 0x08, 0x04, (uint8_t *)"\x01", 1) < 0) return -1;
+	if(frame_log) {
+		if(flog_open(frame_log) < 0)
+			return -1;
+		atexit(flog_close);
+	}
 
- 	/**
-	 * The camera needs to be initialized with the current time before
-	 * a bunch of other commands start to work:
-	 * - 0x0101 (port 0x08) - take picture
-	 * - 0x2001 (port 0x08) - start recording
-	 * - 0x0200 (port 0x08) - stop recording
-	 *
-	 * If this command is not sent, a response with the following bytes
-	 * will be returned: 55 bb 09 48 03 00 e5 ff 48
-	 */
-	if(init_camera_time_bcd(fd) < 0) return -1;
+	if(flush_ms < 0)
+		flush_ms = strcmp(format, "text")? 1000: 0;
+	if(sink_open(out, output, format, flush_ms * 1000000ull) < 0)
+		return -1;
+	atexit(close_output);
 
-	FD_ZERO(&rfds);
-	for(;;) {
-		fflush(stdout);
-		FD_SET(fd, &rfds);
-		FD_SET(fileno(stdin), &rfds);
-		tv.tv_sec = 1;
-		tv.tv_usec = 500000;
-		if((ret = select(fd + 1, &rfds, NULL, NULL, &tv)) < 0) {
-			fprintf(stderr, "ERROR: select() failed: %s\n",
-				strerror(errno));
-			close(fd);
+	if(archive_in)
+		return arc_read(archive_in, from, to, stats);
+
+	if(frame_log_in) {
+		filter.from = from;
+		filter.to = to;
+		return flog_read(frame_log_in, &filter, stats);
+	}
+
+	if(report) {
+		filter.from = from;
+		filter.to = to;
+		return query_run(report, &filter, argv + optind, argc - optind,
+			nthreads, stats);
+	}
+
+	if(hexfile) {
+		if((fp = fopen(hexfile, "r")) == NULL) {
+			fprintf(stderr, "ERROR: Failed to open %s: %s\n",
+				hexfile, strerror(errno));
 			return -1;
 		}
 
-		if(ret == 0) {
-			/* Send something to prevent link from being closed */
-			if(send_packet(fd, 0x0a, 0x49, (uint8_t *)"", 1) < 0)
-				break;
-			if(send_packet(fd, 0x0a, 0x53, (uint8_t *)"", 1) < 0)
-				break;
-		}
+		ret = decode_hex_stream(fp);
+		fclose(fp);
+		return ret;
+	}
+
+	if(hex) {
+		for(i = optind; i < argc; i++) {
+			if(!strcmp(argv[i], "-")) {
+				decode_hex_stream(stdin);
+				continue;
+			}
 
-		if(FD_ISSET(fd, &rfds)) {
-			if((pkt = read_packet(fd)) == NULL) break;
-			if(decode_packet(pkt)) break;
+			/* Interpret args as entire packets in hex for debugging */
+			if(read_packet_from_hex_string(argv[i], strlen(argv[i]),
+					&pkt, frame) != NULL)
+				decode_packet(&pkt);
 		}
 
-		if(FD_ISSET(fileno(stdin), &rfds)) {
-			if(read_console(stdin, fd)) break;
+		return 0;
+	}
+
+	if(capture) {
+		tcp_reasm_init(&ra, SER2NET_PORT, cap_decode_frame, NULL);
+		ret = cap_read_file(capture, &ra);
+		tcp_reasm_free(&ra);
+		return ret;
+	}
+
+	if(replay)
+		return replay_run(replay, speed, stats) < 0? -1: 0;
+
+	if(relay) {
+		snprintf(upstream_port, sizeof(upstream_port), "%d", SER2NET_PORT);
+		if((colon = strrchr(upstream, ':')) != NULL) {
+			*colon = 0;
+			snprintf(upstream_port, sizeof(upstream_port), "%s",
+				colon + 1);
 		}
+
+		return relay_run(relay, upstream, upstream_port) < 0? -1: 0;
 	}
 
-	return 0;
+	if(config)
+		return sessions_run(sessions, schedules, nsessions, nthreads,
+			window, stats) < 0? -1: 0;
+
+	/* Just the one, with the console */
+	s = &sessions[0];
+	strcpy(s->name, "phantom");
+	strcpy(s->host, "192.168.1.1");
+	snprintf(s->port, sizeof(s->port), "%d", SER2NET_PORT);
+	/* It reconnects forever, signals are the way out */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	if((sfd = signalfd(-1, &set, SFD_CLOEXEC)) < 0 ||
+		evloop_init(&loop) < 0 ||
+		evloop_add(&loop, &signal_src, sfd, EPOLLIN, console_signal,
+			s) < 0 ||
+		session_attach(s, &loop, &schedules[0], window) < 0) {
+		fprintf(stderr, "ERROR: Failed to set up event loop: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	if(session_up(s) < 0) {
+		fprintf(stderr, "ERROR: Failed to connect to DJI Phantom\n");
+		return -1;
+	}
+
+	/**
+	 * Unbuffered so no commands hide in stdio where epoll can't see
+	 * them.  Fails for regular files, which isn't worth a warning.
+	 */
+	setvbuf(stdin, NULL, _IONBF, 0);
+	evloop_add(&loop, &console_src, fileno(stdin), EPOLLIN,
+		console_readable, s);
+
+	ret = evloop_run(&loop);
+	if(stats)
+		session_stats(s, stderr);
+	session_detach(s);
+	evloop_del(&signal_src);
+	close(sfd);
+	evloop_free(&loop);
+	return ret < 0? -1: 0;
 }
+#endif